@@ -0,0 +1,245 @@
+#!/bin/sh
+#
+# Converts synthetic SVN repositories of a few typical shapes and prints
+# revisions/s, peak RSS and the size of the fast-import stream for each, so
+# changes to the hot paths of svn2git can be compared without a mirror or
+# the network.  The repositories are generated as dump files and loaded with
+# svnadmin, nothing but svnadmin, svnlook, awk and git is needed.
+#
+# usage: benchmark.sh [-s scale] [-k] [-n] [svn-all-fast-export [shape ...]]
+#
+# Shapes are tiny (many one file commits), deep (a deep tree), branches
+# (many branches and tags), vendor (huge vendor imports) and mergeinfo
+# (heavy svn:mergeinfo), the default is all of them.  -s scales the number
+# of revisions and files, -k keeps the scratch directory.  -n converts each
+# shape a second time with --native-pack, in two runs that stop halfway
+# first, and checks that every ref ends up at the same object and that the
+# same commits are reachable as with git fast-import.
+
+set -e
+
+scale=1
+keep=
+native=
+while getopts "s:kn" OPT; do
+    case "$OPT" in
+        s) scale=$OPTARG ;;
+        k) keep=1 ;;
+        n) native=1 ;;
+        *) echo "usage: $0 [-s scale] [-k] [-n] [svn-all-fast-export [shape ...]]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+export LC_ALL=C
+tool=${1:-$PWD/svn2git/svn-all-fast-export}
+[ $# -gt 0 ] && shift
+shapes=${*:-tiny deep branches vendor mergeinfo}
+case "$tool" in
+    /*) ;;
+    *) tool=$PWD/$tool ;;
+esac
+
+scratch=`mktemp -d -t svn2git-bench.XXXXXX`
+trap '[ -n "$keep" ] || rm -rf "$scratch"' EXIT
+
+case `uname` in
+    FreeBSD) timeflags=-l ;;
+    *) timeflags=-v ;;
+esac
+
+# Writes an svn dump of the shape to stdout.  Every file is a few lines of
+# text that differ between revisions, so fast-import has real blobs to store.
+gendump() {
+    awk -v shape="$1" -v scale="$scale" '
+    function props(k, v) { return "K " length(k) "\n" k "\nV " length(v) "\n" v "\n" }
+    function revision(msg,    p) {
+        rev++
+        p = props("svn:author", "bench") props("svn:date", sprintf("2020-01-01T00:%02d:%02d.000000Z", int(rev / 60) % 60, rev % 60)) props("svn:log", msg) "PROPS-END\n"
+        printf "Revision-number: %d\nProp-content-length: %d\nContent-length: %d\n\n%s\n", rev, length(p), length(p), p
+    }
+    function mkdir(path) {
+        printf "Node-path: %s\nNode-kind: dir\nNode-action: add\nProp-content-length: 10\nContent-length: 10\n\nPROPS-END\n\n\n", path
+    }
+    function file(path, action,    t) {
+        t = sprintf("file %s\nrevision %d\n", path, rev)
+        printf "Node-path: %s\nNode-kind: file\nNode-action: %s\n", path, action
+        if (action == "add")
+            printf "Prop-content-length: 10\nText-content-length: %d\nContent-length: %d\n\nPROPS-END\n%s\n\n", length(t), length(t) + 10, t
+        else
+            printf "Text-content-length: %d\nContent-length: %d\n\n%s\n\n", length(t), length(t), t
+    }
+    function copy(from, to) {
+        printf "Node-path: %s\nNode-kind: dir\nNode-action: add\nNode-copyfrom-rev: %d\nNode-copyfrom-path: %s\n\n\n", to, rev - 1, from
+    }
+    function mergeinfo(path, v,    p) {
+        p = props("svn:mergeinfo", v) "PROPS-END\n"
+        printf "Node-path: %s\nNode-kind: dir\nNode-action: change\nProp-content-length: %d\nContent-length: %d\n\n%s\n\n", path, length(p), length(p), p
+    }
+    # a tree of depth levels with fanout subdirectories and files each
+    function tree(path, levels, fanout,    i) {
+        mkdir(path)
+        for (i = 0; i < fanout; i++)
+            file(path "/f" i, "add")
+        if (levels > 0)
+            for (i = 0; i < fanout; i++)
+                tree(path "/d" i, levels - 1, fanout)
+    }
+    BEGIN {
+        p = props("svn:date", "2020-01-01T00:00:00.000000Z") "PROPS-END\n"
+        printf "SVN-fs-dump-format-version: 2\n\nUUID: 00000000-0000-0000-0000-000000000000\n\n"
+        printf "Revision-number: 0\nProp-content-length: %d\nContent-length: %d\n\n%s\n", length(p), length(p), p
+        rev = 0
+
+        revision("layout")
+        mkdir("trunk"); mkdir("branches"); mkdir("tags"); mkdir("vendor")
+        for (i = 0; i < 10; i++)
+            file("trunk/README" i, "add")
+
+        if (shape == "tiny") {
+            for (n = 0; n < 20000 * scale; n++) {
+                revision("tiny " n)
+                file("trunk/README" n % 10, "change")
+            }
+        } else if (shape == "deep") {
+            revision("deep tree")
+            tree("trunk/deep", 6, 3)
+            for (n = 0; n < 2000 * scale; n++) {
+                revision("deep " n)
+                path = "trunk/deep"
+                for (l = 0; l < 6; l++)
+                    path = path "/d" int(rand() * 3)
+                file(path "/f" int(rand() * 3), "change")
+            }
+        } else if (shape == "branches") {
+            for (n = 0; n < 1000 * scale; n++) {
+                revision("branch " n)
+                copy("trunk", "branches/b" n)
+                revision("change on branch " n)
+                file("branches/b" n "/README" n % 10, "change")
+                revision("tag " n)
+                copy("branches/b" n, "tags/t" n)
+                revision("trunk " n)
+                file("trunk/README" n % 10, "change")
+            }
+        } else if (shape == "vendor") {
+            for (n = 0; n < 10 * scale; n++) {
+                revision("vendor import " n)
+                if (n == 0) {
+                    mkdir("vendor/big"); mkdir("vendor/big/dist")
+                }
+                for (d = 0; d < 50; d++) {
+                    if (n == 0)
+                        mkdir("vendor/big/dist/d" d)
+                    for (i = 0; i < 100; i++)
+                        file("vendor/big/dist/d" d "/f" i, n == 0 ? "add" : "change")
+                }
+                revision("tag vendor import " n)
+                copy("vendor/big/dist", "vendor/big/v" n)
+            }
+        } else if (shape == "mergeinfo") {
+            revision("branch")
+            copy("trunk", "branches/stable")
+            merged = ""
+            for (n = 0; n < 2000 * scale; n++) {
+                revision("trunk " n)
+                file("trunk/README" n % 10, "change")
+                revision("merge " n)
+                file("branches/stable/README" n % 10, "change")
+                # ranges with holes, so the mergeinfo does not collapse
+                merged = merged (n ? "," : "") rev - 1
+                mergeinfo("branches/stable", "/trunk:" merged)
+            }
+        } else {
+            print "unknown shape " shape > "/dev/stderr"
+            exit 1
+        }
+    }'
+}
+
+cat > "$scratch/bench.rules" <<EOF
+create repository bench
+end repository
+
+match /trunk/
+  repository bench
+  branch master
+end match
+
+match /branches/([^/]+)/
+  repository bench
+  branch \1
+end match
+
+match /tags/([^/]+)/
+  repository bench
+  branch refs/tags/\1
+end match
+
+match /vendor/([^/]+)/dist/
+  repository bench
+  branch vendor/\1/dist
+end match
+
+match /vendor/([^/]+)/([^/]+)/
+  repository bench
+  branch refs/tags/vendor/\1/\2
+end match
+
+match /
+end match
+EOF
+
+status=0
+printf "%-10s %9s %9s %10s %11s %15s\n" shape revisions seconds revs/s maxrss_kb fast_import_b
+for shape in $shapes; do
+    dir=$scratch/$shape
+    mkdir -p $dir
+    svnadmin create $dir/svn
+    gendump $shape | svnadmin load -q $dir/svn
+
+    (cd $dir && /usr/bin/time $timeflags -o time.out "$tool" --rules ../bench.rules \
+        --identity-domain example.org --metrics metrics.json --metrics-format json \
+        svn > convert.log 2>&1) || { echo "$shape: conversion failed, see $dir/convert.log" >&2; keep=1; continue; }
+
+    awk -v shape=$shape '
+        /"elapsed_seconds"/ { gsub(/[,]/, ""); secs = $2 }
+        /"revisions"/ { gsub(/[,]/, ""); revs = $2 }
+        /"fast_import_bytes"/ { gsub(/[,]/, ""); bytes += $2 }
+        FILENAME ~ /time.out$/ && /[Mm]ax.*resident/ { for (i = 1; i <= NF; i++) if ($i ~ /^[0-9]+$/) rss = $i }
+        END { printf "%-10s %9d %9.1f %10.1f %11d %15d\n", shape, revs, secs, secs > 0 ? revs / secs : 0, rss, bytes }
+    ' $dir/metrics.json $dir/time.out
+
+    [ -n "$native" ] || continue
+    # commit ids cover the trees, tag ids the commits, so equal refs mean
+    # the native packs hold the same history as fast-import made; the second
+    # run resumes from the packs and marks of the first
+    mkdir -p $dir/native
+    half=$((`svnlook youngest $dir/svn` / 2))
+    (cd $dir/native && "$tool" --native-pack --max-rev $half --rules ../../bench.rules \
+        --identity-domain example.org ../svn > convert.log 2>&1 &&
+        "$tool" --native-pack --rules ../../bench.rules \
+        --identity-domain example.org ../svn >> convert.log 2>&1) ||
+        { echo "$shape: --native-pack conversion failed, see $dir/native/convert.log" >&2; keep=1; status=1; continue; }
+    git -C $dir/bench for-each-ref --format='%(refname) %(objectname)' > $dir/refs.fast-import
+    git -C $dir/native/bench for-each-ref --format='%(refname) %(objectname)' > $dir/refs.native
+    git -C $dir/bench rev-list --all > $dir/commits.fast-import
+    git -C $dir/native/bench rev-list --all > $dir/commits.native
+    if ! cmp -s $dir/refs.fast-import $dir/refs.native; then
+        echo "$shape: --native-pack refs differ from git fast-import, see $dir/refs.*" >&2
+        keep=1
+        status=1
+    elif ! cmp -s $dir/commits.fast-import $dir/commits.native; then
+        echo "$shape: --native-pack commits differ from git fast-import, see $dir/commits.*" >&2
+        keep=1
+        status=1
+    elif ! git -C $dir/native/bench fsck --no-progress --no-dangling > $dir/native/fsck.log 2>&1; then
+        echo "$shape: --native-pack repository fails git fsck, see $dir/native/fsck.log" >&2
+        keep=1
+        status=1
+    else
+        echo "$shape: --native-pack matches git fast-import (`wc -l < $dir/refs.native` refs, `wc -l < $dir/commits.native` commits)"
+    fi
+done
+[ -n "$keep" ] && echo "scratch directory kept in $scratch"
+exit $status
@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# Converts an SVN repository once with git fast-import and once with
+# --native-pack, and fails unless every git repository the rules create
+# ends up with the same refs, pointing at the same objects, and the same
+# commits.  The --native-pack conversion is done in two runs, stopping
+# halfway first, so that resuming from its own packs and marks file is
+# checked as well.
+#
+# usage: compare_importers.sh [-k] svn-all-fast-export rules svn-repository [option ...]
+#
+# The options are handed to both conversions, --identity-domain or
+# --identity-map are needed.  -k keeps the scratch directory.
+
+set -e
+
+keep=
+while getopts "k" OPT; do
+    case "$OPT" in
+        k) keep=1 ;;
+        *) echo "usage: $0 [-k] svn-all-fast-export rules svn-repository [option ...]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -lt 3 ]; then
+    echo "usage: $0 [-k] svn-all-fast-export rules svn-repository [option ...]" >&2
+    exit 1
+fi
+
+abspath() {
+    case "$1" in
+        /*) echo "$1" ;;
+        *) echo "$PWD/$1" ;;
+    esac
+}
+
+export LC_ALL=C
+tool=`abspath "$1"`
+rules=`abspath "$2"`
+svn=`abspath "$3"`
+shift 3
+
+scratch=`mktemp -d -t svn2git-compare.XXXXXX`
+trap '[ -n "$keep" ] || rm -rf "$scratch"' EXIT
+
+youngest=`svnlook youngest "$svn"`
+mkdir $scratch/fast-import $scratch/native
+(cd $scratch/fast-import && "$tool" --rules "$rules" "$@" "$svn" > convert.log 2>&1) ||
+    { echo "git fast-import conversion failed, see $scratch/fast-import/convert.log" >&2; keep=1; exit 1; }
+(cd $scratch/native && "$tool" --native-pack --max-rev $((youngest / 2)) --rules "$rules" "$@" "$svn" > convert.log 2>&1 &&
+    "$tool" --native-pack --rules "$rules" "$@" "$svn" >> convert.log 2>&1) ||
+    { echo "--native-pack conversion failed, see $scratch/native/convert.log" >&2; keep=1; exit 1; }
+
+status=0
+for git in $scratch/fast-import/*/; do
+    repo=`basename $git`
+    git -C $git rev-parse --git-dir > /dev/null 2>&1 || continue
+    for importer in fast-import native; do
+        git -C $scratch/$importer/$repo for-each-ref --format='%(refname) %(objectname)' > $scratch/$repo.refs.$importer
+        git -C $scratch/$importer/$repo rev-list --all > $scratch/$repo.commits.$importer
+    done
+    if ! cmp -s $scratch/$repo.refs.fast-import $scratch/$repo.refs.native; then
+        echo "$repo: --native-pack refs differ from git fast-import:" >&2
+        diff $scratch/$repo.refs.fast-import $scratch/$repo.refs.native | head -20 >&2
+        status=1
+    elif ! cmp -s $scratch/$repo.commits.fast-import $scratch/$repo.commits.native; then
+        echo "$repo: --native-pack commits differ from git fast-import:" >&2
+        diff $scratch/$repo.commits.fast-import $scratch/$repo.commits.native | head -20 >&2
+        status=1
+    elif ! git -C $scratch/native/$repo fsck --no-progress --no-dangling > $scratch/$repo.fsck 2>&1; then
+        echo "$repo: --native-pack repository fails git fsck, see $scratch/$repo.fsck" >&2
+        status=1
+    else
+        echo "$repo: --native-pack matches git fast-import (`wc -l < $scratch/$repo.refs.native` refs, `wc -l < $scratch/$repo.commits.native` commits)"
+    fi
+done
+[ $status = 0 ] || keep=1
+[ -n "$keep" ] && echo "scratch directory kept in $scratch"
+exit $status
@@ -0,0 +1,88 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+/*
+ * Bump allocation for objects that all die together: the parse of a
+ * single ,v file, or everything that lives until the program is done.
+ * An arena is not locked; each one belongs to a single thread, or is
+ * used under its owner's lock.
+ */
+
+#include "cvs.h"
+
+#define ARENA_BLOCK	65536
+#define ARENA_ALIGN	16
+
+struct _arena_block {
+    struct _arena_block	*next;
+    size_t		size;
+    size_t		used;
+    char		data[] __attribute__ ((aligned (ARENA_ALIGN)));
+};
+
+void *
+arena_alloc (arena *a, size_t size)
+/* zeroed storage that lives until the arena is reset */
+{
+    arena_block	*b = a->blocks;
+    void	*p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if (!b || b->size - b->used < size) {
+	size_t	bsize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+
+	b = xmalloc (sizeof (arena_block) + bsize);
+	b->size = bsize;
+	b->used = 0;
+	b->next = a->blocks;
+	a->blocks = b;
+    }
+    p = b->data + b->used;
+    b->used += size;
+    memset (p, 0, size);
+    return p;
+}
+
+void
+arena_reset (arena *a)
+/* discard everything allocated, keeping one block to start over with */
+{
+    arena_block	*b, *n;
+
+    if (!a->blocks)
+	return;
+    for (b = a->blocks->next; b; b = n) {
+	n = b->next;
+	free (b);
+    }
+    a->blocks->next = NULL;
+    a->blocks->used = 0;
+}
+
+void
+arena_free (arena *a)
+/* discard everything allocated, and the arena's storage */
+{
+    arena_block	*b, *n;
+
+    for (b = a->blocks; b; b = n) {
+	n = b->next;
+	free (b);
+    }
+    a->blocks = NULL;
+}
+
+/* end */
@@ -17,69 +17,73 @@
  */
 
 #include "cvs.h"
-#include <stdint.h>
+#include <pthread.h>
 
-typedef uint32_t	crc32_t;
+typedef struct _hash_bucket {
+    unsigned int	crc;
+    char		string[0];
+} hash_bucket_t;
 
-static crc32_t crc32_table[256];
+/*
+ * Open addressing with linear probing, doubled whenever it is three
+ * quarters full.  Every log message and symbol goes through here, so
+ * the table has to keep up with the largest repositories.
+ */
+#define ATOM_INIT_SIZE	4096
 
-static void
-generate_crc32_table(void)
-{
-    crc32_t	c, p;
-    int		n, m;
+static hash_bucket_t	**buckets;
+static unsigned long	nbuckets, natoms;
 
-    p = 0xedb88320;
-    for (n = 0; n < 256; n++)
-    {
-	c = n;
-	for (m = 0; m < 8; m++)
-	    c = (c >> 1) ^ ((c & 1) ? p : 0);
-	crc32_table[n] = c;
-    }
-}
+/* the strings themselves, which are never freed one by one */
+static arena		atom_arena;
 
-static crc32_t
-crc32 (char *string)
+/* files are parsed on several threads, all of them interning strings */
+static pthread_mutex_t	atom_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+atom_grow (void)
 {
-    crc32_t		crc32 = ~0;
-    unsigned char	c;
+    hash_bucket_t	**old = buckets;
+    unsigned long	nold = nbuckets;
+    unsigned long	i, h;
 
-    if (crc32_table[1] == 0) generate_crc32_table ();
-    while ((c = (unsigned char) *string++))
-	crc32 = (crc32 >> 8) ^ crc32_table[(crc32 ^ c) & 0xff];
-    return ~crc32;
+    nbuckets = nbuckets ? nbuckets * 2 : ATOM_INIT_SIZE;
+    buckets = calloc (nbuckets, sizeof (hash_bucket_t *));
+    for (i = 0; i < nold; i++) {
+	if (!old[i])
+	    continue;
+	for (h = old[i]->crc & (nbuckets - 1); buckets[h]; h = (h + 1) & (nbuckets - 1))
+	    ;
+	buckets[h] = old[i];
+    }
+    free (old);
 }
 
-#define HASH_SIZE	9013	/* prime for netterr hash performance */
-
-typedef struct _hash_bucket {
-    struct _hash_bucket	*next;
-    crc32_t		crc;
-    char		string[0];
-} hash_bucket_t;
-
-static hash_bucket_t	*buckets[HASH_SIZE];
-
 char *
 atom (char *string)
 /* intern a string, avoiding having separate storage for duplicate copies */
 {
-    crc32_t		crc = crc32 (string);
-    hash_bucket_t	**head = &buckets[crc % HASH_SIZE];
+    unsigned int	crc;
+    unsigned long	h;
     hash_bucket_t	*b;
     int			len = strlen (string);
 
-    while ((b = *head)) {
-	if (b->crc == crc && !strcmp (string, b->string))
+    crc = hash_bytes (string, len);
+    pthread_mutex_lock (&atom_lock);
+    if ((natoms + 1) * 4 > nbuckets * 3)
+	atom_grow ();
+    for (h = crc & (nbuckets - 1); (b = buckets[h]); h = (h + 1) & (nbuckets - 1)) {
+	if (b->crc == crc && !strcmp (string, b->string)) {
+	    pthread_mutex_unlock (&atom_lock);
 	    return b->string;
-	head = &(b->next);
+	}
     }
-    b = malloc (sizeof (hash_bucket_t) + len + 1);
-    b->next = 0;
+    b = arena_alloc (&atom_arena, sizeof (hash_bucket_t) + len + 1);
     b->crc = crc;
     memcpy (b->string, string, len + 1);
-    *head = b;
+    buckets[h] = b;
+    natoms++;
+    pthread_mutex_unlock (&atom_lock);
     return b->string;
 }
 
@@ -87,14 +91,10 @@ void
 discard_atoms (void)
 /* empty all string buckets */
 {
-    hash_bucket_t	**head, *b;
-    int			i;
-
-    for (i = 0; i < HASH_SIZE; i++)
-	for (head = &buckets[i]; (b = *head);) {
-	    *head = b->next;
-	    free (b);
-	}
+    arena_free (&atom_arena);
+    free (buckets);
+    buckets = NULL;
+    nbuckets = natoms = 0;
 }
 
 /* end */
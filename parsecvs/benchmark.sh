@@ -0,0 +1,152 @@
+#!/bin/sh
+#
+# Converts synthetic RCS trees of a few typical shapes with parsecvs and
+# prints the time, peak RSS and size of the fast-export stream for each,
+# so changes to parsecvs can be compared without a CVS repository.  The
+# ,v files are written with awk, nothing else is needed.
+#
+# usage: benchmark.sh [-s scale] [-j jobs] [-k] [parsecvs [shape ...]]
+#
+# Shapes are wide (tens of thousands of files, each commit touching a
+# handful of them, some deleting one), tree (even more files, deep in a
+# source tree, and hundreds of authors) and history (a few hundred files
+# with long histories), the default is all of them.  -s scales the number of
+# files and commits, -j is handed to parsecvs, -k keeps the scratch
+# directory.
+
+set -e
+
+scale=1
+jobs=
+keep=
+while getopts "s:j:k" OPT; do
+    case "$OPT" in
+        s) scale=$OPTARG ;;
+        j) jobs="-j $OPTARG" ;;
+        k) keep=1 ;;
+        *) echo "usage: $0 [-s scale] [-j jobs] [-k] [parsecvs [shape ...]]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+export LC_ALL=C
+tool=${1:-$PWD/parsecvs}
+[ $# -gt 0 ] && shift
+shapes=${*:-wide tree history}
+case "$tool" in
+    /*) ;;
+    *) tool=$PWD/$tool ;;
+esac
+
+scratch=`mktemp -d -t parsecvs-bench.XXXXXX`
+trap '[ -n "$keep" ] || rm -rf "$scratch"' EXIT
+
+case `uname` in
+    FreeBSD) timeflags=-l ;;
+    *) timeflags=-v ;;
+esac
+
+# Writes the ,v files of the shape below $2.  Every file starts in one
+# import commit; after that each commit is ten minutes apart, more than
+# the default fuzz, and changes one line of the files it touches.  The
+# authors take turns.
+genrcs() {
+    awk -v shape="$1" -v root="$2" -v scale="$scale" '
+    # RCS dates for a number of seconds after 2001-01-01
+    function rcsdate(t,    d, y, m, ml) {
+        split("31 28 31 30 31 30 31 31 30 31 30 31", ml)
+        d = int(t / 86400)
+        for (y = 2001; d >= 365 + (y % 4 == 0); y++)
+            d -= 365 + (y % 4 == 0)
+        ml[2] = 28 + (y % 4 == 0)
+        for (m = 1; d >= ml[m]; m++)
+            d -= ml[m]
+        t %= 86400
+        return sprintf("%04d.%02d.%02d.%02d.%02d.%02d", y, m, d + 1, int(t / 3600), int(t / 60) % 60, t % 60)
+    }
+    function touch(f, k, dead) {
+        if (f in gone || (k, f) in touched)
+            return
+        touched[k, f] = 1
+        nrev[f]++
+        when[f, nrev[f]] = k
+        if (dead)
+            gone[f] = nrev[f]
+    }
+    function writefile(f,    path, n, r, s) {
+        path = root "/" dirs[f % ndirs] "/f" f ".c,v"
+        n = nrev[f] + 1
+        printf "head\t1.%d;\naccess;\nsymbols;\nlocks; strict;\ncomment\t@# @;\n\n\n", n > path
+        for (r = n; r > 0; r--) {
+            s = (f in gone && gone[f] + 1 == r) ? "dead" : "Exp"
+            printf("1.%d\ndate\t%s;\tauthor %s;\tstate %s;\nbranches;\nnext\t%s;\n\n", r,
+                rcsdate(when[f, r - 1] * 600), "dev" when[f, r - 1] % nauthors, s,
+                r > 1 ? "1." (r - 1) : "") > path
+        }
+        printf "\ndesc\n@@\n\n" > path
+        for (r = n; r > 0; r--) {
+            printf("\n1.%d\nlog\n@%s\n@\ntext\n@", r, r > 1 ? "change " when[f, r - 1] : "import") > path
+            if (r == n)
+                printf "file %d\nrevision %d\n", f, r > path
+            else
+                printf "d2 1\na2 1\nrevision %d\n", r > path
+            printf "@\n\n" > path
+        }
+        close(path)
+    }
+    BEGIN {
+        if (shape == "wide") {
+            nfiles = 20000 * scale; ndirs = 200 * scale; ncommits = 2000 * scale; per = 5
+        } else if (shape == "tree") {
+            nfiles = 50000 * scale; ndirs = 2500 * scale; ncommits = 1000 * scale; per = 10
+        } else if (shape == "history") {
+            nfiles = 200 * scale; ndirs = 10; ncommits = 500 * scale; per = 20
+        } else {
+            print "unknown shape " shape > "/dev/stderr"
+            exit 1
+        }
+        nauthors = 10
+        if (shape == "tree") {
+            # src/sys/dev/... and the like, three levels below the top
+            split("bin sbin lib libexec usr.bin usr.sbin sys contrib crypto share", top)
+            nauthors = 400
+        }
+        for (d = 0; d < ndirs; d++) {
+            dirs[d] = shape == "tree" ? top[d % 10 + 1] "/module" int(d / 10) % 50 "/src" d : "d" d
+            print root "/" dirs[d] | "xargs mkdir -p"
+        }
+        close("xargs mkdir -p")
+        for (f = 0; f < nfiles; f++)
+            when[f, 0] = 0
+        for (k = 1; k <= ncommits; k++)
+            for (i = 0; i < per; i++)
+                touch((k * 7919 + i * 104729) % nfiles, k, i == 0 && k % 50 == 0)
+        for (f = 0; f < nfiles; f++)
+            writefile(f)
+    }'
+}
+
+printf "%-10s %7s %8s %9s %10s %11s %13s\n" shape files commits seconds commits/s maxrss_kb stream_bytes
+for shape in $shapes; do
+    dir=$scratch/$shape
+    mkdir -p $dir/rcs
+    genrcs $shape $dir/rcs
+
+    (cd $dir && find rcs -name '*,v' | /usr/bin/time $timeflags -o time.out \
+        "$tool" $jobs > stream 2> convert.log) ||
+        { echo "$shape: conversion failed, see $dir/convert.log" >&2; keep=1; continue; }
+
+    files=`find $dir/rcs -name '*,v' | wc -l`
+    commits=`grep -c '^commit ' $dir/stream || true`
+    bytes=`wc -c < $dir/stream`
+    awk -v shape=$shape -v files=$files -v commits=$commits -v bytes=$bytes '
+        # GNU time: "Elapsed (wall clock) time (h:mm:ss or m:ss): 0:01.23"
+        /Elapsed/ { n = split($NF, t, ":"); secs = 0; for (i = 1; i <= n; i++) secs = secs * 60 + t[i] }
+        # BSD time: "        1.23 real         1.00 user ..."
+        $2 == "real" { secs = $1 }
+        /[Mm]ax.*resident/ { for (i = 1; i <= NF; i++) if ($i ~ /^[0-9]+$/) rss = $i }
+        END { printf("%-10s %7d %8d %9.2f %10.1f %11d %13d\n", shape, files, commits, secs,
+                secs > 0 ? commits / secs : 0, rss, bytes) }
+    ' $dir/time.out
+done
+[ -n "$keep" ] && echo "scratch directory kept in $scratch"
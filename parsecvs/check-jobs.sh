@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Converts the ,v files below a CVS repository directory once with a single
+# job and once with several, and fails unless the two fast-export streams
+# are identical.  parsecvs parses the files on several threads but has to
+# write the same marks, blobs, commits and tags as it does on one.
+#
+# usage: check-jobs.sh [-j jobs] [-k] [parsecvs] directory
+#
+# -j is the number of jobs compared with -j 1, 4 by default, -k keeps the
+# scratch directory with both streams and the logs.
+
+set -e
+
+jobs=4
+keep=
+while getopts "j:k" OPT; do
+    case "$OPT" in
+        j) jobs=$OPTARG ;;
+        k) keep=1 ;;
+        *) echo "usage: $0 [-j jobs] [-k] [parsecvs] directory" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+export LC_ALL=C
+case $# in
+    1) tool=$PWD/parsecvs; tree=$1 ;;
+    2) tool=$1; tree=$2 ;;
+    *) echo "usage: $0 [-j jobs] [-k] [parsecvs] directory" >&2; exit 1 ;;
+esac
+case "$tool" in
+    /*) ;;
+    *) tool=$PWD/$tool ;;
+esac
+[ -d "$tree" ] || { echo "$0: $tree is not a directory" >&2; exit 1; }
+
+scratch=`mktemp -d -t parsecvs-jobs.XXXXXX`
+trap '[ -n "$keep" ] || rm -rf "$scratch"' EXIT
+
+# The file names are handed over relative to the tree and sorted, so both
+# runs, and runs on different machines, see them in the same order.
+(cd "$tree" && find . -name '*,v' | sed 's:^\./::' | sort) > $scratch/files
+[ -s $scratch/files ] || { echo "$0: no ,v files below $tree" >&2; exit 1; }
+
+for j in 1 $jobs; do
+    (cd "$tree" && "$tool" -j $j < $scratch/files > $scratch/stream.$j 2> $scratch/log.$j) ||
+        { echo "-j $j: conversion failed, see $scratch/log.$j" >&2; keep=1; exit 1; }
+done
+
+files=`wc -l < $scratch/files`
+commits=`grep -c '^commit ' $scratch/stream.1 || true`
+if cmp -s $scratch/stream.1 $scratch/stream.$jobs; then
+    echo "$files files, $commits commits: -j 1 and -j $jobs give identical streams"
+else
+    echo "$files files, $commits commits: -j 1 and -j $jobs differ:" >&2
+    diff $scratch/stream.1 $scratch/stream.$jobs | head -20 >&2
+    keep=1
+    echo "scratch directory kept in $scratch" >&2
+    exit 1
+fi
+[ -n "$keep" ] && echo "scratch directory kept in $scratch"
+exit 0
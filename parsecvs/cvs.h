@@ -51,7 +51,6 @@ struct _cvs_patch;
 struct _rev_file;
 
 typedef struct node {
-	struct node *hash_next;
 	cvs_number number;
 	struct _cvs_version *v;
 	struct _cvs_patch *p;
@@ -115,7 +114,6 @@ typedef struct _rev_file {
     time_t		date;
     int                 mark;
     mode_t		mode;
-    struct _rev_file	*link;
 } rev_file;
 
 typedef struct _rev_dir {
@@ -186,6 +184,49 @@ typedef struct _rev_diff {
     int			nadd;
 } rev_diff;
 
+typedef struct _arena_block arena_block;
+
+/*
+ * Storage handed out in order and only given back all at once
+ */
+typedef struct _arena {
+    arena_block		*blocks;
+} arena;
+
+/*
+ * A tag seen in a file, kept until the file's turn comes in
+ * the order the files were given
+ */
+typedef struct _cvs_tag_ref {
+    struct _cvs_tag_ref	*next;
+    rev_commit		*commit;
+    char		*name;
+} cvs_tag_ref;
+
+/*
+ * Everything that belongs to a single ,v file while it is parsed and
+ * its revisions are expanded, so that several files can be worked
+ * on at once
+ */
+typedef struct _cvs_context {
+    char		*name;
+    cvs_file		*file;
+    void		*scanner;	/* the reentrant lexer */
+    arena		*arena;		/* the file, its versions, patches and nodes */
+    Node		**table;	/* open addressing, size a power of two */
+    int			size, entries;
+    Node		*head_node;
+    time_t		skew_vulnerable;
+    rev_list		*rl;
+    int			nversions;
+    cvs_tag_ref		*tags, **tags_tail;
+    bool		queue_blobs;	/* blobs wait in blobs until written */
+    char		*blobs;
+    size_t		nblobs, sblobs;
+    FILE		*spill;		/* and in here, past QUEUED_BLOB_MEMORY */
+    bool		done;
+} cvs_context;
+
 typedef struct _cvs_author {
     struct _cvs_author	*next;
     char		*name;
@@ -198,11 +239,7 @@ cvs_author * fullname (char *);
 
 int load_author_map (char *);
 
-extern cvs_file     *this_file;
-
-int yyparse (void);
-
-extern char *yyfilename;
+int yyparse (void *scanner, cvs_context *ctx);
 
 char *
 ctime_nonl (time_t *date);
@@ -211,19 +248,25 @@ cvs_number
 lex_number (char *);
 
 time_t
-lex_date (cvs_number *n);
+lex_date (cvs_number *n, cvs_context *ctx);
 
 char *
-lex_text (void);
+lex_text (void *scanner);
+
+bool
+lex_open (cvs_context *ctx);
+
+void
+lex_close (cvs_context *ctx);
 
 rev_list *
-rev_list_cvs (cvs_file *cvs);
+rev_list_cvs (cvs_context *ctx);
 
 rev_list *
 rev_list_merge (rev_list *lists);
 
 void
-rev_list_free (rev_list *rl, int free_files);
+rev_list_free (rev_list *rl);
 
 enum { Ncommits = 256 };
 
@@ -245,7 +288,7 @@ typedef struct _tag {
 } Tag;
 
 extern Tag *all_tags;
-void tag_commit(rev_commit *c, char *name);
+void tag_commit(rev_commit *c, char *name, char *filename);
 rev_commit **tagged(Tag *tag);
 void discard_tags(void);
 
@@ -333,14 +376,18 @@ dump_rev_graph (rev_list *rl, char *title);
 void
 dump_rev_tree (rev_list *rl);
 
-extern int yylex (void);
-
 char *
 atom (char *string);
 
 void
 discard_atoms (void);
 
+unsigned int
+hash_bytes (const void *data, size_t len);
+
+void
+sha1_blob (const void *data, unsigned long len, unsigned char *sha1);
+
 rev_ref *
 rev_list_add_head (rev_list *rl, rev_commit *commit, char *name, int degree);
 
@@ -363,10 +410,7 @@ rev_file *
 rev_file_rev (char *name, cvs_number *n, time_t date);
 
 void
-rev_file_free (rev_file *f);
-
-void
-rev_head_free (rev_ref *heads, int free_files);
+rev_head_free (rev_ref *heads);
 
 void
 rev_list_set_tail (rev_list *rl);
@@ -383,18 +427,27 @@ rev_list_validate (rev_list *rl);
 #define time_compare(a,b) ((long) (a) - (long) (b))
 
 void 
-export_blob(Node *node, void *buf, unsigned long len);
+export_blob(cvs_context *ctx, Node *node, void *buf, unsigned long len);
+
+void
+export_queued_blobs(cvs_context *ctx);
 
 void
 export_init(void);
 
+bool
+export_load_blob_marks(const char *path);
+
+bool
+export_save_blob_marks(const char *path);
+
 bool
 export_commits (rev_list *rl, int strip);
 
 void
 free_author_map (void);
 
-void generate_files(cvs_file *cvs, void (*hook)(Node *node, void *buf, unsigned long len));
+void generate_files(cvs_context *ctx, void (*hook)(cvs_context *ctx, Node *node, void *buf, unsigned long len));
 
 rev_dir **
 rev_pack_files (rev_file **files, int nfiles, int *ndr);
@@ -417,12 +470,23 @@ xmalloc(size_t size);
 void* 
 xrealloc(void *ptr, size_t size);
 
-void hash_version(cvs_version *);
-void hash_patch(cvs_patch *);
-void hash_branch(cvs_branch *);
-void clean_hash(void);
-void build_branches(void);
-extern Node *head_node;
+void *
+arena_alloc (arena *a, size_t size);
+
+void
+arena_reset (arena *a);
+
+void
+arena_free (arena *a);
+
+void *
+rev_alloc (size_t size);
+
+void hash_version(cvs_context *, cvs_version *);
+void hash_patch(cvs_context *, cvs_patch *);
+void hash_branch(cvs_context *, cvs_branch *);
+void clean_hash(cvs_context *);
+void build_branches(cvs_context *);
 
 extern time_t skew_vulnerable;
 
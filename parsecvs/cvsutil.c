@@ -254,65 +254,16 @@ cvs_is_vendor (cvs_number *number)
     return 1;
 }
 
-static void
-cvs_symbol_free (cvs_symbol *symbol)
-/* discard a symbol and its storage */
-{
-    cvs_symbol	*s;
-
-    while ((s = symbol)) {
-	symbol = s->next;
-	free (s);
-    }
-}
-
-static void
-cvs_branch_free (cvs_branch *branch)
-/* discard a branch and its storage */
-{
-    cvs_branch	*b;
-
-    while ((b = branch)) {
-	branch = b->next;
-	free (b);
-    }
-}
-
-static void
-cvs_version_free (cvs_version *version)
-/* discard a version and its storage */
-{
-    cvs_version	*v;
-
-    while ((v = version)) {
-	version = v->next;
-	cvs_branch_free (v->branches);
-	free (v);
-    }
-}
-
-static void
-cvs_patch_free (cvs_patch *patch)
-/* discard a patch and its storage */
-{
-    cvs_patch	*v;
-
-    while ((v = patch)) {
-	patch = v->next;
-	free (v->text);
-	free (v);
-    }
-}
-
 void
 cvs_file_free (cvs_file *cvs)
-/* discard a file object and its storage */
+/* discard the patch texts of a file, the rest goes with its arena */
 {
-    cvs_symbol_free (cvs->symbols);
-    cvs_version_free (cvs->versions);
-    cvs_patch_free (cvs->patches);
-    free (cvs);
-    clean_hash();
+    cvs_patch	*p;
+
+    for (p = cvs->patches; p; p = p->next) {
+	free (p->text);
+	p->text = NULL;
+    }
 }
 
 char *
@@ -17,27 +17,277 @@
  */
 
 #include <limits.h>
+#include <errno.h>
 #include "cvs.h"
 
+/*
+ * The highest mark taken.  Blobs get odd marks and commits even ones, so
+ * that the blobs can be told apart in a marks file written by git
+ * fast-import.
+ */
 static int mark;
+#define next_blob_mark()	(mark = (mark + 1) | 1)
+#define next_commit_mark()	(mark = (mark + 2) & ~1)
+/*
+ * What mark would be if every blob got a new one.  -T derives the
+ * dates from it, so they do not depend on which blobs were sent before,
+ * here or in the run -B loaded the marks of.
+ */
+static int serial;
+
+/*
+ * The blobs written so far, by their git object names.  A revision
+ * with the same contents as one written before, reverted or
+ * re-imported or copied, gets its mark instead of being sent again.
+ * Open addressing with linear probing, a mark of 0 is an empty slot.
+ */
+typedef struct _blob_mark {
+    unsigned char	sha1[20];
+    int			mark;
+} blob_mark;
+
+static blob_mark	*blob_marks;
+static unsigned long	nblob_marks, sblob_marks;
+
+static blob_mark *
+blob_mark_slot(const unsigned char *sha1)
+{
+    unsigned long   h;
+    blob_mark	    *b;
+
+    memcpy(&h, sha1, sizeof (h));
+    for (h &= sblob_marks - 1; (b = &blob_marks[h])->mark; h = (h + 1) & (sblob_marks - 1))
+	if (!memcmp(b->sha1, sha1, 20))
+	    break;
+    return b;
+}
+
+static blob_mark *
+blob_mark_find(const unsigned char *sha1)
+/* the slot of a blob, made room for if it is not there yet */
+{
+    blob_mark	    *old = blob_marks;
+    unsigned long   nold = sblob_marks;
+    unsigned long   i;
+
+    if ((nblob_marks + 1) * 4 > sblob_marks * 3) {
+	sblob_marks = sblob_marks ? sblob_marks * 2 : 4096;
+	blob_marks = calloc(sblob_marks, sizeof (blob_mark));
+	for (i = 0; i < nold; i++)
+	    if (old[i].mark)
+		*blob_mark_slot(old[i].sha1) = old[i];
+	free(old);
+    }
+    return blob_mark_slot(sha1);
+}
 
 void
 export_init(void)
 {
     mark = 0;
+    serial = 0;
 }
 
-void 
-export_blob(Node *node, void *buf, unsigned long len)
+bool
+export_load_blob_marks(const char *path)
+/* learn the blobs of an earlier run, marks in the format of fast-import */
+{
+    FILE	    *f = fopen(path, "r");
+    char	    line[128];
+    unsigned char   sha1[20];
+    blob_mark	    *b;
+    int		    m, i, n;
+
+    if (!f) {
+	if (errno == ENOENT)
+	    return true;
+	perror(path);
+	return false;
+    }
+    while (fgets(line, sizeof (line), f)) {
+	if (sscanf(line, ":%d %n", &m, &n) != 1 || m <= 0)
+	    continue;
+	for (i = 0; i < 20; i++)
+	    if (sscanf(line + n + 2 * i, "%2hhx", &sha1[i]) != 1)
+		break;
+	if (i < 20)
+	    continue;
+	/* other objects only keep their marks taken */
+	if (m > mark)
+	    mark = m;
+	if (!(m & 1))
+	    continue;
+	b = blob_mark_find(sha1);
+	if (!b->mark)
+	    nblob_marks++;
+	memcpy(b->sha1, sha1, 20);
+	b->mark = m;
+    }
+    fclose(f);
+    return true;
+}
+
+static int
+compare_blob_marks(const void *a, const void *b)
+{
+    return ((const blob_mark *) a)->mark - ((const blob_mark *) b)->mark;
+}
+
+bool
+export_save_blob_marks(const char *path)
+/* write the marks of all blobs known, for the next run */
+{
+    FILE	    *f = fopen(path, "w");
+    blob_mark	    *sorted;
+    unsigned long   i, n;
+    int		    j;
+
+    if (!f) {
+	perror(path);
+	return false;
+    }
+    sorted = xmalloc((nblob_marks + 1) * sizeof (blob_mark));
+    for (i = n = 0; i < sblob_marks; i++)
+	if (blob_marks[i].mark)
+	    sorted[n++] = blob_marks[i];
+    qsort(sorted, n, sizeof (blob_mark), compare_blob_marks);
+    for (i = 0; i < n; i++) {
+	fprintf(f, ":%d ", sorted[i].mark);
+	for (j = 0; j < 20; j++)
+	    fprintf(f, "%02x", sorted[i].sha1[j]);
+	fputc('\n', f);
+    }
+    free(sorted);
+    if (fclose(f) != 0) {
+	perror(path);
+	return false;
+    }
+    return true;
+}
+
+static void
+write_blob(rev_file *file, const unsigned char *sha1, void *buf, unsigned long len)
 {
-    node->file->mark = ++mark;
+    blob_mark	*b = blob_mark_find(sha1);
+
+    serial++;
+    if (b->mark) {
+	file->mark = b->mark;
+	return;
+    }
+    file->mark = next_blob_mark();
+    memcpy(b->sha1, sha1, 20);
+    b->mark = mark;
+    nblob_marks++;
 
     printf("blob\nmark :%d\ndata %zd\n", 
-	   node->file->mark, len);
+	   file->mark, len);
     fwrite(buf, len, sizeof(char), stdout);
     putchar('\n');
 }
 
+/*
+ * A blob waiting in a context for the marks of all files before it.
+ * Past QUEUED_BLOB_MEMORY bytes, a file's blobs go to a temporary file
+ * instead, so a long history of large binaries does not have to fit in
+ * memory once for each file a worker is ahead.
+ */
+typedef struct _queued_blob {
+    rev_file		*file;
+    unsigned char	sha1[20];
+    unsigned long	len;
+} queued_blob;
+
+#define QUEUED_BLOB_MEMORY	(4 << 20)
+
+static void
+spill_write(cvs_context *ctx, const void *buf, size_t len)
+{
+    if (fwrite(buf, 1, len, ctx->spill) != len) {
+	perror("parsecvs: queued blobs");
+	exit(1);
+    }
+}
+
+void 
+export_blob(cvs_context *ctx, Node *node, void *buf, unsigned long len)
+{
+    queued_blob	b;
+
+    /* hashed here, so that with several jobs the workers do it */
+    sha1_blob(buf, len, b.sha1);
+    if (!ctx->queue_blobs) {
+	write_blob(node->file, b.sha1, buf, len);
+	return;
+    }
+    b.file = node->file;
+    b.len = len;
+    if (!ctx->spill && ctx->nblobs + sizeof (b) + len > QUEUED_BLOB_MEMORY) {
+	ctx->spill = tmpfile();
+	if (!ctx->spill) {
+	    perror("parsecvs: queued blobs");
+	    exit(1);
+	}
+	spill_write(ctx, ctx->blobs, ctx->nblobs);
+	free(ctx->blobs);
+	ctx->blobs = NULL;
+	ctx->nblobs = ctx->sblobs = 0;
+    }
+    if (ctx->spill) {
+	spill_write(ctx, &b, sizeof (b));
+	spill_write(ctx, buf, len);
+	return;
+    }
+    if (ctx->nblobs + sizeof (b) + len > ctx->sblobs) {
+	ctx->sblobs = ctx->sblobs ? ctx->sblobs * 2 : 65536;
+	if (ctx->sblobs < ctx->nblobs + sizeof (b) + len)
+	    ctx->sblobs = ctx->nblobs + sizeof (b) + len;
+	ctx->blobs = xrealloc(ctx->blobs, ctx->sblobs);
+    }
+    memcpy(ctx->blobs + ctx->nblobs, &b, sizeof (b));
+    memcpy(ctx->blobs + ctx->nblobs + sizeof (b), buf, len);
+    ctx->nblobs += sizeof (b) + len;
+}
+
+void
+export_queued_blobs(cvs_context *ctx)
+/* write the blobs of a file once it is its turn, numbering them as it goes */
+{
+    size_t	pos = 0;
+    queued_blob	b;
+
+    while (pos < ctx->nblobs) {
+	memcpy(&b, ctx->blobs + pos, sizeof (b));
+	pos += sizeof (b);
+	write_blob(b.file, b.sha1, ctx->blobs + pos, b.len);
+	pos += b.len;
+    }
+    if (ctx->spill) {
+	/* read back one at a time, into a buffer that only grows */
+	rewind(ctx->spill);
+	while (fread(&b, sizeof (b), 1, ctx->spill) == 1) {
+	    if (b.len > ctx->sblobs) {
+		ctx->sblobs = b.len;
+		ctx->blobs = xrealloc(ctx->blobs, ctx->sblobs);
+	    }
+	    if (fread(ctx->blobs, 1, b.len, ctx->spill) != b.len) {
+		fprintf(stderr, "parsecvs: queued blobs of %s cut short\n", ctx->name);
+		exit(1);
+	    }
+	    write_blob(b.file, b.sha1, ctx->blobs, b.len);
+	}
+	if (ferror(ctx->spill)) {
+	    perror("parsecvs: queued blobs");
+	    exit(1);
+	}
+	fclose(ctx->spill);
+	ctx->spill = NULL;
+    }
+    free(ctx->blobs);
+    ctx->blobs = NULL;
+    ctx->nblobs = ctx->sblobs = 0;
+}
+
 static char *
 export_filename (rev_file *file, int strip)
 {
@@ -131,8 +381,13 @@ export_commit(rev_commit *commit, char *branch, int strip)
     size_t revpairsize = 0;
     const char *ts;
     time_t ct;
+    rev_commit	*parent;
     rev_file	*f, *f2;
+    char	*stripped;
     int		i, j, i2, j2;
+    static rev_file	**del;
+    static int	sdel;
+    int		ndel;
 
     author = fullname(commit->author);
     if (!author) {
@@ -146,9 +401,10 @@ export_commit(rev_commit *commit, char *branch, int strip)
     }
 
     printf("commit refs/heads/%s\n", branch);
-    printf("mark :%d\n", ++mark);
-    commit->mark = mark;
-    ct = force_dates ? mark * commit_time_window * 2 : commit->date;
+    commit->mark = next_commit_mark();
+    printf("mark :%d\n", commit->mark);
+    serial++;
+    ct = force_dates ? serial * commit_time_window * 2 : commit->date;
     ts = utc_offset_timestamp(&ct, timezone);
     printf("author %s <%s> %s\n", full, email, ts);
     printf("committer %s <%s> %s\n", full, email, ts);
@@ -162,75 +418,85 @@ export_commit(rev_commit *commit, char *branch, int strip)
 	revpairs[0] = '\0';
     }
 
-    for (i = 0; i < commit->ndirs; i++) {
-	rev_dir	*dir = commit->dirs[i];
-	
-	for (j = 0; j < dir->nfiles; j++) {
-	    char *stripped;
-	    bool present, changed;
-	    f = dir->files[j];
-	    stripped = export_filename(f, strip);
-	    present = false;
-	    changed = false;
-	    if (commit->parent) {
-		for (i2 = 0; i2 < commit->parent->ndirs; i2++) {
-		    rev_dir	*dir2 = commit->parent->dirs[i2];
-		    for (j2 = 0; j2 < dir2->nfiles; j2++) {
-			f2 = dir2->files[j2];
-			if (strcmp(f->name, f2->name) == 0) {
-			    present = true;
-			    changed = (f->mark != f2->mark);
-			}
-		    }
-		}
-	    }
-	    if (!present || changed) {
-		printf("M 100%o :%d %s\n", 
-		       (f->mode & 0777) | 0200, 
-		       f->mark, stripped);
-		if (revision_map || reposurgeon) {
-		    char *fr = stringify_revision(stripped, " ", &f->number);
-		    if (revision_map)
-			fprintf(revision_map, "%s :%d\n", fr, f->mark);
-		    if (reposurgeon)
-		    {
-			if (strlen(revpairs) + strlen(fr) + 2 > revpairsize)
-			{
-			    revpairsize += strlen(fr) + 2;
-			    revpairs = xrealloc(revpairs, revpairsize);
-			}
-			strcat(revpairs, fr);
-			strcat(revpairs, "\n");
-		    }
-		}
-	    }
+    /*
+     * Both file lists are sorted by name, a rev_dir at a time, so walk
+     * them side by side.  rev_dirs are shared between commits whenever
+     * their files are the same, and those are skipped whole, so only
+     * the directories that changed cost anything.
+     */
+    parent = commit->parent;
+    ndel = 0;
+    i = j = i2 = j2 = 0;
+    for (;;) {
+	rev_dir	*dir, *dir2;
+	int	c;
+
+	while (i < commit->ndirs && j == commit->dirs[i]->nfiles) {
+	    i++;
+	    j = 0;
 	}
-    }
-
-    if (commit->parent)
-    {
-	for (i = 0; i < commit->parent->ndirs; i++) {
-	    rev_dir	*dir = commit->parent->dirs[i];
-
-	    for (j = 0; j < dir->nfiles; j++) {
-		bool present;
-		f = dir->files[j];
-		present = false;
-		for (i2 = 0; i2 < commit->ndirs; i2++) {
-		    rev_dir	*dir2 = commit->dirs[i2];
-		    for (j2 = 0; j2 < dir2->nfiles; j2++) {
-			f2 = dir2->files[j2];
-			if (strcmp(f->name, f2->name) == 0) {
-			    present = true;
-			}
-		    }
+	while (parent && i2 < parent->ndirs && j2 == parent->dirs[i2]->nfiles) {
+	    i2++;
+	    j2 = 0;
+	}
+	dir = i < commit->ndirs ? commit->dirs[i] : NULL;
+	dir2 = parent && i2 < parent->ndirs ? parent->dirs[i2] : NULL;
+	if (!dir && !dir2)
+	    break;
+	if (dir == dir2 && j == 0 && j2 == 0) {
+	    i++;
+	    i2++;
+	    continue;
+	}
+	f = dir ? dir->files[j] : NULL;
+	f2 = dir2 ? dir2->files[j2] : NULL;
+	if (!f)
+	    c = 1;
+	else if (!f2)
+	    c = -1;
+	else if (f->name == f2->name)
+	    c = 0;
+	else
+	    c = strcmp(f->name, f2->name);
+
+	if (c > 0) {
+	    /* deletions follow the modifications */
+	    if (ndel == sdel)
+		del = xrealloc(del, (sdel = sdel ? sdel * 2 : 64) * sizeof (rev_file *));
+	    del[ndel++] = f2;
+	    j2++;
+	    continue;
+	}
+	j++;
+	if (c == 0) {
+	    j2++;
+	    if (f->mark == f2->mark)
+		continue;
+	}
+	stripped = export_filename(f, strip);
+	printf("M 100%o :%d %s\n", 
+	       (f->mode & 0777) | 0200, 
+	       f->mark, stripped);
+	if (revision_map || reposurgeon) {
+	    char *fr = stringify_revision(stripped, " ", &f->number);
+	    if (revision_map)
+		fprintf(revision_map, "%s :%d\n", fr, f->mark);
+	    if (reposurgeon)
+	    {
+		if (strlen(revpairs) + strlen(fr) + 2 > revpairsize)
+		{
+		    revpairsize += strlen(fr) + 2;
+		    revpairs = xrealloc(revpairs, revpairsize);
 		}
-		if (!present)
-		    printf("D %s\n", export_filename(f, strip));
+		strcat(revpairs, fr);
+		strcat(revpairs, "\n");
 	    }
 	}
     }
 
+    for (i = 0; i < ndel; i++)
+	printf("D %s\n", export_filename(del[i], strip));
+
     if (reposurgeon) 
     {
 	printf("property cvs-revision %zd %s", strlen(revpairs), revpairs);
@@ -68,17 +68,22 @@ enum markers { Nomatch, Author, Date, Header, Id, Locker, Log,
 enum stringwork {ENTER, EDIT};
 
 enum expand_mode {EXPANDKKV, EXPANDKKVL, EXPANDKK, EXPANDKV, EXPANDKO, EXPANDKB};
-enum expand_mode Gexpand;
-char * Glog;
-int Gkvlen = 0;
-char* Gkeyval = NULL;
-char const *Gfilename;
-char *Gabspath;
-cvs_version *Gversion;
-char Gversion_number[CVS_MAX_REV_LEN];
-struct out_buffer_type *Goutbuf;
-struct in_buffer_type in_buffer_store;
-struct in_buffer_type *Ginbuf = &in_buffer_store;
+/*
+ * The state of the file being expanded.  A file is expanded from start
+ * to end by a single thread, and several threads may be expanding
+ * different files, so all of it is thread-local.
+ */
+static __thread enum expand_mode Gexpand;
+static __thread char * Glog;
+static __thread int Gkvlen = 0;
+static __thread char* Gkeyval = NULL;
+static __thread char const *Gfilename;
+static __thread char *Gabspath;
+static __thread cvs_version *Gversion;
+static __thread char Gversion_number[CVS_MAX_REV_LEN];
+static __thread struct out_buffer_type *Goutbuf;
+static __thread struct in_buffer_type in_buffer_store;
+#define Ginbuf (&in_buffer_store)
 
 /*
  * Gline contains pointers to the lines in the currently edit buffer
@@ -88,8 +93,8 @@ struct in_buffer_type *Ginbuf = &in_buffer_store;
  * Any @s in lines are duplicated.
  * Lines are terminated by \n, or (for a last partial line only) by single @.
  */
-static int depth;
-static struct {
+static __thread int depth;
+static __thread struct {
 	Node *next_branch;
 	Node *node;
 	uchar **line;
@@ -486,12 +491,13 @@ static void keyreplace(enum markers marker)
 	char const *xxp;
 	char *leader = NULL;
 	char date_string[25];
+	struct tm tm;
 	uchar *kdelim_ptr = NULL;
 	enum expand_mode exp = Gexpand;
 	char const *sp = Keyword[(int)marker];
 
 	strftime(date_string, 25,
-		"%Y/%m/%d %H:%M:%S", localtime(&Gversion->date));
+		"%Y/%m/%d %H:%M:%S", localtime_r(&Gversion->date, &tm));
 
 	if (exp != EXPANDKV)
 		out_printf("%c%s", KDELIM, sp);
@@ -831,16 +837,19 @@ static void enter_branch(Node *node)
 	depth++;
 }
 
-void generate_files(cvs_file *cvs, void (*hook)(Node *node, void *buf, unsigned long len))
+void generate_files(cvs_context *ctx, void (*hook)(cvs_context *ctx, Node *node, void *buf, unsigned long len))
 {
-	int expandflag = Gexpand < EXPANDKO;
-	Node *node = head_node;
+	cvs_file *cvs = ctx->file;
+	int expandflag;
+	Node *node = ctx->head_node;
 	depth = 0;
 	Gfilename = cvs->name;
 	if (!suppress_keyword_expansion && cvs->expand)
 	    Gexpand = expand_override(cvs->expand);
 	else
 	    Gexpand = EXPANDKK;
+	/* -ko and -kb files are written as they are */
+	expandflag = Gexpand < EXPANDKO;
 	Gabspath = NULL;
 	Gline = NULL; Ggap = Ggapsize = Glinemax = 0;
 	stack[0].node = node;
@@ -852,7 +861,7 @@ void generate_files(cvs_file *cvs, void (*hook)(Node *node, void *buf, unsigned
 				finishedit();
 			else
 				snapshotedit();
-			hook(node, out_buffer_text(), out_buffer_count());
+			hook(ctx, node, out_buffer_text(), out_buffer_count());
 			out_buffer_cleanup();
 		}
 		node = node->down;
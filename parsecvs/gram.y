@@ -19,11 +19,17 @@
 
 #include "cvs.h"
 
-void yyerror (char *msg);
-
 time_t skew_vulnerable = 0;
 %}
 
+/*
+ * The parser keeps no state of its own, each file brings its lexer
+ * and the context the results go to
+ */
+%define api.pure full
+%parse-param {void *scanner} {cvs_context *ctx}
+%lex-param {void *scanner}
+
 %union {
     int		i;
     time_t	date;
@@ -59,6 +65,10 @@ time_t skew_vulnerable = 0;
 %type <patch>	patch
 %type <patches>	patches
 
+%code {
+int yylex (YYSTYPE *lvalp, void *scanner);
+void yyerror (void *scanner, cvs_context *ctx, const char *msg);
+}
 
 %%
 file		: headers revisions desc patches
@@ -69,16 +79,16 @@ headers		: header headers
 		|
 		;
 header		: HEAD opt_number SEMI
-		  { this_file->head = $2; }
+		  { ctx->file->head = $2; }
 		| BRANCH NUMBER SEMI
-		  { this_file->branch = $2; }
+		  { ctx->file->branch = $2; }
 		| ACCESS SEMI
 		| symbollist
-		  { this_file->symbols = $1; }
+		  { ctx->file->symbols = $1; }
 		| LOCKS locks SEMI lock_type
 		| COMMENT DATA SEMI
 		| EXPAND DATA SEMI
-		  { this_file->expand = $2; }
+		  { ctx->file->expand = $2; }
 		;
 locks		: locks lock
 		|
@@ -100,7 +110,7 @@ symbols		: symbols symbol
 		;
 symbol		: name COLON NUMBER
 		  {
-			$$ = calloc (1, sizeof (cvs_symbol));
+			$$ = arena_alloc (ctx->arena, sizeof (cvs_symbol));
 			$$->name = $1;
 			$$->number = $3;
 		  }
@@ -121,11 +131,11 @@ name		: NAME
 revisions	: revisions revision
 		  { *$1 = $2; $$ = &$2->next; }
 		|
-		  { $$ = &this_file->versions; }
+		  { $$ = &ctx->file->versions; }
 		;
 revision	: NUMBER date author state branches next opt_commitid
 		  {
-			$$ = calloc (1, sizeof (cvs_version));
+			$$ = arena_alloc (ctx->arena, sizeof (cvs_version));
 			$$->number = $1;
 			$$->date = $2;
 			$$->author = $3;
@@ -134,16 +144,16 @@ revision	: NUMBER date author state branches next opt_commitid
 			$$->branches = $5;
 			$$->parent = $6;
 			$$->commitid = $7;
-			if ($$->commitid == NULL && skew_vulnerable < $$->date)
-			    skew_vulnerable = $$->date;
-			hash_version($$);
-			++this_file->nversions;
+			if ($$->commitid == NULL && ctx->skew_vulnerable < $$->date)
+			    ctx->skew_vulnerable = $$->date;
+			hash_version(ctx, $$);
+			++ctx->file->nversions;
 			
 		  }
 		;
 date		: DATE NUMBER SEMI
 		  {
-			$$ = lex_date (&$2);
+			$$ = lex_date (&$2, ctx);
 		  }
 		;
 author		: AUTHOR NAME SEMI
@@ -157,10 +167,10 @@ branches	: BRANCHES numbers SEMI
 		;
 numbers		: NUMBER numbers
 		  {
-			$$ = calloc (1, sizeof (cvs_branch));
+			$$ = arena_alloc (ctx->arena, sizeof (cvs_branch));
 			$$->next = $2;
 			$$->number = $1;
-			hash_branch($$);
+			hash_branch(ctx, $$);
 		  }
 		|
 		  { $$ = NULL; }
@@ -187,14 +197,14 @@ desc		: DESC DATA
 patches		: patches patch
 		  { *$1 = $2; $$ = &$2->next; }
 		|
-		  { $$ = &this_file->patches; }
+		  { $$ = &ctx->file->patches; }
 		;
 patch		: NUMBER log text
-		  { $$ = calloc (1, sizeof (cvs_patch));
+		  { $$ = arena_alloc (ctx->arena, sizeof (cvs_patch));
 		    $$->number = $1;
 		    $$->log = $2;
 		    $$->text = $3;
-		    hash_patch($$);
+		    hash_patch(ctx, $$);
 		  }
 		;
 log		: LOG DATA
@@ -205,8 +215,9 @@ text		: TEXT TEXT_DATA
 		;
 %%
 
-void yyerror (char *msg)
+void yyerror (void *scanner, cvs_context *ctx, const char *msg)
 {
-	fprintf (stderr, "parse error %s at %s\n", msg, lex_text ());
+	fprintf (stderr, "%s: parse error %s at %s\n", ctx->name, msg,
+		 lex_text (scanner));
 	exit(1);
 }
@@ -0,0 +1,135 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+/*
+ * CRC32C (Castagnoli), the hash of the atom, node and rev_dir tables.
+ * x86 processors with SSE4.2 and ARMv8 processors with the CRC
+ * extension compute it in hardware; everything else uses a table.  All
+ * of them give the same values.
+ */
+
+#include "cvs.h"
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_CRC32C_ARM 1
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_CRC32C_SSE42 1
+#endif
+
+typedef uint32_t (*crc32c_func) (uint32_t crc, const unsigned char *p, size_t len);
+
+static uint32_t crc32c_table[256];
+
+static void
+generate_crc32c_table (void)
+{
+    uint32_t	c, p;
+    int		n, m;
+
+    p = 0x82f63b78;
+    for (n = 0; n < 256; n++)
+    {
+	c = n;
+	for (m = 0; m < 8; m++)
+	    c = (c >> 1) ^ ((c & 1) ? p : 0);
+	crc32c_table[n] = c;
+    }
+}
+
+static uint32_t
+crc32c_bytes (uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len--)
+	crc = (crc >> 8) ^ crc32c_table[(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+__attribute__ ((target ("sse4.2")))
+static uint32_t
+crc32c_sse42 (uint32_t crc, const unsigned char *p, size_t len)
+{
+#ifdef __x86_64__
+    uint64_t	c = crc, v;
+
+    for (; len >= 8; p += 8, len -= 8) {
+	memcpy (&v, p, 8);
+	c = __builtin_ia32_crc32di (c, v);
+    }
+    crc = c;
+#endif
+    for (; len >= 4; p += 4, len -= 4) {
+	uint32_t    w;
+
+	memcpy (&w, p, 4);
+	crc = __builtin_ia32_crc32si (crc, w);
+    }
+    while (len--)
+	crc = __builtin_ia32_crc32qi (crc, *p++);
+    return crc;
+}
+#endif
+
+#ifdef HAVE_CRC32C_ARM
+static uint32_t
+crc32c_arm (uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t	v;
+
+    for (; len >= 8; p += 8, len -= 8) {
+	memcpy (&v, p, 8);
+	crc = __crc32cd (crc, v);
+    }
+    while (len--)
+	crc = __crc32cb (crc, *p++);
+    return crc;
+}
+#endif
+
+static crc32c_func	crc32c = crc32c_bytes;
+
+static pthread_once_t	crc32c_once = PTHREAD_ONCE_INIT;
+
+static void
+crc32c_init (void)
+/* pick the fastest way this processor has */
+{
+#ifdef HAVE_CRC32C_ARM
+    crc32c = crc32c_arm;
+    return;
+#endif
+#ifdef HAVE_CRC32C_SSE42
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse4.2")) {
+	crc32c = crc32c_sse42;
+	return;
+    }
+#endif
+    generate_crc32c_table ();
+}
+
+unsigned int
+hash_bytes (const void *data, size_t len)
+/* the CRC32C of a block of memory */
+{
+    pthread_once (&crc32c_once, crc32c_init);
+    return ~crc32c (~0u, data, len);
+}
+
+/* end */
@@ -1,17 +1,53 @@
 #include "cvs.h"
 
-static Node *table[4096];
-static int entries;
+#define NODE_HASH_INIT	64
 
-Node *head_node;
+static unsigned int node_hash(cvs_number *n)
+/* hash the significant part of a release number */
+{
+	return hash_bytes(n->n, n->c * sizeof(n->n[0]));
+}
+
+static Node **node_slot(cvs_context *ctx, cvs_number *key)
+/* the slot of a release number: its node, or where it would go */
+{
+	unsigned int mask = ctx->size - 1;
+	unsigned int h;
+	Node *p;
+	int i;
+
+	for (h = node_hash(key) & mask; (p = ctx->table[h]); h = (h + 1) & mask) {
+		if (p->number.c != key->c)
+			continue;
+		for (i = 0; i < key->c && p->number.n[i] == key->n[i]; i++)
+			;
+		if (i == key->c)
+			break;
+	}
+	return &ctx->table[h];
+}
+
+static void grow_hash(cvs_context *ctx)
+/* start the node table small and double it as a file needs */
+{
+	Node **old = ctx->table;
+	int size = ctx->size;
+	int i;
+
+	ctx->size = size ? size * 2 : NODE_HASH_INIT;
+	ctx->table = calloc(ctx->size, sizeof(Node *));
+	for (i = 0; i < size; i++)
+		if (old[i])
+			*node_slot(ctx, &old[i]->number) = old[i];
+	free(old);
+}
 
-static Node *hash_number(cvs_number *n)
+static Node *hash_number(cvs_context *ctx, cvs_number *n)
 /* look up the node associated with a specifued CVS release number */
 {
 	cvs_number key = *n;
+	Node **slot;
 	Node *p;
-	int hash;
-	int i;
 
 	if (key.c > 2 && !key.n[key.c - 2]) {
 		key.n[key.c - 2] = key.n[key.c - 1];
@@ -19,53 +55,34 @@ static Node *hash_number(cvs_number *n)
 	}
 	if (key.c & 1)
 		key.n[key.c] = 0;
-	for (i = 0, hash = 0; i < key.c - 1; i++)
-		hash += key.n[i];
-	hash = (hash * 256 + key.n[key.c - 1]) % 4096;
-	for (p = table[hash]; p; p = p->hash_next) {
-		if (p->number.c != key.c)
-			continue;
-		for (i = 0; i < key.c && p->number.n[i] == key.n[i]; i++)
-			;
-		if (i == key.c)
-			return p;
-	}
-	p = calloc(1, sizeof(Node));
+	if ((ctx->entries + 1) * 4 > ctx->size * 3)
+		grow_hash(ctx);
+	slot = node_slot(ctx, &key);
+	if (*slot)
+		return *slot;
+	p = arena_alloc(ctx->arena, sizeof(Node));
 	p->number = key;
-	p->hash_next = table[hash];
-	table[hash] = p;
-	entries++;
+	*slot = p;
+	ctx->entries++;
 	return p;
 }
 
-static Node *find_parent(cvs_number *n, int depth)
+static Node *find_parent(cvs_context *ctx, cvs_number *n, int depth)
 /* find the parent node of the specified prefix of a release number */
 {
 	cvs_number key = *n;
-	Node *p;
-	int hash;
-	int i;
 
 	key.c -= depth;
-	for (i = 0, hash = 0; i < key.c - 1; i++)
-		hash += key.n[i];
-	hash = (hash * 256 + key.n[key.c - 1]) % 4096;
-	for (p = table[hash]; p; p = p->hash_next) {
-		if (p->number.c != key.c)
-			continue;
-		for (i = 0; i < key.c && p->number.n[i] == key.n[i]; i++)
-			;
-		if (i == key.c)
-			break;
-	}
-	return p;
+	if (key.c <= 0 || !ctx->size)
+		return NULL;
+	return *node_slot(ctx, &key);
 }
 
-void hash_version(cvs_version *v)
+void hash_version(cvs_context *ctx, cvs_version *v)
 /* intern a version onto the node list */
 {
 	char name[CVS_MAX_REV_LEN];
-	v->node = hash_number(&v->number);
+	v->node = hash_number(ctx, &v->number);
 	if (v->node->v) {
 		fprintf(stderr, "more than one delta with number %s\n",
 			cvs_number_string(&v->node->number, name));
@@ -78,11 +95,11 @@ void hash_version(cvs_version *v)
 	}
 }
 
-void hash_patch(cvs_patch *p)
+void hash_patch(cvs_context *ctx, cvs_patch *p)
 /* intern a patch onto the node list */
 {
 	char name[CVS_MAX_REV_LEN];
-	p->node = hash_number(&p->number);
+	p->node = hash_number(ctx, &p->number);
 	if (p->node->p) {
 		fprintf(stderr, "more than one delta with number %s\n",
 			cvs_number_string(&p->node->number, name));
@@ -95,27 +112,20 @@ void hash_patch(cvs_patch *p)
 	}
 }
 
-void hash_branch(cvs_branch *b)
+void hash_branch(cvs_context *ctx, cvs_branch *b)
 /* intern a branch onto the node list */
 {
-	b->node = hash_number(&b->number);
+	b->node = hash_number(ctx, &b->number);
 }
 
-void clean_hash(void)
-/* discard the node list */
+void clean_hash(cvs_context *ctx)
+/* discard the node list, the nodes go with the context's arena */
 {
-	int i;
-	for (i = 0; i < 4096; i++) {
-		Node *p = table[i];
-		table[i] = NULL;
-		while (p) {
-			Node *q = p->hash_next;
-			free(p);
-			p = q;
-		}
-	}
-	entries = 0;
-	head_node = NULL;
+	free(ctx->table);
+	ctx->table = NULL;
+	ctx->size = 0;
+	ctx->entries = 0;
+	ctx->head_node = NULL;
 }
 
 static int compare(const void *a, const void *b)
@@ -137,7 +147,7 @@ static int compare(const void *a, const void *b)
 	return 0;
 }
 
-static void try_pair(Node *a, Node *b)
+static void try_pair(cvs_context *ctx, Node *a, Node *b)
 {
 	int n = a->number.c;
 
@@ -157,39 +167,38 @@ static void try_pair(Node *a, Node *b)
 			return;
 		}
 	} else if (n == 2) {
-		head_node = a;
+		ctx->head_node = a;
 	}
 	if ((b->number.c & 1) == 0) {
 		b->starts = 1;
 		/* can the code below ever be needed? */
-		Node *p = find_parent(&b->number, 1);
+		Node *p = find_parent(ctx, &b->number, 1);
 		if (p)
 			p->next = b;
 	}
 }
 
-void build_branches(void)
-/* set head_node global and build branch links in the node list */ 
+void build_branches(cvs_context *ctx)
+/* set the context's head_node and build branch links in the node list */ 
 {
-	Node **v = malloc(sizeof(Node *) * entries), **p = v;
+	Node **v = malloc(sizeof(Node *) * ctx->entries), **p = v;
+	int entries = ctx->entries;
 	int i;
 
-	for (i = 0; i < 4096; i++) {
-		Node *q;
-		for (q = table[i]; q; q = q->hash_next)
-			*p++ = q;
-	}
+	for (i = 0; i < ctx->size; i++)
+		if (ctx->table[i])
+			*p++ = ctx->table[i];
 	qsort(v, entries, sizeof(Node *), compare);
 	/* only trunk? */
 	if (v[entries-1]->number.c == 2)
-		head_node = v[entries-1];
+		ctx->head_node = v[entries-1];
 	for (p = v + entries - 2 ; p >= v; p--)
-		try_pair(p[0], p[1]);
+		try_pair(ctx, p[0], p[1]);
 	for (p = v + entries - 1 ; p >= v; p--) {
 		Node *a = *p, *b = NULL;
 		if (!a->starts)
 			continue;
-		b = find_parent(&a->number, 2);
+		b = find_parent(ctx, &a->number, 2);
 		if (!b) {
 			char name[CVS_MAX_REV_LEN];
 			fprintf(stderr, "no parent for %s\n",
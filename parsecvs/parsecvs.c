@@ -21,6 +21,7 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #ifndef MAXPATHLEN
 #define MAXPATHLEN  10240
@@ -37,6 +38,8 @@ bool suppress_keyword_expansion = false;
 bool reposurgeon;
 FILE *revision_map;
 static int verbose = 0;
+static int jobs = 0;
+static char *blob_marks_file;
 static rev_execution_mode rev_mode = ExecuteExport;
 
 char *
@@ -146,41 +149,79 @@ ctime_nonl (time_t *date)
     return d;
 }
 
-extern FILE *yyin;
 static int err = 0;
-char *yyfilename;
-extern int yylineno;
 
-cvs_file	*this_file;
+/* what a thread has parsed of the file it is on, reset between files */
+static __thread arena file_arena;
 
-static rev_list *
-rev_list_file (char *name, int *nversions)
+static void
+rev_list_file (cvs_context *ctx)
+/* parse a ,v file and expand its revisions, touching nothing but ctx */
 {
-    rev_list	*rl;
-    struct stat	buf;
-
-    yyin = fopen (name, "r");
-    if (!yyin) {
-	perror (name);
-	++err;
+    ctx->arena = &file_arena;
+    ctx->file = arena_alloc (ctx->arena, sizeof (cvs_file));
+    ctx->file->name = ctx->name;
+    ctx->tags_tail = &ctx->tags;
+    if (!lex_open (ctx)) {
+	ctx->file = NULL;
+	arena_reset (ctx->arena);
+	return;
     }
-    yyfilename = name;
-    yylineno = 0;
-    this_file = calloc (1, sizeof (cvs_file));
-    this_file->name = name;
-    if (yyin)
-	assert (fstat (fileno (yyin), &buf) == 0);
-    this_file->mode = buf.st_mode;
-    yyparse ();
-    fclose (yyin);
-    yyfilename = 0;
-    rl = rev_list_cvs (this_file);
+    yyparse (ctx->scanner, ctx);
+    lex_close (ctx);
+    ctx->rl = rev_list_cvs (ctx);
     if (rev_mode == ExecuteExport)
-	generate_files(this_file, export_blob);
+	generate_files(ctx, export_blob);
    
-    *nversions = this_file->nversions;
-    cvs_file_free (this_file);
-    return rl;
+    ctx->nversions = ctx->file->nversions;
+    cvs_file_free (ctx->file);
+    ctx->file = NULL;
+    clean_hash (ctx);
+    arena_reset (ctx->arena);
+}
+
+/*
+ * With several jobs, workers take the files in turn and parse them,
+ * while the main thread waits for each file in order to write its
+ * blobs and hand its tags on.  Marks and tags come out the same as if
+ * the files had been read one by one.  Workers stay at most a few
+ * files ahead of the writer, as each file's blobs are kept until then,
+ * in memory up to a limit and in a temporary file past it.
+ */
+typedef struct _rev_file_queue {
+    cvs_context		**files;
+    int			nfiles;
+    int			next;		/* next file for a worker */
+    int			written;	/* files the writer is done with */
+    int			window;
+    pthread_mutex_t	lock;
+    pthread_cond_t	cond;
+} rev_file_queue;
+
+static void *
+rev_file_worker (void *closure)
+{
+    rev_file_queue  *q = closure;
+    cvs_context	    *ctx;
+
+    pthread_mutex_lock (&q->lock);
+    for (;;) {
+	while (q->next < q->nfiles && q->next >= q->written + q->window)
+	    pthread_cond_wait (&q->cond, &q->lock);
+	if (q->next >= q->nfiles)
+	    break;
+	ctx = q->files[q->next++];
+	pthread_mutex_unlock (&q->lock);
+
+	rev_list_file (ctx);
+
+	pthread_mutex_lock (&q->lock);
+	ctx->done = true;
+	pthread_cond_broadcast (&q->cond);
+    }
+    pthread_mutex_unlock (&q->lock);
+    arena_free (&file_arena);
+    return NULL;
 }
 
 void
@@ -401,6 +442,9 @@ main (int argc, char **argv)
     int		    c;
     char	    *file;
     int		    nfile = 0;
+    int		    i;
+    rev_file_queue  queue;
+    pthread_t	    *workers;
 
     while (1) {
 	static struct option options[] = {
@@ -412,8 +456,10 @@ main (int argc, char **argv)
 	    { "revision-map",       1, 0, 'R' },
 	    { "reposurgeon",        1, 0, 'r' },
             { "graph",              0, 0, 'g' },
+	    { "jobs",               1, 0, 'j' },
+	    { "blob-marks",         1, 0, 'B' },
 	};
-	int c = getopt_long(argc, argv, "+hVw:grvA:R:T", options, NULL);
+	int c = getopt_long(argc, argv, "+hVw:grvA:R:Tj:B:", options, NULL);
 	if (c < 0)
 	    break;
 	switch (c) {
@@ -423,10 +469,12 @@ main (int argc, char **argv)
                    "Mandatory arguments to long options are mandatory for short options too.\n"
                    " -h --help                       This help\n"
 		   " -g --graph                      Dump the commit graph\n"
+		   " -j --jobs=N                     Parse N files at once (default: one per CPU)\n"
 		   " -k                              Suppress keyword expansion\n"
                    " -v --version                    Print version\n"
                    " -w --commit-time-window=WINDOW  Time window for commits (seconds)\n"
 		   " -A --authormap                  Author map file\n"
+		   " -B --blob-marks=FILE            Read and write the marks of blobs\n"
 		   " -R --revision-map               Revision map file\n"
 		   " -r --reposurgeon                Issue cvs-revision properties\n"
 		   " -T                              Force deterministic dates\n"
@@ -464,6 +512,12 @@ main (int argc, char **argv)
 	case 'T':
 	    force_dates = true;
 	    break;
+	case 'j':
+	    jobs = atoi (optarg);
+	    break;
+	case 'B':
+	    blob_marks_file = optarg;
+	    break;
 	default: /* error message already emitted */
 	    fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
 	    return 1;
@@ -519,27 +573,84 @@ main (int argc, char **argv)
 	last = fn->file;
 	nfile++;
     }
-    if (rev_mode == ExecuteExport)
+    if (rev_mode == ExecuteExport) {
 	export_init();
+	if (blob_marks_file && !export_load_blob_marks (blob_marks_file))
+	    exit (1);
+    }
+    if (jobs <= 0)
+	jobs = sysconf (_SC_NPROCESSORS_ONLN);
+    if (jobs <= 0)
+	jobs = 1;
     load_total_files = nfile;
     load_current_file = 0;
-    while (fn_head) {
-	int nversions;
-	
-	fn = fn_head;
-	fn_head = fn_head->next;
-	++load_current_file;
-	if (verbose)
-	    fprintf(stderr, "parsecvs: processing %s\n", fn->file);
-	load_status (fn->file + strip);
-	rl = rev_list_file (fn->file, &nversions);
-	if (rl->watch)
-	    dump_rev_tree (rl);
-	*tail = rl;
-	tail = &rl->next;
 
+    queue.files = calloc (nfile + 1, sizeof (cvs_context *));
+    queue.nfiles = nfile;
+    queue.next = queue.written = 0;
+    queue.window = 2 * jobs;
+    pthread_mutex_init (&queue.lock, NULL);
+    pthread_cond_init (&queue.cond, NULL);
+    for (i = 0; (fn = fn_head); i++) {
+	fn_head = fn->next;
+	queue.files[i] = calloc (1, sizeof (cvs_context));
+	queue.files[i]->name = fn->file;
+	queue.files[i]->queue_blobs = jobs > 1;
 	free(fn);
     }
+    workers = calloc (jobs, sizeof (pthread_t));
+    if (jobs > 1)
+	for (i = 0; i < jobs; i++)
+	    if (pthread_create (&workers[i], NULL, rev_file_worker, &queue) != 0) {
+		perror ("pthread_create");
+		exit (1);
+	    }
+
+    for (i = 0; i < nfile; i++) {
+	cvs_context *ctx = queue.files[i];
+	cvs_tag_ref *t;
+
+	++load_current_file;
+	if (verbose)
+	    fprintf(stderr, "parsecvs: processing %s\n", ctx->name);
+	load_status (ctx->name + strip);
+	if (jobs > 1) {
+	    pthread_mutex_lock (&queue.lock);
+	    while (!ctx->done)
+		pthread_cond_wait (&queue.cond, &queue.lock);
+	    pthread_mutex_unlock (&queue.lock);
+	} else
+	    rev_list_file (ctx);
+
+	rl = ctx->rl;
+	if (rl) {
+	    while ((t = ctx->tags)) {
+		ctx->tags = t->next;
+		tag_commit (t->commit, t->name, ctx->name);
+		free (t);
+	    }
+	    if (skew_vulnerable < ctx->skew_vulnerable)
+		skew_vulnerable = ctx->skew_vulnerable;
+	    export_queued_blobs (ctx);
+	    if (rl->watch)
+		dump_rev_tree (rl);
+	    *tail = rl;
+	    tail = &rl->next;
+	} else
+	    ++err;
+	free (ctx);
+	queue.files[i] = NULL;
+
+	pthread_mutex_lock (&queue.lock);
+	queue.written = i + 1;
+	pthread_cond_broadcast (&queue.cond);
+	pthread_mutex_unlock (&queue.lock);
+    }
+    if (jobs > 1)
+	for (i = 0; i < jobs; i++)
+	    pthread_join (workers[i], NULL);
+    free (workers);
+    free (queue.files);
     if (skew_vulnerable > 0)
 	fprintf(stderr, "Commits before this date lack commitids: %s",
 		ctime(&skew_vulnerable));
@@ -555,16 +666,19 @@ main (int argc, char **argv)
 	    break;
 	case ExecuteExport:
 	    export_commits (rl, strip);
+	    if (blob_marks_file && !export_save_blob_marks (blob_marks_file))
+		err++;
 	    break;
 	}
     }
     if (rl)
-	rev_list_free (rl, 0);
+	rev_list_free (rl);
     while (head) {
 	rl = head;
 	head = head->next;
-	rev_list_free (rl, 1);
+	rev_list_free (rl);
     }
+    arena_free (&file_arena);
     discard_atoms ();
     discard_tags ();
     rev_free_dirs ();
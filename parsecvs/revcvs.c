@@ -65,7 +65,7 @@ rev_branch_cvs (cvs_file *cvs, cvs_number *branch)
 	rev_commit *c;
 	if (!v)
 	     continue;
-	c = calloc (1, sizeof (rev_commit));
+	c = rev_alloc (sizeof (rev_commit));
 	c->date = v->date;
 	c->commitid = v->commitid;
 	c->author = v->author;
@@ -380,6 +380,22 @@ rev_list_graft_branches (rev_list *rl, cvs_file *cvs)
     }
 }
 
+/*
+ * The tags go into the global list in the order the files were given,
+ * which need not be the order in which they are parsed
+ */
+
+static void
+rev_list_defer_tag (cvs_context *ctx, rev_commit *c, char *name)
+{
+    cvs_tag_ref	*t = calloc (1, sizeof (cvs_tag_ref));
+
+    t->commit = c;
+    t->name = name;
+    *ctx->tags_tail = t;
+    ctx->tags_tail = &t->next;
+}
+
 /*
  * For each symbol, locate the appropriate commit
  */
@@ -409,8 +425,9 @@ rev_list_find_branch (rev_list *rl, cvs_number *number)
 }
 
 static void
-rev_list_set_refs (rev_list *rl, cvs_file *cvs)
+rev_list_set_refs (rev_list *rl, cvs_context *ctx)
 {
+    cvs_file	*cvs = ctx->file;
     rev_ref	*h;
     cvs_symbol	*s;
     rev_commit	*c;
@@ -451,7 +468,7 @@ rev_list_set_refs (rev_list *rl, cvs_file *cvs)
 	} else {
 	    c = rev_find_cvs_commit (rl, &s->number);
 	    if (c)
-		tag_commit(c, s->name);
+		rev_list_defer_tag (ctx, c, s->name);
 	}
     }
     /*
@@ -506,8 +523,8 @@ rev_list_set_refs (rev_list *rl, cvs_file *cvs)
 
 /*
  * Dead file revisions get an extra rev_file object which may be
- * needed during branch merging. Clean those up before returning
- * the resulting rev_list
+ * needed during branch merging. Drop those before returning
+ * the resulting rev_list; their storage goes with the others
  */
 
 static void
@@ -520,10 +537,8 @@ rev_list_free_dead_files (rev_list *rl)
 	if (h->tail)
 	    continue;
 	for (c = h->commit; c; c = c->parent) {
-	    if (c->nfiles == 0) {
-		rev_file_free (c->file);
+	    if (c->nfiles == 0)
 		c->file = 0;
-	    }
 	    if (c->tail)
 		break;
 	}
@@ -596,8 +611,9 @@ rev_list_sort_heads (rev_list *rl, cvs_file *cvs)
 }
 
 rev_list *
-rev_list_cvs (cvs_file *cvs)
+rev_list_cvs (cvs_context *ctx)
 {
+    cvs_file	*cvs = ctx->file;
     rev_list	*rl = calloc (1, sizeof (rev_list));
     cvs_number	trunk_number;
     rev_commit	*trunk; 
@@ -607,7 +623,7 @@ rev_list_cvs (cvs_file *cvs)
     rev_ref	*t;
     cvs_version	*ctrunk = NULL;
 
-    build_branches();
+    build_branches(ctx);
     /*
      * Locate first revision on trunk branch
      */
@@ -649,7 +665,7 @@ rev_list_cvs (cvs_file *cvs)
     }
     rev_list_patch_vendor_branch (rl, cvs);
     rev_list_graft_branches (rl, cvs);
-    rev_list_set_refs (rl, cvs);
+    rev_list_set_refs (rl, ctx);
     rev_list_sort_heads (rl, cvs);
     rev_list_set_tail (rl);
     rev_list_free_dead_files (rl);
@@ -21,34 +21,53 @@
 static int
 compare_names (const void *a, const void *b)
 {
-    const rev_file	*af = a, *bf = b;
+    const rev_file	*af = *(const rev_file **) a;
+    const rev_file	*bf = *(const rev_file **) b;
 
     return strcmp (af->name, bf->name);
 }
 
-#define REV_DIR_HASH	288361
-
 typedef struct _rev_dir_hash {
-    struct _rev_dir_hash    *next;
     unsigned long	    hash;
     rev_dir		    dir;
 } rev_dir_hash;
 
-static rev_dir_hash	*buckets[REV_DIR_HASH];
+/*
+ * Open addressing with linear probing, doubled whenever it is three
+ * quarters full
+ */
+#define REV_DIR_INIT_SIZE	4096
+
+static rev_dir_hash	**buckets;
+static unsigned long	nbuckets;
 
 static 
 unsigned long hash_files (rev_file **files, int nfiles)
 {
-    unsigned long   h = 0;
-    int		    i;
-
-    for (i = 0; i < nfiles; i++)
-	h = ((h << 1) | (h >> (sizeof (h) * 8 - 1))) ^ (unsigned long) files[i];
-    return h;
+    return hash_bytes (files, nfiles * sizeof (rev_file *));
 }
 
 static int	total_dirs = 0;
 
+static void
+rev_dir_grow (void)
+{
+    rev_dir_hash    **old = buckets;
+    unsigned long   nold = nbuckets;
+    unsigned long   i, b;
+
+    nbuckets = nbuckets ? nbuckets * 2 : REV_DIR_INIT_SIZE;
+    buckets = calloc (nbuckets, sizeof (rev_dir_hash *));
+    for (i = 0; i < nold; i++) {
+	if (!old[i])
+	    continue;
+	for (b = old[i]->hash & (nbuckets - 1); buckets[b]; b = (b + 1) & (nbuckets - 1))
+	    ;
+	buckets[b] = old[i];
+    }
+    free (old);
+}
+
 /*
  * Take a collection of file revisions and pack them together
  */
@@ -56,10 +75,12 @@ static rev_dir *
 rev_pack_dir (rev_file **files, int nfiles)
 {
     unsigned long   hash = hash_files (files, nfiles);
-    rev_dir_hash    **bucket = &buckets[hash % REV_DIR_HASH];
+    unsigned long   b;
     rev_dir_hash    *h;
 
-    for (h = *bucket; h; h = h->next) {
+    if ((unsigned long) (total_dirs + 1) * 4 > nbuckets * 3)
+	rev_dir_grow ();
+    for (b = hash & (nbuckets - 1); (h = buckets[b]); b = (b + 1) & (nbuckets - 1)) {
 	if (h->hash == hash && h->dir.nfiles == nfiles &&
 	    !memcmp (files, h->dir.files, nfiles * sizeof (rev_file *)))
 	{
@@ -67,8 +88,7 @@ rev_pack_dir (rev_file **files, int nfiles)
 	}
     }
     h = malloc (sizeof (rev_dir_hash) + nfiles * sizeof (rev_file *));
-    h->next = *bucket;
-    *bucket = h;
+    buckets[b] = h;
     h->hash = hash;
     h->dir.nfiles = nfiles;
     memcpy (h->dir.files, files, nfiles * sizeof (rev_file *));
@@ -82,17 +102,14 @@ static rev_dir **rds = NULL;
 void
 rev_free_dirs (void)
 {
-    unsigned long   hash;
-
-    for (hash = 0; hash < REV_DIR_HASH; hash++) {
-	rev_dir_hash    **bucket = &buckets[hash];
-	rev_dir_hash	*h;
-
-	while ((h = *bucket)) {
-	    *bucket = h->next;
-	    free (h);
-	}
-    }
+    unsigned long   b;
+
+    for (b = 0; b < nbuckets; b++)
+	free (buckets[b]);
+    free (buckets);
+    buckets = NULL;
+    nbuckets = 0;
+    total_dirs = 0;
     if (rds) {
 	free (rds);
 	rds = NULL;
@@ -17,6 +17,28 @@
  */
 
 #include "cvs.h"
+#include <pthread.h>
+
+/*
+ * Each file revision and commit may be referenced many times, from
+ * the per-file lists and the merged one, and all of them are needed
+ * until the end.  They are allocated together, from an arena shared by
+ * the threads parsing files, and freed together in rev_commit_cleanup.
+ */
+
+static arena		rev_arena;
+static pthread_mutex_t	rev_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *
+rev_alloc (size_t size)
+{
+    void	*p;
+
+    pthread_mutex_lock (&rev_arena_lock);
+    p = arena_alloc (&rev_arena, size);
+    pthread_mutex_unlock (&rev_arena_lock);
+    return p;
+}
 
 /*
  * Add head refs
@@ -52,10 +74,31 @@ rev_find_head (rev_list *rl, char *name)
 
 /*
  * We keep all file lists in a canonical sorted order,
- * first by latest date and then by the address of the rev_file object
- * (which are always unique)
+ * first by latest date, then by name and revision number.  The files
+ * are parsed on several threads, so their addresses do not give the
+ * same order from one run to the next; they only break what is left.
  */
 
+static int
+rev_file_order (rev_file *af, rev_file *bf)
+{
+    int	c;
+
+    if (af->name != bf->name) {
+	c = strcmp (af->name, bf->name);
+	if (c)
+	    return c;
+    }
+    c = cvs_number_compare (&af->number, &bf->number);
+    if (c)
+	return c;
+    if ((uintptr_t) af > (uintptr_t) bf)
+	return 1;
+    if ((uintptr_t) af < (uintptr_t) bf)
+	return -1;
+    return 0;
+}
+
 bool
 rev_file_later (rev_file *af, rev_file *bf)
 {
@@ -73,9 +116,7 @@ rev_file_later (rev_file *af, rev_file *bf)
 	return true;
     if (t < 0)
 	return false;
-    if ((uintptr_t) af > (uintptr_t) bf)
-	return true;
-    return false;
+    return rev_file_order (af, bf) > 0;
 }
 
 bool
@@ -345,8 +386,10 @@ rev_commit_date_compare (const void *av, const void *bv)
     if (t)
 	return t;
     /*
-     * Ensure total order by ordering based on file address
+     * Ensure total order by ordering based on the file
      */
+    if (a->file && b->file)
+	return -rev_file_order (a->file, b->file);
     if ((uintptr_t) a->file > (uintptr_t) b->file)
 	return -1;
     if ((uintptr_t) a->file < (uintptr_t) b->file)
@@ -407,6 +450,7 @@ rev_commit_cleanup (void)
 	files = NULL;
 	sfiles = 0;
     }
+    arena_free (&rev_arena);
 }
 
 static rev_commit *
@@ -437,8 +481,8 @@ rev_commit_build (rev_commit **commits, rev_commit *leader, int ncommit)
     
     rds = rev_pack_files (files, nfile, &nds);
         
-    commit = calloc (1, sizeof (rev_commit) +
-		     nds * sizeof (rev_dir *));
+    commit = rev_alloc (sizeof (rev_commit) +
+			nds * sizeof (rev_dir *));
     
     commit->date = leader->date;
     commit->commitid = leader->commitid;
@@ -1000,41 +1044,10 @@ rev_list_merge (rev_list *head)
     return rl;
 }
 
-/*
- * Icky. each file revision may be referenced many times in a single
- * tree. When freeing the tree, queue the file objects to be deleted
- * and clean them up afterwards
- */
-
-static rev_file *rev_files;
-
-static void
-rev_file_mark_for_free (rev_file *f)
-{
-    if (f->name) {
-	f->name = NULL;
-	f->link = rev_files;
-	rev_files = f;
-    }
-}
-
-static void
-rev_file_free_marked (void)
-{
-    rev_file	*f, *n;
-
-    for (f = rev_files; f; f = n)
-    {
-	n = f->link;
-	free (f);
-    }
-    rev_files = NULL;
-}
-
 rev_file *
 rev_file_rev (char *name, cvs_number *n, time_t date)
 {
-    rev_file	*f = calloc (1, sizeof (rev_file));
+    rev_file	*f = rev_alloc (sizeof (rev_file));
 
     f->name = name;
     f->number = *n;
@@ -1043,45 +1056,20 @@ rev_file_rev (char *name, cvs_number *n, time_t date)
 }
 
 void
-rev_file_free (rev_file *f)
-{
-    free (f);
-}
-
-static void
-rev_commit_free (rev_commit *commit, int free_files)
-{
-    rev_commit	*c;
-
-    while ((c = commit)) {
-	commit = c->parent;
-	if (--c->seen == 0)
-	{
-	    if (free_files && c->file)
-		rev_file_mark_for_free (c->file);
-	    free (c);
-	}
-    }
-}
-
-void
-rev_head_free (rev_ref *head, int free_files)
+rev_head_free (rev_ref *head)
 {
     rev_ref	*h;
 
     while ((h = head)) {
 	head = h->next;
-	rev_commit_free (h->commit, free_files);
 	free (h);
     }
 }
 
 void
-rev_list_free (rev_list *rl, int free_files)
+rev_list_free (rev_list *rl)
 {
-    rev_head_free (rl->heads, free_files);
-    if (free_files)
-	rev_file_free_marked ();
+    rev_head_free (rl->heads);
     free (rl);
 }
 
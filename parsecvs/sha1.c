@@ -0,0 +1,137 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or (at
+ *  your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ */
+
+/*
+ * SHA-1 (FIPS 180-1), just enough of it to name blobs the way git
+ * does, so that identical file contents can be told apart from
+ * different ones without keeping them around.
+ */
+
+#include "cvs.h"
+#include <stdint.h>
+
+typedef struct _sha1_state {
+    uint32_t		h[5];
+    uint64_t		len;
+    unsigned char	buf[64];
+    int			nbuf;
+} sha1_state;
+
+#define ROL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+sha1_block (sha1_state *s, const unsigned char *p)
+{
+    uint32_t	w[80];
+    uint32_t	a, b, c, d, e, f, k, t;
+    int		i;
+
+    for (i = 0; i < 16; i++)
+	w[i] = (uint32_t) p[4*i] << 24 | (uint32_t) p[4*i+1] << 16 |
+	       (uint32_t) p[4*i+2] << 8 | p[4*i+3];
+    for (; i < 80; i++)
+	w[i] = ROL (w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3]; e = s->h[4];
+    for (i = 0; i < 80; i++) {
+	if (i < 20) {
+	    f = (b & c) | (~b & d);
+	    k = 0x5a827999;
+	} else if (i < 40) {
+	    f = b ^ c ^ d;
+	    k = 0x6ed9eba1;
+	} else if (i < 60) {
+	    f = (b & c) | (b & d) | (c & d);
+	    k = 0x8f1bbcdc;
+	} else {
+	    f = b ^ c ^ d;
+	    k = 0xca62c1d6;
+	}
+	t = ROL (a, 5) + f + e + k + w[i];
+	e = d; d = c; c = ROL (b, 30); b = a; a = t;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d; s->h[4] += e;
+}
+
+static void
+sha1_init (sha1_state *s)
+{
+    s->h[0] = 0x67452301;
+    s->h[1] = 0xefcdab89;
+    s->h[2] = 0x98badcfe;
+    s->h[3] = 0x10325476;
+    s->h[4] = 0xc3d2e1f0;
+    s->len = 0;
+    s->nbuf = 0;
+}
+
+static void
+sha1_update (sha1_state *s, const void *data, size_t len)
+{
+    const unsigned char	*p = data;
+    size_t		n;
+
+    s->len += len;
+    if (s->nbuf) {
+	n = 64 - s->nbuf < len ? 64 - s->nbuf : len;
+	memcpy (s->buf + s->nbuf, p, n);
+	s->nbuf += n;
+	p += n;
+	len -= n;
+	if (s->nbuf < 64)
+	    return;
+	sha1_block (s, s->buf);
+	s->nbuf = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+	sha1_block (s, p);
+    memcpy (s->buf, p, len);
+    s->nbuf = len;
+}
+
+static void
+sha1_final (sha1_state *s, unsigned char *sha1)
+{
+    uint64_t	bits = s->len * 8;
+    int		i;
+
+    s->buf[s->nbuf++] = 0x80;
+    if (s->nbuf > 56) {
+	memset (s->buf + s->nbuf, 0, 64 - s->nbuf);
+	sha1_block (s, s->buf);
+	s->nbuf = 0;
+    }
+    memset (s->buf + s->nbuf, 0, 56 - s->nbuf);
+    for (i = 0; i < 8; i++)
+	s->buf[56 + i] = bits >> (56 - 8 * i);
+    sha1_block (s, s->buf);
+    for (i = 0; i < 20; i++)
+	sha1[i] = s->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+void
+sha1_blob (const void *data, unsigned long len, unsigned char *sha1)
+/* the name git gives a blob with these contents */
+{
+    sha1_state	s;
+    char	header[32];
+
+    sha1_init (&s);
+    sha1_update (&s, header, snprintf (header, sizeof (header), "blob %lu", len) + 1);
+    sha1_update (&s, data, len);
+    sha1_final (&s, sha1);
+}
+
+/* end */
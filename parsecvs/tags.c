@@ -36,16 +36,16 @@ static Tag *find_tag(char *name)
 	return tag;
 }
 
-void tag_commit(rev_commit *c, char *name)
-/* add a commit to the list associated with a named tag (this_file implicit) */
+void tag_commit(rev_commit *c, char *name, char *filename)
+/* add a commit to the list associated with a named tag */
 {
 	Tag *tag = find_tag(name);
-	if (tag->last == this_file->name) {
+	if (tag->last == filename) {
 		fprintf(stderr, "duplicate tag %s in %s, ignoring\n",
-			name, this_file->name);
+			name, filename);
 		return;
 	}
-	tag->last = this_file->name;
+	tag->last = filename;
 	if (!tag->left) {
 		Chunk *v = malloc(sizeof(Chunk));
 		v->next = tag->commits;
@@ -0,0 +1,195 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "atoms.h"
+
+#include <QHash>
+#include <QVarLengthArray>
+
+#include <string.h>
+
+// Every atom is preceded by its header in the arena.
+struct AtomHeader
+{
+    int size;
+    uint hash;
+};
+
+static const int ArenaChunkSize = 64 * 1024;
+
+static inline const AtomHeader *header(Atom atom)
+{
+    return reinterpret_cast<const AtomHeader *>(atom) - 1;
+}
+
+static inline uint atomHash(const char *data, int size)
+{
+    return qHashBits(data, size, 0);
+}
+
+// Encodes UTF-16 into out, which must have room for 3 bytes per QChar, and
+// returns the number of bytes written. Lone surrogates become U+FFFD, which
+// is what QString::toUtf8() does as well.
+static int encodeUtf8(char *out, const QChar *s, int size)
+{
+    uchar *d = reinterpret_cast<uchar *>(out);
+    for (int i = 0; i < size; ++i) {
+        uint c = s[i].unicode();
+        if (c < 0x80) {
+            *d++ = c;
+            continue;
+        }
+        if (c < 0x800) {
+            *d++ = 0xc0 | (c >> 6);
+            *d++ = 0x80 | (c & 0x3f);
+            continue;
+        }
+        if (QChar::isHighSurrogate(c) && i + 1 < size && s[i + 1].isLowSurrogate()) {
+            c = QChar::surrogateToUcs4(c, s[++i].unicode());
+            *d++ = 0xf0 | (c >> 18);
+            *d++ = 0x80 | ((c >> 12) & 0x3f);
+            *d++ = 0x80 | ((c >> 6) & 0x3f);
+            *d++ = 0x80 | (c & 0x3f);
+            continue;
+        }
+        if (QChar::isSurrogate(c))
+            c = QChar::ReplacementCharacter;
+        *d++ = 0xe0 | (c >> 12);
+        *d++ = 0x80 | ((c >> 6) & 0x3f);
+        *d++ = 0x80 | (c & 0x3f);
+    }
+    return d - reinterpret_cast<uchar *>(out);
+}
+
+void appendUtf8(QByteArray &out, const QChar *s, int size)
+{
+    int old = out.size();
+    out.resize(old + 3 * size);
+    out.resize(old + encodeUtf8(out.data() + old, s, size));
+}
+
+AtomTable *AtomTable::instance()
+{
+    static AtomTable table;
+    return &table;
+}
+
+AtomTable::AtomTable()
+    : m_free(0), m_left(0), m_arenaBytes(0), m_buckets(1024), m_count(0)
+{
+}
+
+AtomTable::~AtomTable()
+{
+    foreach (char *chunk, m_chunks)
+        delete[] chunk;
+}
+
+int AtomTable::size(Atom atom)
+{
+    return header(atom)->size;
+}
+
+qint64 AtomTable::memoryUsage() const
+{
+    return m_arenaBytes + m_buckets.capacity() * sizeof(Atom)
+        + m_chunks.capacity() * sizeof(char *);
+}
+
+// The bucket holding the atom, or the empty one it would go to.
+int AtomTable::bucket(const char *data, int size, uint hash) const
+{
+    int mask = m_buckets.size() - 1;
+    for (int i = hash & mask; ; i = (i + 1) & mask) {
+        Atom atom = m_buckets.at(i);
+        if (!atom)
+            return i;
+        const AtomHeader *h = header(atom);
+        if (h->hash == hash && h->size == size && !memcmp(atom, data, size))
+            return i;
+    }
+}
+
+void AtomTable::rehash()
+{
+    QVector<Atom> old = m_buckets;
+    m_buckets = QVector<Atom>(old.size() * 2);
+    int mask = m_buckets.size() - 1;
+    foreach (Atom atom, old) {
+        if (!atom)
+            continue;
+        int i = header(atom)->hash & mask;
+        while (m_buckets.at(i))
+            i = (i + 1) & mask;
+        m_buckets[i] = atom;
+    }
+}
+
+Atom AtomTable::find(const char *data, int size) const
+{
+    return m_buckets.at(bucket(data, size, atomHash(data, size)));
+}
+
+Atom AtomTable::find(const QChar *data, int size) const
+{
+    QVarLengthArray<char, 256> utf8(3 * size);
+    return find(utf8.data(), encodeUtf8(utf8.data(), data, size));
+}
+
+Atom AtomTable::intern(const char *data, int size)
+{
+    uint hash = atomHash(data, size);
+    int i = bucket(data, size, hash);
+    if (m_buckets.at(i))
+        return m_buckets.at(i);
+
+    // header, string and NUL, rounded up to keep the next header aligned
+    int needed = (sizeof(AtomHeader) + size + 1 + sizeof(AtomHeader) - 1) & ~(sizeof(AtomHeader) - 1);
+    char *p;
+    if (needed > ArenaChunkSize / 4) {
+        // big ones get a chunk of their own so the current one is not wasted
+        p = new char[needed];
+        m_chunks.append(p);
+        m_arenaBytes += needed;
+    } else {
+        if (needed > m_left) {
+            m_free = new char[ArenaChunkSize];
+            m_left = ArenaChunkSize;
+            m_chunks.append(m_free);
+            m_arenaBytes += ArenaChunkSize;
+        }
+        p = m_free;
+        m_free += needed;
+        m_left -= needed;
+    }
+
+    AtomHeader *h = reinterpret_cast<AtomHeader *>(p);
+    h->size = size;
+    h->hash = hash;
+    char *atom = reinterpret_cast<char *>(h + 1);
+    memcpy(atom, data, size);
+    atom[size] = '\0';
+
+    m_buckets[i] = atom;
+    if (++m_count * 2 > m_buckets.size())
+        rehash();
+    return atom;
+}
+
+Atom AtomTable::intern(const QChar *data, int size)
+{
+    QVarLengthArray<char, 256> utf8(3 * size);
+    return intern(utf8.data(), encodeUtf8(utf8.data(), data, size));
+}
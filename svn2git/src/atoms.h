@@ -0,0 +1,72 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATOMS_H
+#define ATOMS_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+// An interned, NUL terminated UTF-8 string. Equal strings are the same
+// atom, so atoms compare and hash by pointer. The bytes stay in the table
+// until the program exits.
+typedef const char *Atom;
+
+// Path components and branch names are interned here so the hot paths can
+// pass them around without converting between QString and QByteArray. Only
+// the exporting thread may use it.
+class AtomTable
+{
+public:
+    static AtomTable *instance();
+
+    Atom intern(const char *data, int size);
+    Atom intern(const QByteArray &s) { return intern(s.constData(), s.size()); }
+    Atom intern(const QChar *data, int size);
+    Atom intern(const QString &s) { return intern(s.constData(), s.size()); }
+    // like intern(), but returns 0 instead of adding a new atom
+    Atom find(const char *data, int size) const;
+    Atom find(const QChar *data, int size) const;
+    Atom find(const QString &s) const { return find(s.constData(), s.size()); }
+
+    static int size(Atom atom);
+    static QByteArray bytes(Atom atom) { return QByteArray(atom, size(atom)); }
+    static QString string(Atom atom) { return QString::fromUtf8(atom, size(atom)); }
+
+    int count() const { return m_count; }
+    qint64 memoryUsage() const;
+
+private:
+    AtomTable();
+    ~AtomTable();
+    Q_DISABLE_COPY(AtomTable)
+
+    int bucket(const char *data, int size, uint hash) const;
+    void rehash();
+
+    QVector<char *> m_chunks;
+    char *m_free;
+    int m_left;
+    qint64 m_arenaBytes;
+    QVector<Atom> m_buckets;
+    int m_count;
+};
+
+// Appends the UTF-8 encoding of s to out without a temporary QByteArray.
+void appendUtf8(QByteArray &out, const QChar *s, int size);
+inline void appendUtf8(QByteArray &out, const QString &s) { appendUtf8(out, s.constData(), s.size()); }
+
+#endif
@@ -17,6 +17,7 @@
 
 #include <QCoreApplication>
 #include <QFile>
+#include <QLoggingCategory>
 #include <QStringList>
 #include <QTextStream>
 #include <QDebug>
@@ -27,6 +28,8 @@
 #include "CommandLineParser.h"
 #include "ruleparser.h"
 #include "repository.h"
+#include "atoms.h"
+#include "metrics.h"
 #include "svn.h"
 
 QHash<QByteArray, QByteArray> loadIdentityMapFile(const QString &fileName)
@@ -133,6 +136,7 @@ static const CommandLineOption options[] = {
     {"--msg-filter FILENAME", "External program / script to modify svn log message"},
     {"--add-metadata", "if passed, each git commit will have svn commit info"},
     {"--add-metadata-notes", "if passed, each git commit will have notes with svn commit info"},
+    {"--squash-notes", "with --add-metadata-notes, write all notes in a single notes commit at the end"},
     {"--resume-from revision", "start importing at svn revision number"},
     {"--max-rev revision", "stop importing at svn revision number"},
     {"--dry-run", "don't actually write anything"},
@@ -140,10 +144,19 @@ static const CommandLineOption options[] = {
     {"--debug-rules", "print what rule is being used for each file"},
     {"--commit-interval NUMBER", "if passed the cache will be flushed to git every NUMBER of commits"},
     {"--stats", "after a run print some statistics about the rules"},
+    {"--metrics FILENAME", "write phase timings and per-repository counters to FILENAME while running"},
+    {"--metrics-format FORMAT", "prometheus (the default) or json"},
+    {"--metrics-interval REVISIONS", "rewrite the metrics file every REVISIONS revisions, default 1000"},
+    {"--benchmark FILENAME[,FILENAME]", "time the rules, path splitting and commit writing on --debug-rules output or fast-import logs"},
+    {"--check-rules FILENAME", "match the paths of a --debug-rules log with PCRE and QRegExp and report where they differ"},
     {"--svn-branches", "Use the contents of SVN when creating branches, Note: SVN tags are branches as well"},
     {"--empty-dirs", "Add .gitignore-file for empty dirs"},
     {"--svn-ignore", "Import svn-ignore-properties via .gitignore"},
     {"--propcheck", "Check for svn-properties except svn-ignore"},
+    {"--prefetch DEPTH", "read up to DEPTH revisions ahead of the one being exported on background threads"},
+    {"--prefetch-cache MEGABYTES", "size of the svn cache shared with the prefetch threads, default 512"},
+    {"--write-buffer MEGABYTES", "size of the buffer in front of each fast-import process, default 4"},
+    {"--native-pack", "experimental: write packfiles, refs and marks in-process instead of running git fast-import"},
     {"--fast-import-timeout SECONDS", "number of seconds to wait before terminating fast-import, 0 to wait forever"},
     {"-h, --help", "show help"},
     {"-v, --version", "show version"},
@@ -190,11 +203,55 @@ int main(int argc, char **argv)
         out << "WARNING; no identity-map or -domain specified, all commits will use default @localhost email address\n\n";
     }
 
+    // starts the clock and checks --metrics-format
+    Metrics::instance();
+
     QCoreApplication app(argc, argv);
     // Load the configuration
     RulesList rulesList(args->optionArgument(QLatin1String("rules")));
     rulesList.load();
 
+    if (args->contains(QLatin1String("check-rules"))) {
+        QList<MatchRuleList> allMatchRules;
+        foreach (const QList<Rules::Match> &matchRules, rulesList.allMatchRules())
+            allMatchRules.append(MatchRuleList(matchRules));
+        return checkMatchRules(allMatchRules, args->optionArgument(QLatin1String("check-rules"))) == 0
+            ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (args->contains(QLatin1String("benchmark"))) {
+        // the rules get loaded over and over
+        QLoggingCategory::setFilterRules(QStringLiteral("*.debug=false"));
+        const QString rulesFiles = args->optionArgument(QLatin1String("rules"));
+        benchmark("RulesList::load", 1, [&]() {
+            RulesList rules(rulesFiles);
+            rules.load();
+        });
+
+        QList<MatchRuleList> allMatchRules;
+        foreach (const QList<Rules::Match> &matchRules, rulesList.allMatchRules())
+            allMatchRules.append(MatchRuleList(matchRules));
+        Svn::initialize();
+        foreach (const QString &fileName, args->optionArgument(QLatin1String("benchmark")).split(',')) {
+            QFile file(fileName);
+            if (!file.open(QIODevice::ReadOnly)) {
+                qCritical() << "Could not open" << fileName << ":" << file.errorString();
+                return EXIT_FAILURE;
+            }
+            if (file.readLine().startsWith("commit ")) {
+                benchmarkFastImportLog(fileName);
+                continue;
+            }
+            MatchPathList paths;
+            if (!readMatchPaths(fileName, &paths))
+                return EXIT_FAILURE;
+            printf("%d paths in %s\n", paths.size(), qPrintable(fileName));
+            benchmarkMatchRules(allMatchRules, paths);
+            Svn::benchmarkSplitPathName(allMatchRules, paths);
+        }
+        return EXIT_SUCCESS;
+    }
+
     int resume_from = args->optionArgument(QLatin1String("resume-from")).toInt();
     int max_rev = args->optionArgument(QLatin1String("max-rev")).toInt();
 
@@ -213,6 +270,7 @@ int main(int argc, char **argv)
         int repo_next = repo->setupIncremental(cutoff);
         repo->restoreAnnotatedTags();
         repo->restoreBranchNotes();
+        repo->restoreBlobIndex(cutoff);
 
         /*
   * cutoff < resume_from => error exit eventually
@@ -264,6 +322,10 @@ int main(int argc, char **argv)
     if (max_rev < 1)
         max_rev = svn.youngestRevision();
 
+    int prefetch = args->optionArgument(QLatin1String("prefetch"), QLatin1String("0")).toInt();
+    if (prefetch > 0)
+        svn.startPrefetch(prefetch, qMin(max_rev, svn.youngestRevision()));
+
     bool errors = false;
     QSet<int> revisions = loadRevisionsFile(args->optionArgument(QLatin1String("revisions-file")), svn);
     const bool filerRevisions = !revisions.isEmpty();
@@ -280,6 +342,7 @@ int main(int argc, char **argv)
             errors = true;
             break;
         }
+        Metrics::instance()->revisionExported(i);
     }
 
     foreach (Repository *repo, repositories) {
@@ -287,6 +350,8 @@ int main(int argc, char **argv)
         repo->saveBranchNotes();
         delete repo;
     }
+    Stats::instance()->atomTableUsage(AtomTable::instance()->count(), AtomTable::instance()->memoryUsage());
     Stats::instance()->printStats();
+    Metrics::instance()->write();
     return errors ? EXIT_FAILURE : EXIT_SUCCESS;
 }
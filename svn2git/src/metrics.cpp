@@ -0,0 +1,293 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+#include "CommandLineParser.h"
+
+#include <QDebug>
+#include <QSaveFile>
+
+#include <stdio.h>
+
+static const char *const phaseNames[Metrics::PhaseCount] = {
+    "prepare_transactions",
+    "find_match_rule",
+    "dump_blob",
+    "fast_import_wait",
+    "mergeinfo",
+    "commit",
+    "checkpoint"
+};
+
+static const char *const branchClassNames[Metrics::BranchClassCount] = {
+    "head", "stable", "vendor", "user", "other"
+};
+
+Metrics *Metrics::instance()
+{
+    static Metrics metrics;
+    return &metrics;
+}
+
+Metrics::Metrics()
+    : m_json(false), m_interval(0), m_revisions(0), m_lastRevision(0)
+{
+    CommandLineParser *args = CommandLineParser::instance();
+    m_fileName = args->optionArgument(QLatin1String("metrics"));
+    QString format = args->optionArgument(QLatin1String("metrics-format"), QLatin1String("prometheus"));
+    if (format == QLatin1String("json"))
+        m_json = true;
+    else if (format != QLatin1String("prometheus"))
+        qFatal("Unknown metrics format %s, use prometheus or json", qPrintable(format));
+    m_interval = args->optionArgument(QLatin1String("metrics-interval"), QLatin1String("1000")).toInt();
+
+    for (int i = 0; i < PhaseCount; ++i)
+        m_phaseNsecs[i] = m_phaseCalls[i] = 0;
+    m_clock.start();
+}
+
+Metrics::Counters::Counters()
+    : blockedNsecs(0), fastImportBytes(0)
+{
+    for (int i = 0; i < BranchClassCount; ++i)
+        commits[i] = blobs[i] = reusedBlobs[i] = bytes[i] = 0;
+}
+
+// The FreeBSD layout: head, stable/N and releng/N, vendor trees and the
+// user/ and projects/ sandboxes.
+Metrics::BranchClass Metrics::branchClass(const QByteArray &branch)
+{
+    if (branch == "master" || branch == "head" || branch == "main")
+        return Head;
+    if (branch.startsWith("stable/") || branch.startsWith("releng/") || branch.startsWith("release/"))
+        return Stable;
+    if (branch.startsWith("vendor"))
+        return Vendor;
+    if (branch.startsWith("user/") || branch.startsWith("projects/"))
+        return User;
+    return Other;
+}
+
+void Metrics::commitWritten(const QString &repository, const QByteArray &branch)
+{
+    ++m_repositories[repository].commits[branchClass(branch)];
+}
+
+void Metrics::blobWritten(const QString &repository, const QByteArray &branch, qint64 bytes, bool reused)
+{
+    Counters &c = m_repositories[repository];
+    BranchClass bc = branchClass(branch);
+    if (reused) {
+        ++c.reusedBlobs[bc];
+    } else {
+        ++c.blobs[bc];
+        c.bytes[bc] += bytes;
+    }
+}
+
+void Metrics::pipeBlocked(const QString &repository, qint64 nsecs)
+{
+    m_repositories[repository].blockedNsecs += nsecs;
+    addTime(FastImportWait, nsecs);
+}
+
+void Metrics::fastImportWritten(const QString &repository, qint64 bytes)
+{
+    m_repositories[repository].fastImportBytes += bytes;
+}
+
+void Metrics::revisionExported(int revnum)
+{
+    ++m_revisions;
+    m_lastRevision = revnum;
+    if (m_interval > 0 && m_revisions % m_interval == 0)
+        write();
+}
+
+void Metrics::write()
+{
+    if (m_fileName.isEmpty())
+        return;
+
+    // readers never see a half written file
+    QSaveFile file(m_fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "WARN: Unable to open" << m_fileName << "for writing metrics";
+        return;
+    }
+    file.write(m_json ? json() : prometheus());
+    if (!file.commit())
+        qWarning() << "WARN: Unable to write metrics to" << m_fileName << file.errorString();
+}
+
+void benchmark(const char *name, qint64 ops, const std::function<void()> &round)
+{
+    if (!ops) {
+        printf("%-32s no input\n", name);
+        return;
+    }
+    // one untimed round to warm up the caches
+    round();
+    QElapsedTimer timer;
+    timer.start();
+    qint64 rounds = 0;
+    do {
+        round();
+        ++rounds;
+    } while (timer.elapsed() < 1000);
+    double nsecs = timer.nsecsElapsed() / double(rounds * ops);
+    printf("%-32s %12lld ops %12.1f ns/op\n", name, rounds * ops, nsecs);
+}
+
+static QByteArray rate(qint64 count, double seconds)
+{
+    return QByteArray::number(seconds > 0 ? count / seconds : 0.0, 'f', 3);
+}
+
+static QByteArray labelValue(const QString &s)
+{
+    QByteArray value = s.toUtf8();
+    return value.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+}
+
+static QByteArray label(const QString &repository, const char *branchClass)
+{
+    return "{repository=\"" + labelValue(repository) + "\",branch_class=\"" + branchClass + "\"}";
+}
+
+QByteArray Metrics::prometheus() const
+{
+    double seconds = m_clock.nsecsElapsed() / 1e9;
+    qint64 commits = 0, blobs = 0, bytes = 0;
+    QByteArray out;
+
+    out += "# TYPE svn2git_elapsed_seconds gauge\n";
+    out += "svn2git_elapsed_seconds " + QByteArray::number(seconds, 'f', 3) + "\n";
+    out += "# TYPE svn2git_revisions_total counter\n";
+    out += "svn2git_revisions_total " + QByteArray::number(m_revisions) + "\n";
+    out += "# TYPE svn2git_last_revision gauge\n";
+    out += "svn2git_last_revision " + QByteArray::number(m_lastRevision) + "\n";
+
+    out += "# TYPE svn2git_phase_seconds_total counter\n";
+    for (int i = 0; i < PhaseCount; ++i)
+        out += QByteArray("svn2git_phase_seconds_total{phase=\"") + phaseNames[i] + "\"} "
+               + QByteArray::number(m_phaseNsecs[i] / 1e9, 'f', 6) + "\n";
+    out += "# TYPE svn2git_phase_calls_total counter\n";
+    for (int i = 0; i < PhaseCount; ++i)
+        out += QByteArray("svn2git_phase_calls_total{phase=\"") + phaseNames[i] + "\"} "
+               + QByteArray::number(m_phaseCalls[i]) + "\n";
+
+    static const char *const series[] = {
+        "commits", "blobs", "reused_blobs", "blob_bytes"
+    };
+    for (int s = 0; s < 4; ++s) {
+        out += QByteArray("# TYPE svn2git_") + series[s] + "_total counter\n";
+        for (QHash<QString, Counters>::const_iterator it = m_repositories.constBegin();
+             it != m_repositories.constEnd(); ++it) {
+            const Counters &c = it.value();
+            const qint64 *values[] = { c.commits, c.blobs, c.reusedBlobs, c.bytes };
+            for (int i = 0; i < BranchClassCount; ++i) {
+                if (!values[s][i])
+                    continue;
+                out += QByteArray("svn2git_") + series[s] + "_total" + label(it.key(), branchClassNames[i])
+                       + " " + QByteArray::number(values[s][i]) + "\n";
+            }
+        }
+    }
+    out += "# TYPE svn2git_pipe_blocked_seconds_total counter\n";
+    for (QHash<QString, Counters>::const_iterator it = m_repositories.constBegin();
+         it != m_repositories.constEnd(); ++it)
+        out += "svn2git_pipe_blocked_seconds_total{repository=\"" + labelValue(it.key()) + "\"} "
+               + QByteArray::number(it.value().blockedNsecs / 1e9, 'f', 6) + "\n";
+    out += "# TYPE svn2git_fast_import_bytes_total counter\n";
+    for (QHash<QString, Counters>::const_iterator it = m_repositories.constBegin();
+         it != m_repositories.constEnd(); ++it) {
+        out += "svn2git_fast_import_bytes_total{repository=\"" + labelValue(it.key()) + "\"} "
+               + QByteArray::number(it.value().fastImportBytes) + "\n";
+        for (int i = 0; i < BranchClassCount; ++i) {
+            commits += it.value().commits[i];
+            blobs += it.value().blobs[i];
+            bytes += it.value().bytes[i];
+        }
+    }
+
+    out += "# TYPE svn2git_commits_per_second gauge\n";
+    out += "svn2git_commits_per_second " + rate(commits, seconds) + "\n";
+    out += "# TYPE svn2git_blobs_per_second gauge\n";
+    out += "svn2git_blobs_per_second " + rate(blobs, seconds) + "\n";
+    out += "# TYPE svn2git_blob_bytes_per_second gauge\n";
+    out += "svn2git_blob_bytes_per_second " + rate(bytes, seconds) + "\n";
+    return out;
+}
+
+static QByteArray jsonString(const QString &s)
+{
+    QByteArray out = "\"";
+    foreach (char c, s.toUtf8()) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (uchar(c) < 0x20) {
+            out += "\\u" + QByteArray::number(uchar(c), 16).rightJustified(4, '0');
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+QByteArray Metrics::json() const
+{
+    double seconds = m_clock.nsecsElapsed() / 1e9;
+    qint64 commits = 0, blobs = 0, bytes = 0;
+    QByteArray out = "{\n";
+
+    out += "  \"elapsed_seconds\": " + QByteArray::number(seconds, 'f', 3) + ",\n";
+    out += "  \"revisions\": " + QByteArray::number(m_revisions) + ",\n";
+    out += "  \"last_revision\": " + QByteArray::number(m_lastRevision) + ",\n";
+    out += "  \"phases\": {";
+    for (int i = 0; i < PhaseCount; ++i)
+        out += QByteArray(i ? "," : "") + "\n    \"" + phaseNames[i] + "\": { \"seconds\": "
+               + QByteArray::number(m_phaseNsecs[i] / 1e9, 'f', 6) + ", \"calls\": "
+               + QByteArray::number(m_phaseCalls[i]) + " }";
+    out += "\n  },\n  \"repositories\": {";
+
+    bool first = true;
+    for (QHash<QString, Counters>::const_iterator it = m_repositories.constBegin();
+         it != m_repositories.constEnd(); ++it) {
+        const Counters &c = it.value();
+        out += QByteArray(first ? "" : ",") + "\n    " + jsonString(it.key()) + ": {\n";
+        out += "      \"pipe_blocked_seconds\": " + QByteArray::number(c.blockedNsecs / 1e9, 'f', 6) + ",\n";
+        out += "      \"fast_import_bytes\": " + QByteArray::number(c.fastImportBytes) + ",\n";
+        out += "      \"branch_classes\": {";
+        for (int i = 0; i < BranchClassCount; ++i) {
+            out += QByteArray(i ? "," : "") + "\n        \"" + branchClassNames[i] + "\": { \"commits\": "
+                   + QByteArray::number(c.commits[i]) + ", \"blobs\": " + QByteArray::number(c.blobs[i])
+                   + ", \"reused_blobs\": " + QByteArray::number(c.reusedBlobs[i])
+                   + ", \"blob_bytes\": " + QByteArray::number(c.bytes[i]) + " }";
+            commits += c.commits[i];
+            blobs += c.blobs[i];
+            bytes += c.bytes[i];
+        }
+        out += "\n      }\n    }";
+        first = false;
+    }
+    out += "\n  },\n";
+
+    out += "  \"commits_per_second\": " + rate(commits, seconds) + ",\n";
+    out += "  \"blobs_per_second\": " + rate(blobs, seconds) + ",\n";
+    out += "  \"blob_bytes_per_second\": " + rate(bytes, seconds) + "\n";
+    return out + "}\n";
+}
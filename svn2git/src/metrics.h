@@ -0,0 +1,107 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QString>
+
+#include <functional>
+
+// Counters and phase timers that are always collected, and written with
+// --metrics as Prometheus text or JSON every --metrics-interval revisions
+// and at exit.  Only the exporting thread may use it.
+class Metrics
+{
+public:
+    // phases nest: the time blocked on fast-import is also part of the
+    // phase that was writing
+    enum Phase {
+        PrepareTransactions,
+        FindMatchRule,
+        DumpBlob,
+        FastImportWait,
+        Mergeinfo,
+        Commit,
+        Checkpoint,
+        PhaseCount
+    };
+    enum BranchClass { Head, Stable, Vendor, User, Other, BranchClassCount };
+
+    class Timer
+    {
+    public:
+        explicit Timer(Phase phase) : m_phase(phase) { m_timer.start(); }
+        ~Timer() { Metrics::instance()->addTime(m_phase, m_timer.nsecsElapsed()); }
+    private:
+        Q_DISABLE_COPY(Timer)
+        Phase m_phase;
+        QElapsedTimer m_timer;
+    };
+
+    static Metrics *instance();
+    static BranchClass branchClass(const QByteArray &branch);
+
+    void addTime(Phase phase, qint64 nsecs)
+    {
+        m_phaseNsecs[phase] += nsecs;
+        ++m_phaseCalls[phase];
+    }
+    void commitWritten(const QString &repository, const QByteArray &branch);
+    void blobWritten(const QString &repository, const QByteArray &branch, qint64 bytes, bool reused);
+    void pipeBlocked(const QString &repository, qint64 nsecs);
+    // every byte of the stream, as it goes to fast-import
+    void fastImportWritten(const QString &repository, qint64 bytes);
+
+    // writes the metrics file every --metrics-interval revisions
+    void revisionExported(int revnum);
+    void write();
+
+private:
+    Metrics();
+    Q_DISABLE_COPY(Metrics)
+
+    struct Counters
+    {
+        Counters();
+        qint64 commits[BranchClassCount];
+        qint64 blobs[BranchClassCount];
+        qint64 reusedBlobs[BranchClassCount];
+        qint64 bytes[BranchClassCount];
+        qint64 blockedNsecs;
+        qint64 fastImportBytes;
+    };
+    QByteArray prometheus() const;
+    QByteArray json() const;
+
+    QString m_fileName;
+    bool m_json;
+    int m_interval;
+    QElapsedTimer m_clock;
+    qint64 m_phaseNsecs[PhaseCount];
+    qint64 m_phaseCalls[PhaseCount];
+    qint64 m_revisions;
+    int m_lastRevision;
+    QHash<QString, Counters> m_repositories;
+};
+
+// For --benchmark: runs round, which does ops operations, until a second
+// has passed and prints the time per operation.
+void benchmark(const char *name, qint64 ops, const std::function<void()> &round);
+
+#endif
@@ -0,0 +1,1334 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "packimporter.h"
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QtEndian>
+
+#include <algorithm>
+
+static const char *const typeNames[] = { 0, "commit", "tree", "blob", "tag" };
+static const char emptyTreeHex[] = "4b825dc642cb6eb9a060e54bf8d69288fbee4904";
+
+ObjectId ObjectId::fromRaw(const char *data)
+{
+    ObjectId id;
+    memcpy(id.sha1, data, sizeof(id.sha1));
+    return id;
+}
+
+bool ObjectId::fromHex(const QByteArray &hex, ObjectId *id)
+{
+    if (hex.size() != 40)
+        return false;
+    for (int i = 0; i < 40; ++i) {
+        if (!isxdigit(uchar(hex.at(i))))
+            return false;
+    }
+    *id = fromRaw(QByteArray::fromHex(hex).constData());
+    return true;
+}
+
+bool ObjectId::isNull() const
+{
+    for (uint i = 0; i < sizeof(sha1); ++i) {
+        if (sha1[i])
+            return false;
+    }
+    return true;
+}
+
+QByteArray ObjectId::toHex() const
+{
+    return QByteArray::fromRawData(reinterpret_cast<const char *>(sha1), sizeof(sha1)).toHex();
+}
+
+static inline bool isDir(int mode)
+{
+    return (mode & 0170000) == 040000;
+}
+
+static inline const char *endOfComponent(const char *p)
+{
+    const char *slash = strchr(p, '/');
+    return slash ? slash : p + strlen(p);
+}
+
+// what convert_num_notes_to_fanout() in fast-import makes of it
+static int notesFanout(qint64 notes)
+{
+    int fanout = 0;
+    while (notes >= 256) {
+        notes /= 256;
+        ++fanout;
+    }
+    return fanout;
+}
+
+static QByteArray notePath(const QByteArray &hex, int fanout)
+{
+    QByteArray path;
+    for (int i = 0; i < fanout; ++i)
+        path += hex.mid(2 * i, 2) + '/';
+    return path + hex.mid(2 * fanout);
+}
+
+// the order of git trees: directories sort as if their name ended in '/'
+static bool gitTreeOrder(const QByteArray &a, int modeA, const QByteArray &b, int modeB)
+{
+    int len = qMin(a.size(), b.size());
+    int cmp = memcmp(a.constData(), b.constData(), len);
+    if (cmp)
+        return cmp < 0;
+    uchar c1 = a.size() > len ? a.at(len) : (isDir(modeA) ? '/' : 0);
+    uchar c2 = b.size() > len ? b.at(len) : (isDir(modeB) ? '/' : 0);
+    return c1 < c2;
+}
+
+static void appendBigEndian(QByteArray &out, quint32 value)
+{
+    uchar bytes[4];
+    qToBigEndian(value, bytes);
+    out.append(reinterpret_cast<const char *>(bytes), 4);
+}
+
+PackImporter::TreeEntry::~TreeEntry()
+{
+    delete tree;
+}
+
+PackImporter::PackImporter(const QString &gitDir, const QString &marksFile, const QString &logFile)
+    : m_gitDir(gitDir), m_marksFile(marksFile), m_log(logFile), m_bytes(0),
+      m_dataLeft(-1), m_skipLF(false), m_dataTarget(BlobData), m_command(NoCommand), m_mark(0),
+      m_branch(0), m_notesChanged(false), m_prevFanout(0),
+      m_marksRunEnd(0), m_marksRunPos(0), m_firstChangedMark(0),
+      m_packOpen(false), m_packSize(0), m_crc(0), m_objectStart(0),
+      m_deflated(64 * 1024, Qt::Uninitialized), m_blobHash(QCryptographicHash::Sha1), m_readerPack(-1)
+{
+    if (!m_log.open(QIODevice::WriteOnly | QIODevice::Append))
+        qFatal("Failed to open %s: %s", qPrintable(logFile), qPrintable(m_log.errorString()));
+    memset(&m_zstream, 0, sizeof(m_zstream));
+    if (deflateInit(&m_zstream, Z_DEFAULT_COMPRESSION) != Z_OK)
+        qFatal("Failed to set up zlib");
+    loadPackIndexes();
+    loadMarks();
+}
+
+PackImporter::~PackImporter()
+{
+    checkpoint();
+    deflateEnd(&m_zstream);
+    qDeleteAll(m_branches);
+    foreach (const PackIndex &index, m_oldPacks)
+        delete index.file;
+    if (m_catFile.state() != QProcess::NotRunning) {
+        m_catFile.closeWriteChannel();
+        m_catFile.waitForFinished(-1);
+    }
+}
+
+void PackImporter::write(const char *data, qint64 len)
+{
+    m_bytes += len;
+    QByteArray joined;
+    if (!m_input.isEmpty()) {
+        joined = m_input;
+        joined.append(data, len);
+        m_input.clear();
+        data = joined.constData();
+        len = joined.size();
+    }
+
+    const char *end = data + len;
+    while (data < end) {
+        if (m_dataLeft > 0) {
+            qint64 n = qMin<qint64>(end - data, m_dataLeft);
+            addData(data, n);
+            data += n;
+            continue;
+        }
+        // the LF after data is optional
+        if (m_skipLF) {
+            m_skipLF = false;
+            if (*data == '\n') {
+                ++data;
+                continue;
+            }
+        }
+        const char *eol = static_cast<const char *>(memchr(data, '\n', end - data));
+        if (!eol) {
+            m_input = QByteArray(data, end - data);
+            break;
+        }
+        QByteArray line(data, eol - data);
+        data = eol + 1;
+        handleLine(line);
+    }
+}
+
+void PackImporter::handleLine(const QByteArray &line)
+{
+    switch (m_command) {
+    case BlobCommand:
+        if (line.startsWith("mark :")) {
+            m_mark = line.mid(6).toULongLong();
+            return;
+        }
+        if (line.startsWith("data ")) {
+            qint64 size = line.mid(5).toLongLong();
+            beginObject(BlobObject, size);
+            m_blobHash.reset();
+            m_blobHash.addData(QByteArray("blob ") + QByteArray::number(size) + '\0');
+            startData(size, BlobData);
+            return;
+        }
+        qFatal("Expected 'data n' command, found: %s", line.constData());
+    case CommitCommand:
+        if (commitLine(line))
+            return;
+        finishCommit();
+        if (line.isEmpty())
+            return;
+        break;
+    case ResetCommand:
+        m_command = NoCommand;
+        if (line.startsWith("from ")) {
+            setFrom(m_branch, line.mid(5));
+            return;
+        }
+        if (line.isEmpty())
+            return;
+        break;
+    case TagCommand:
+        if (line.startsWith("from ")) {
+            Branch *b = m_branches.value(line.mid(5));
+            if (b && !b->hasCommit)
+                qFatal("Can't tag an empty branch.");
+            m_tagFrom = b ? b->commit : resolve(line.mid(5), "tag");
+        } else if (line.startsWith("mark :")) {
+            m_mark = line.mid(6).toULongLong();
+        } else if (line.startsWith("tagger ")) {
+            m_committer = line.mid(7);
+        } else if (line.startsWith("data ")) {
+            startData(line.mid(5).toLongLong(), MessageData);
+        } else {
+            qFatal("Expected 'data n' command, found: %s", line.constData());
+        }
+        return;
+    case NoCommand:
+        break;
+    }
+
+    if (line.isEmpty())
+        return;
+    if (line == "blob") {
+        m_command = BlobCommand;
+        m_mark = 0;
+    } else if (line.startsWith("commit ")) {
+        m_command = CommitCommand;
+        m_branch = branch(line.mid(7));
+        m_mark = 0;
+        m_author.clear();
+        m_committer.clear();
+        m_message.clear();
+        m_merges.clear();
+        m_notesChanged = false;
+    } else if (line.startsWith("reset ")) {
+        // fast-import forgets what the branch was, "from" may set it again
+        m_command = ResetCommand;
+        m_branch = branch(line.mid(6));
+        m_branch->hasCommit = false;
+        m_branch->commit = ObjectId();
+        replaceRoot(&m_branch->root, ObjectId(), 040000, 0);
+        m_branch->notes = -1;
+        m_branch->changed = true;
+    } else if (line.startsWith("tag ")) {
+        m_command = TagCommand;
+        m_tagName = line.mid(4);
+        m_tagFrom = ObjectId();
+        m_mark = 0;
+        m_committer.clear();
+    } else if (line.startsWith("progress ")) {
+        progress(line);
+    } else if (line == "checkpoint") {
+        checkpoint();
+    } else {
+        qFatal("Unsupported command: %s", line.constData());
+    }
+}
+
+// Returns false if line is not part of the commit
+bool PackImporter::commitLine(const QByteArray &line)
+{
+    Branch *b = m_branch;
+    if (line.startsWith("M ")) {
+        touch(b);
+        fileModify(line);
+    } else if (line.startsWith("D ")) {
+        touch(b);
+        treeContentRemove(&b->root, line.constData() + 2, 0);
+    } else if (line.startsWith("R ")) {
+        touch(b);
+        fileRename(line);
+    } else if (line == "deleteall") {
+        replaceRoot(&b->root, ObjectId(), 040000, new TreeContent);
+        b->notes = 0;
+    } else if (line.startsWith("N inline ")) {
+        m_noteTarget = line.mid(9);
+    } else if (line.startsWith("N ")) {
+        int space = line.indexOf(' ', 2);
+        m_noteTarget = line.mid(space + 1);
+        noteModify(dataRef(line.mid(2, space - 2)));
+    } else if (line.startsWith("data ")) {
+        startData(line.mid(5).toLongLong(), m_noteTarget.isNull() ? MessageData : NoteData);
+    } else if (line.startsWith("mark :")) {
+        m_mark = line.mid(6).toULongLong();
+    } else if (line.startsWith("author ")) {
+        m_author = line.mid(7);
+    } else if (line.startsWith("committer ")) {
+        m_committer = line.mid(10);
+    } else if (line.startsWith("from ")) {
+        setFrom(b, line.mid(5));
+    } else if (line.startsWith("merge ")) {
+        m_merges.append(resolve(line.mid(6), "merge"));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void PackImporter::startData(qint64 length, DataTarget target)
+{
+    m_dataTarget = target;
+    m_dataLeft = length;
+    m_data.clear();
+    if (!length)
+        finishData();
+}
+
+void PackImporter::addData(const char *data, qint64 len)
+{
+    if (m_dataTarget == BlobData) {
+        m_blobHash.addData(data, len);
+        deflateData(data, len, false);
+    } else {
+        m_data.append(data, len);
+    }
+    m_dataLeft -= len;
+    if (!m_dataLeft)
+        finishData();
+}
+
+void PackImporter::finishData()
+{
+    m_dataLeft = -1;
+    m_skipLF = true;
+
+    switch (m_dataTarget) {
+    case BlobData: {
+        deflateData(0, 0, true);
+        ObjectId id = ObjectId::fromRaw(m_blobHash.result().constData());
+        endObject(id);
+        if (m_mark)
+            setMark(m_mark, id);
+        m_command = NoCommand;
+        break;
+    }
+    case MessageData:
+        m_message = m_data;
+        if (m_command == TagCommand)
+            finishTag();
+        break;
+    case NoteData:
+        noteModify(storeObject(BlobObject, m_data));
+        break;
+    }
+    m_data.clear();
+}
+
+void PackImporter::finishCommit()
+{
+    Branch *b = m_branch;
+    m_command = NoCommand;
+    if (m_committer.isEmpty())
+        qFatal("Expected committer but didn't get one");
+
+    // the notes are laid out for their number at the end of the commit
+    if (m_notesChanged && notesFanout(b->notes) != m_prevFanout)
+        b->notes = changeNoteFanout(&b->root, notesFanout(b->notes));
+
+    touch(b);
+    storeTree(&b->root);
+
+    QByteArray content = "tree " + b->root.id.toHex() + '\n';
+    if (b->hasCommit)
+        content += "parent " + b->commit.toHex() + '\n';
+    foreach (const ObjectId &merge, m_merges)
+        content += "parent " + merge.toHex() + '\n';
+    content += "author " + (m_author.isEmpty() ? m_committer : m_author) + '\n';
+    content += "committer " + m_committer + '\n';
+    content += '\n';
+    content += m_message;
+
+    ObjectId id = storeObject(CommitObject, content);
+    m_commitTrees.insert(id, b->root.id);
+    b->commit = id;
+    b->hasCommit = true;
+    b->changed = true;
+    if (m_mark)
+        setMark(m_mark, id);
+}
+
+void PackImporter::finishTag()
+{
+    m_command = NoCommand;
+    QByteArray content = "object " + m_tagFrom.toHex() + "\ntype commit\ntag " + m_tagName + '\n';
+    if (!m_committer.isEmpty())
+        content += "tagger " + m_committer + '\n';
+    content += '\n';
+    content += m_message;
+
+    ObjectId id = storeObject(TagObject, content);
+    m_tags.insert(m_tagName, id);
+    if (m_mark)
+        setMark(m_mark, id);
+}
+
+// fast-import echoes these on its standard output, which went to the log
+void PackImporter::progress(const QByteArray &line)
+{
+    m_log.write(line + '\n');
+    m_log.flush();
+}
+
+PackImporter::Branch *PackImporter::branch(const QByteArray &ref)
+{
+    Branch *&b = m_branches[ref];
+    if (!b) {
+        b = new Branch;
+        b->name = ref;
+    }
+    return b;
+}
+
+// Keeps the trees of the last few branches written to in memory, like
+// fast-import's --active-branches.
+void PackImporter::touch(Branch *b)
+{
+    m_active.removeOne(b);
+    m_active.prepend(b);
+    while (m_active.size() > MaxActiveBranches) {
+        Branch *old = m_active.takeLast();
+        if (!old->root.id.isNull()) {
+            delete old->root.tree;
+            old->root.tree = 0;
+        }
+    }
+}
+
+void PackImporter::setFrom(Branch *b, const QByteArray &from)
+{
+    Branch *s = m_branches.value(from);
+    if (s == b)
+        qFatal("Can't create a branch from itself: %s", b->name.constData());
+
+    ObjectId commit;
+    ObjectId tree;
+    if (s) {
+        commit = s->commit;
+        storeTree(&s->root);
+        tree = s->root.id;
+        b->deleted = false;
+    } else if (ObjectId::fromHex(from, &commit) && commit.isNull()) {
+        // the ref is deleted once the branches are written
+        b->deleted = true;
+    } else {
+        commit = resolve(from, "from");
+        tree = commitTree(commit);
+        b->deleted = false;
+    }
+
+    b->hasCommit = !commit.isNull();
+    b->commit = commit;
+    replaceRoot(&b->root, tree, 040000, 0);
+    b->notes = -1;
+    b->changed = true;
+}
+
+// a mark, a SHA-1 or anything git rev-parse would take
+ObjectId PackImporter::resolve(const QByteArray &spec, const char *what)
+{
+    ObjectId id;
+    if (spec.startsWith(':')) {
+        QMap<quint64, ObjectId>::const_iterator it = m_marks.constFind(spec.mid(1).toULongLong());
+        if (it == m_marks.constEnd())
+            qFatal("mark %s not declared", spec.constData());
+        return *it;
+    }
+    Branch *b = m_branches.value(spec);
+    if (b && b->hasCommit)
+        return b->commit;
+    if (ObjectId::fromHex(spec, &id))
+        return id;
+    if (!catFile(spec, &id, 0, 0))
+        qFatal("Invalid ref name or SHA1 expression in %s: %s", what, spec.constData());
+    return id;
+}
+
+ObjectId PackImporter::commitTree(const ObjectId &commit)
+{
+    QHash<ObjectId, ObjectId>::const_iterator it = m_commitTrees.constFind(commit);
+    if (it != m_commitTrees.constEnd())
+        return *it;
+
+    ObjectType type;
+    QByteArray content = readObject(commit, &type);
+    ObjectId tree;
+    if (type != CommitObject || !content.startsWith("tree ") || !ObjectId::fromHex(content.mid(5, 40), &tree))
+        qFatal("Not a commit: %s", commit.toHex().constData());
+    m_commitTrees.insert(commit, tree);
+    return tree;
+}
+
+ObjectId PackImporter::dataRef(const QByteArray &ref)
+{
+    if (ref.startsWith(':'))
+        return resolve(ref, "data");
+    ObjectId id;
+    if (!ObjectId::fromHex(ref, &id))
+        qFatal("Unsupported data reference: %s", ref.constData());
+    return id;
+}
+
+// M <mode> <dataref> <path>
+void PackImporter::fileModify(const QByteArray &line)
+{
+    int modeEnd = line.indexOf(' ', 2);
+    int refEnd = line.indexOf(' ', modeEnd + 1);
+    if (modeEnd == -1 || refEnd == -1)
+        qFatal("Missing space after SHA1: %s", line.constData());
+
+    bool ok;
+    int mode = line.mid(2, modeEnd - 2).toInt(&ok, 8);
+    switch (mode) {
+    case 0644:
+    case 0100644:
+        mode = 0100644;
+        break;
+    case 0755:
+    case 0100755:
+        mode = 0100755;
+        break;
+    case 0120000:
+    case 0160000:
+    case 040000:
+        break;
+    default:
+        ok = false;
+    }
+    if (!ok)
+        qFatal("Corrupt mode: %s", line.constData());
+
+    ObjectId id = dataRef(line.mid(modeEnd + 1, refEnd - modeEnd - 1));
+    const char *path = line.constData() + refEnd + 1;
+    if (!*path) {
+        if (!isDir(mode))
+            qFatal("Root cannot be a non-directory");
+        replaceRoot(&m_branch->root, id, mode, 0);
+        return;
+    }
+    // git does not keep empty directories
+    if (isDir(mode) && id.toHex() == emptyTreeHex) {
+        treeContentRemove(&m_branch->root, path, 0);
+        return;
+    }
+    treeContentSet(&m_branch->root, path, id, mode, 0);
+}
+
+// R <from> <to>, an unquoted <from> ends at the first space
+void PackImporter::fileRename(const QByteArray &line)
+{
+    int space = line.indexOf(' ', 2);
+    if (space == -1)
+        qFatal("Missing space after source: %s", line.constData());
+    const QByteArray from = line.mid(2, space - 2);
+    const QByteArray to = line.mid(space + 1);
+
+    TreeEntry leaf;
+    treeContentRemove(&m_branch->root, from.constData(), &leaf);
+    if (!leaf.mode)
+        qFatal("Path %s not in branch", from.constData());
+    TreeContent *subtree = leaf.tree;
+    leaf.tree = 0;
+    if (to.isEmpty())
+        replaceRoot(&m_branch->root, leaf.id, leaf.mode, subtree);
+    else
+        treeContentSet(&m_branch->root, to.constData(), leaf.id, leaf.mode, subtree);
+}
+
+// Like note_change_n() in fast-import: the old note is looked for where
+// the fanout at the start of the commit puts it.
+void PackImporter::noteModify(const ObjectId &note)
+{
+    Branch *b = m_branch;
+    ObjectId target;
+    Branch *s = m_branches.value(m_noteTarget);
+    if (s) {
+        if (!s->hasCommit)
+            qFatal("Can't add a note on empty branch.");
+        target = s->commit;
+    } else {
+        target = resolve(m_noteTarget, "note");
+    }
+    m_noteTarget.clear();
+
+    touch(b);
+    if (!m_notesChanged) {
+        if (b->notes < 0)
+            b->notes = changeNoteFanout(&b->root, CountNotes);
+        m_prevFanout = notesFanout(b->notes);
+        m_notesChanged = true;
+    }
+
+    const QByteArray hex = target.toHex();
+    if (treeContentRemove(&b->root, notePath(hex, m_prevFanout).constData(), 0))
+        --b->notes;
+    if (note.isNull())
+        return;
+    ++b->notes;
+    treeContentSet(&b->root, notePath(hex, notesFanout(b->notes)).constData(), note, 0100644, 0);
+}
+
+void PackImporter::loadTree(TreeEntry *root)
+{
+    root->tree = new TreeContent;
+    if (root->id.isNull())
+        return;
+
+    ObjectType type;
+    const QByteArray content = readObject(root->id, &type);
+    if (type != TreeObject)
+        qFatal("Not a tree: %s", root->id.toHex().constData());
+
+    // <octal mode> <name>\0<20 byte id>
+    int pos = 0;
+    while (pos < content.size()) {
+        int space = content.indexOf(' ', pos);
+        int nul = content.indexOf('\0', space);
+        if (space == -1 || nul == -1 || nul + 21 > content.size())
+            qFatal("Corrupt tree: %s", root->id.toHex().constData());
+        TreeEntry *e = new TreeEntry;
+        e->mode = content.mid(pos, space - pos).toInt(0, 8);
+        e->name = content.mid(space + 1, nul - space - 1);
+        e->id = ObjectId::fromRaw(content.constData() + nul + 1);
+        root->tree->entries.append(e);
+        pos = nul + 21;
+    }
+}
+
+// tree_content_set() of fast-import; returns whether anything changed
+bool PackImporter::treeContentSet(TreeEntry *root, const char *p, const ObjectId &id, int mode,
+                                  TreeContent *subtree)
+{
+    const char *slash = endOfComponent(p);
+    const int n = slash - p;
+    if (!n)
+        qFatal("Empty path component found in input");
+    if (!*slash && !isDir(mode) && subtree)
+        qFatal("Non-directories cannot have subtrees");
+
+    if (!root->tree)
+        loadTree(root);
+    TreeContent *t = root->tree;
+    for (int i = 0; i < t->entries.size(); ++i) {
+        TreeEntry *e = t->entries.at(i);
+        if (e->name.size() != n || memcmp(p, e->name.constData(), n))
+            continue;
+        if (!*slash) {
+            if (!isDir(mode) && e->mode == mode && e->id == id)
+                return false;
+            e->mode = mode;
+            e->id = id;
+            delete e->tree;
+            e->tree = subtree;
+            root->id = ObjectId();
+            return true;
+        }
+        if (!isDir(e->mode)) {
+            e->tree = new TreeContent;
+            e->mode = 040000;
+        }
+        if (!e->tree)
+            loadTree(e);
+        if (treeContentSet(e, slash + 1, id, mode, subtree)) {
+            root->id = ObjectId();
+            return true;
+        }
+        return false;
+    }
+
+    TreeEntry *e = new TreeEntry;
+    e->name = QByteArray(p, n);
+    t->entries.append(e);
+    if (*slash) {
+        e->tree = new TreeContent;
+        e->mode = 040000;
+        treeContentSet(e, slash + 1, id, mode, subtree);
+    } else {
+        e->tree = subtree;
+        e->mode = mode;
+        e->id = id;
+    }
+    root->id = ObjectId();
+    return true;
+}
+
+/*
+ * tree_content_remove() of fast-import: the entry is only marked deleted
+ * until the tree is stored, and a directory left empty goes as well.  If
+ * backupLeaf is given, the entry and its subtree are moved there.  Returns
+ * true if a name matched, even a deleted one, which is what fast-import
+ * counts notes by.
+ */
+bool PackImporter::treeContentRemove(TreeEntry *root, const char *p, TreeEntry *backupLeaf)
+{
+    const char *slash = endOfComponent(p);
+    const int n = slash - p;
+
+    if (!root->tree)
+        loadTree(root);
+    TreeContent *t = root->tree;
+    for (int i = 0; i < t->entries.size(); ++i) {
+        TreeEntry *e = t->entries.at(i);
+        if (e->name.size() != n || memcmp(p, e->name.constData(), n))
+            continue;
+        // a file where a parent directory of p should be, p is not there
+        if (*slash && !isDir(e->mode))
+            return true;
+        if (*slash) {
+            if (!e->tree)
+                loadTree(e);
+            if (!treeContentRemove(e, slash + 1, backupLeaf))
+                return false;
+            foreach (const TreeEntry *child, e->tree->entries) {
+                if (child->mode) {
+                    root->id = ObjectId();
+                    return true;
+                }
+            }
+            backupLeaf = 0;
+        }
+
+        if (backupLeaf) {
+            backupLeaf->mode = e->mode;
+            backupLeaf->id = e->id;
+            backupLeaf->tree = e->tree;
+        } else {
+            delete e->tree;
+        }
+        e->tree = 0;
+        e->mode = 0;
+        e->id = ObjectId();
+        root->id = ObjectId();
+        return true;
+    }
+    return false;
+}
+
+void PackImporter::replaceRoot(TreeEntry *root, const ObjectId &id, int mode, TreeContent *subtree)
+{
+    if (!isDir(mode))
+        qFatal("Root cannot be a non-directory");
+    root->mode = mode;
+    root->id = id;
+    delete root->tree;
+    root->tree = subtree;
+}
+
+// Writes the directories that changed, deepest first, and drops the
+// entries that were deleted.
+void PackImporter::storeTree(TreeEntry *root)
+{
+    if (!root->id.isNull())
+        return;
+    if (!root->tree)
+        loadTree(root);
+    TreeContent *t = root->tree;
+    foreach (TreeEntry *e, t->entries) {
+        if (e->tree)
+            storeTree(e);
+    }
+
+    QVector<TreeEntry *> sorted;
+    sorted.reserve(t->entries.size());
+    foreach (TreeEntry *e, t->entries) {
+        if (e->mode)
+            sorted.append(e);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const TreeEntry *a, const TreeEntry *b) {
+        return gitTreeOrder(a->name, a->mode, b->name, b->mode);
+    });
+
+    QByteArray content;
+    content.reserve(sorted.size() * 48);
+    foreach (const TreeEntry *e, sorted) {
+        content += QByteArray::number(e->mode, 8);
+        content += ' ';
+        content += e->name;
+        content += '\0';
+        content.append(reinterpret_cast<const char *>(e->id.sha1), sizeof(e->id.sha1));
+    }
+    root->id = storeObject(TreeObject, content);
+
+    QVector<TreeEntry *> kept;
+    kept.reserve(sorted.size());
+    foreach (TreeEntry *e, t->entries) {
+        if (e->mode)
+            kept.append(e);
+        else
+            delete e;
+    }
+    t->entries = kept;
+}
+
+qint64 PackImporter::changeNoteFanout(TreeEntry *root, int fanout)
+{
+    return changeNoteFanout(root, root, QByteArray(), QByteArray(), fanout);
+}
+
+/*
+ * do_change_note_fanout() of fast-import: moves every note that is not
+ * where fanout puts it, or only counts them with CountNotes.  A moved note
+ * is only counted if the walk comes across it again, as in fast-import.
+ */
+qint64 PackImporter::changeNoteFanout(TreeEntry *origRoot, TreeEntry *root, const QByteArray &hex,
+                                      const QByteArray &fullPath, int fanout)
+{
+    if (!root->tree)
+        loadTree(root);
+
+    qint64 notes = 0;
+    for (int i = 0; root->tree && i < root->tree->entries.size(); ++i) {
+        TreeEntry *e = root->tree->entries.at(i);
+        if (!e->mode || hex.size() + e->name.size() > 40 || e->name.size() % 2)
+            continue;
+
+        const QByteArray entryHex = hex + e->name;
+        const QByteArray path = fullPath.isEmpty() ? e->name : fullPath + '/' + e->name;
+        ObjectId id;
+        if (ObjectId::fromHex(entryHex, &id)) {
+            if (fanout == CountNotes) {
+                ++notes;
+                continue;
+            }
+            const QByteArray realPath = notePath(entryHex, fanout);
+            if (path == realPath) {
+                ++notes;
+                continue;
+            }
+            TreeEntry leaf;
+            if (!treeContentRemove(origRoot, path.constData(), &leaf))
+                qFatal("Failed to remove path %s", path.constData());
+            TreeContent *subtree = leaf.tree;
+            leaf.tree = 0;
+            treeContentSet(origRoot, realPath.constData(), leaf.id, leaf.mode, subtree);
+        } else if (isDir(e->mode)) {
+            notes += changeNoteFanout(origRoot, e, entryHex, path, fanout);
+        }
+    }
+    return notes;
+}
+
+/*
+ * Maps the index of every pack in the repository, so that objects an
+ * earlier run packed are not packed again.  Like fast-import, loose objects
+ * are not looked at.
+ */
+void PackImporter::loadPackIndexes()
+{
+    QDir packDir(m_gitDir + "/objects/pack");
+    foreach (const QString &name, packDir.entryList(QStringList() << "pack-*.idx", QDir::Files)) {
+        PackIndex index;
+        index.file = new QFile(packDir.filePath(name));
+        const qint64 size = index.file->size();
+        const uchar *data = 0;
+        if (index.file->open(QIODevice::ReadOnly) && size >= 8 + 256 * 4)
+            data = index.file->map(0, size);
+        if (!data) {
+            qWarning() << "WARN: could not read" << index.file->fileName() << ":" << index.file->errorString();
+            delete index.file;
+            continue;
+        }
+        const bool version2 = !memcmp(data, "\377tOc", 4);
+        index.fanout = version2 ? data + 8 : data;
+        index.stride = version2 ? 20 : 24;
+        index.names = index.fanout + 256 * 4 + (version2 ? 0 : 4);
+        const quint32 count = qFromBigEndian<quint32>(index.fanout + 255 * 4);
+        if (index.names - data + qint64(count) * index.stride > size) {
+            qWarning() << "WARN: ignoring truncated pack index" << index.file->fileName();
+            delete index.file;
+            continue;
+        }
+        m_oldPacks.append(index);
+    }
+}
+
+// a binary search in the names that start with the same byte
+bool PackImporter::inOldPack(const ObjectId &id) const
+{
+    foreach (const PackIndex &index, m_oldPacks) {
+        quint32 lo = id.sha1[0] ? qFromBigEndian<quint32>(index.fanout + (id.sha1[0] - 1) * 4) : 0;
+        quint32 hi = qFromBigEndian<quint32>(index.fanout + id.sha1[0] * 4);
+        while (lo < hi) {
+            const quint32 mid = lo + (hi - lo) / 2;
+            const int cmp = memcmp(index.names + qint64(mid) * index.stride, id.sha1, sizeof(id.sha1));
+            if (!cmp)
+                return true;
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    }
+    return false;
+}
+
+ObjectId PackImporter::storeObject(ObjectType type, const QByteArray &content)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(QByteArray(typeNames[type]) + ' ' + QByteArray::number(content.size()) + '\0');
+    hash.addData(content);
+    ObjectId id = ObjectId::fromRaw(hash.result().constData());
+    if (hasObject(id))
+        return id;
+
+    beginObject(type, content.size());
+    deflateData(content.constData(), content.size(), true);
+    endObject(id);
+    return id;
+}
+
+// the object header: type and size, 4 bits of the size in the first byte,
+// then 7 in each byte that follows
+void PackImporter::beginObject(ObjectType type, qint64 size)
+{
+    if (!m_packOpen)
+        startPack();
+    m_objectStart = m_packSize;
+    m_crc = crc32(0, 0, 0);
+
+    char header[16];
+    int n = 0;
+    uchar c = (type << 4) | (size & 15);
+    size >>= 4;
+    while (size) {
+        header[n++] = c | 0x80;
+        c = size & 0x7f;
+        size >>= 7;
+    }
+    header[n++] = c;
+    packWrite(header, n);
+}
+
+void PackImporter::deflateData(const char *data, qint64 len, bool finish)
+{
+    m_zstream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    m_zstream.avail_in = len;
+    forever {
+        m_zstream.next_out = reinterpret_cast<Bytef *>(m_deflated.data());
+        m_zstream.avail_out = m_deflated.size();
+        int ret = deflate(&m_zstream, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR)
+            qFatal("zlib failed to deflate");
+        packWrite(m_deflated.constData(), m_deflated.size() - m_zstream.avail_out);
+        if (finish ? ret == Z_STREAM_END : m_zstream.avail_out != 0)
+            break;
+    }
+    if (finish)
+        deflateReset(&m_zstream);
+}
+
+void PackImporter::packWrite(const char *data, qint64 len)
+{
+    if (m_pack.write(data, len) != len)
+        qFatal("Failed to write %s: %s", qPrintable(m_pack.fileName()), qPrintable(m_pack.errorString()));
+    m_crc = crc32(m_crc, reinterpret_cast<const Bytef *>(data), len);
+    m_packSize += len;
+}
+
+// Returns false if the object was there already, then it is taken out of
+// the pack again.
+bool PackImporter::endObject(const ObjectId &id)
+{
+    if (hasObject(id)) {
+        if (!m_pack.resize(m_objectStart) || !m_pack.seek(m_objectStart))
+            qFatal("Failed to truncate %s: %s", qPrintable(m_pack.fileName()), qPrintable(m_pack.errorString()));
+        m_packSize = m_objectStart;
+        return false;
+    }
+    PackedObject object;
+    object.pack = m_packs.size();
+    object.crc = m_crc;
+    object.offset = m_objectStart;
+    m_objects.insert(id, object);
+    m_packObjects.append(id);
+    return true;
+}
+
+void PackImporter::startPack()
+{
+    QDir().mkpath(m_gitDir + "/objects/pack");
+    m_pack.setFileName(m_gitDir + "/objects/pack/tmp_pack_" + QString::number(QCoreApplication::applicationPid())
+                       + "_" + QString::number(m_packs.size()));
+    if (!m_pack.open(QIODevice::ReadWrite | QIODevice::Truncate))
+        qFatal("Failed to create %s: %s", qPrintable(m_pack.fileName()), qPrintable(m_pack.errorString()));
+    m_packOpen = true;
+    m_packSize = 0;
+    m_packObjects.clear();
+
+    // the object count is filled in at the end
+    QByteArray header("PACK");
+    appendBigEndian(header, 2);
+    appendBigEndian(header, 0);
+    packWrite(header.constData(), header.size());
+}
+
+/*
+ * Fills in the object count, appends the checksum of the pack and writes
+ * its version 2 index.  Both are named after the checksum like the packs
+ * fast-import writes.
+ */
+void PackImporter::endPack()
+{
+    if (!m_packOpen)
+        return;
+    m_packOpen = false;
+    if (m_packObjects.isEmpty()) {
+        m_pack.remove();
+        return;
+    }
+
+    QByteArray count;
+    appendBigEndian(count, m_packObjects.size());
+    if (!m_pack.seek(8) || m_pack.write(count) != 4 || !m_pack.seek(0))
+        qFatal("Failed to write %s: %s", qPrintable(m_pack.fileName()), qPrintable(m_pack.errorString()));
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    while (!m_pack.atEnd())
+        hash.addData(m_pack.read(1024 * 1024));
+    const QByteArray packSha1 = hash.result();
+    if (m_pack.write(packSha1) != packSha1.size() || !m_pack.flush())
+        qFatal("Failed to write %s: %s", qPrintable(m_pack.fileName()), qPrintable(m_pack.errorString()));
+    m_pack.close();
+
+    QVector<ObjectId> ids = m_packObjects;
+    std::sort(ids.begin(), ids.end());
+
+    QByteArray idx("\377tOc");
+    appendBigEndian(idx, 2);
+    int i = 0;
+    for (int first = 0; first < 256; ++first) {
+        while (i < ids.size() && ids.at(i).sha1[0] <= first)
+            ++i;
+        appendBigEndian(idx, i);
+    }
+    foreach (const ObjectId &id, ids)
+        idx.append(reinterpret_cast<const char *>(id.sha1), sizeof(id.sha1));
+    foreach (const ObjectId &id, ids)
+        appendBigEndian(idx, m_objects.value(id).crc);
+    QByteArray largeOffsets;
+    foreach (const ObjectId &id, ids) {
+        qint64 offset = m_objects.value(id).offset;
+        if (offset < 0x80000000LL) {
+            appendBigEndian(idx, offset);
+        } else {
+            appendBigEndian(idx, 0x80000000U | (largeOffsets.size() / 8));
+            appendBigEndian(largeOffsets, offset >> 32);
+            appendBigEndian(largeOffsets, offset & 0xffffffffU);
+        }
+    }
+    idx += largeOffsets;
+    idx += packSha1;
+    idx += QCryptographicHash::hash(idx, QCryptographicHash::Sha1);
+
+    const QString base = m_gitDir + "/objects/pack/pack-" + packSha1.toHex();
+    QFile::remove(base + ".pack");
+    if (!m_pack.rename(base + ".pack"))
+        qFatal("Failed to rename %s: %s", qPrintable(m_pack.fileName()), qPrintable(m_pack.errorString()));
+    QSaveFile idxFile(base + ".idx");
+    if (!idxFile.open(QIODevice::WriteOnly) || idxFile.write(idx) != idx.size() || !idxFile.commit())
+        qFatal("Failed to write %s: %s", qPrintable(idxFile.fileName()), qPrintable(idxFile.errorString()));
+
+    m_packs.append(base + ".pack");
+    m_packObjects.clear();
+}
+
+QByteArray PackImporter::readObject(const ObjectId &id, ObjectType *type)
+{
+    QHash<ObjectId, PackedObject>::const_iterator it = m_objects.constFind(id);
+    if (it != m_objects.constEnd())
+        return readPacked(*it, type);
+
+    // from an earlier run
+    ObjectId found;
+    QByteArray content;
+    if (!catFile(id.toHex(), &found, type, &content))
+        qFatal("Object %s not found", id.toHex().constData());
+    return content;
+}
+
+QByteArray PackImporter::readPacked(const PackedObject &object, ObjectType *type)
+{
+    QFile *file = &m_pack;
+    if (object.pack != m_packs.size() || !m_packOpen) {
+        if (m_readerPack != object.pack) {
+            m_reader.close();
+            m_reader.setFileName(m_packs.at(object.pack));
+            if (!m_reader.open(QIODevice::ReadOnly))
+                qFatal("Failed to open %s: %s", qPrintable(m_reader.fileName()), qPrintable(m_reader.errorString()));
+            m_readerPack = object.pack;
+        }
+        file = &m_reader;
+    }
+
+    if (!file->seek(object.offset))
+        qFatal("Failed to read %s: %s", qPrintable(file->fileName()), qPrintable(file->errorString()));
+    char c;
+    file->getChar(&c);
+    *type = ObjectType((uchar(c) >> 4) & 7);
+    qint64 size = c & 15;
+    for (int shift = 4; uchar(c) & 0x80; shift += 7) {
+        file->getChar(&c);
+        size |= qint64(c & 0x7f) << shift;
+    }
+
+    QByteArray content(size, Qt::Uninitialized);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    inflateInit(&stream);
+    stream.next_out = reinterpret_cast<Bytef *>(content.data());
+    stream.avail_out = size;
+    int ret = Z_OK;
+    while (ret == Z_OK) {
+        QByteArray in = file->read(64 * 1024);
+        if (in.isEmpty())
+            break;
+        stream.next_in = reinterpret_cast<Bytef *>(in.data());
+        stream.avail_in = in.size();
+        ret = inflate(&stream, Z_NO_FLUSH);
+    }
+    inflateEnd(&stream);
+    if (ret != Z_STREAM_END || stream.total_out != quint64(size))
+        qFatal("Corrupt object at %lld in %s", object.offset, qPrintable(file->fileName()));
+
+    if (file == &m_pack)
+        m_pack.seek(m_packSize);
+    return content;
+}
+
+// Reads an object written before this process started from git cat-file.
+// type and content may be null to only resolve name.
+bool PackImporter::catFile(const QByteArray &name, ObjectId *id, ObjectType *type, QByteArray *content)
+{
+    if (m_catFile.state() == QProcess::NotRunning) {
+        m_catFile.setWorkingDirectory(m_gitDir);
+        m_catFile.start("git", QStringList() << "cat-file" << "--batch");
+        if (!m_catFile.waitForStarted(-1))
+            qFatal("Failed to start git cat-file in %s", qPrintable(m_gitDir));
+    }
+    m_catFile.write(name + '\n');
+    while (!m_catFile.canReadLine()) {
+        if (!m_catFile.waitForReadyRead(-1))
+            qFatal("git cat-file in %s died", qPrintable(m_gitDir));
+    }
+
+    // <sha1> <type> <size>, or <name> missing
+    const QList<QByteArray> header = m_catFile.readLine().trimmed().split(' ');
+    if (header.size() != 3 || !ObjectId::fromHex(header.at(0), id))
+        return false;
+    const qint64 size = header.at(2).toLongLong();
+    QByteArray data;
+    while (data.size() < size + 1) {
+        if (!m_catFile.bytesAvailable() && !m_catFile.waitForReadyRead(-1))
+            qFatal("git cat-file in %s died", qPrintable(m_gitDir));
+        data += m_catFile.read(size + 1 - data.size());
+    }
+    data.chop(1);
+
+    if (type) {
+        *type = BlobObject;
+        for (int t = CommitObject; t <= TagObject; ++t) {
+            if (header.at(1) == typeNames[t])
+                *type = ObjectType(t);
+        }
+    }
+    if (content)
+        *content = data;
+    return true;
+}
+
+void PackImporter::checkpoint()
+{
+    endPack();
+    writeRefs();
+    writeMarks();
+}
+
+// the branches, then the annotated tags, which may replace one of them
+void PackImporter::writeRefs()
+{
+    // deletions first, refs/heads/a may have to make room for refs/heads/a/b
+    foreach (Branch *b, m_branches) {
+        if (b->changed && !b->hasCommit && b->deleted)
+            deleteRef(b->name);
+    }
+    foreach (Branch *b, m_branches) {
+        if (b->changed && b->hasCommit)
+            updateRef(b->name, b->commit);
+        b->changed = false;
+    }
+    QMap<QByteArray, ObjectId>::const_iterator it = m_tags.constBegin();
+    for ( ; it != m_tags.constEnd(); ++it)
+        updateRef("refs/tags/" + it.key(), it.value());
+    m_tags.clear();
+}
+
+void PackImporter::updateRef(const QByteArray &ref, const ObjectId &id)
+{
+    const QString path = m_gitDir + '/' + QString::fromUtf8(ref);
+    QDir().mkpath(QFileInfo(path).path());
+    // an empty directory left behind by deleted refs
+    QDir().rmdir(path);
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly) || file.write(id.toHex() + '\n') != 41 || !file.commit())
+        qWarning() << "WARN: could not update" << ref << "in" << m_gitDir << ":" << file.errorString();
+}
+
+void PackImporter::deleteRef(const QByteArray &ref)
+{
+    QString path = m_gitDir + '/' + QString::fromUtf8(ref);
+    QFile::remove(path);
+    QDir refs(m_gitDir);
+    for (int slash = ref.lastIndexOf('/'); slash > 0 && ref.left(slash) != "refs"; slash = ref.lastIndexOf('/', slash - 1)) {
+        if (!refs.rmdir(QString::fromUtf8(ref.left(slash))))
+            break;
+    }
+
+    // <sha1> <ref>, optionally followed by ^<sha1> of what a tag points to
+    QFile packedRefs(m_gitDir + "/packed-refs");
+    if (!packedRefs.open(QIODevice::ReadOnly))
+        return;
+    const QList<QByteArray> lines = packedRefs.readAll().split('\n');
+    packedRefs.close();
+    QByteArray kept;
+    bool found = false;
+    for (int i = 0; i < lines.size(); ++i) {
+        if (lines.at(i).size() == 41 + ref.size() && lines.at(i).endsWith(' ' + ref)) {
+            found = true;
+            if (i + 1 < lines.size() && lines.at(i + 1).startsWith('^'))
+                ++i;
+            continue;
+        }
+        if (i + 1 < lines.size() || !lines.at(i).isEmpty())
+            kept += lines.at(i) + '\n';
+    }
+    if (!found)
+        return;
+    QSaveFile file(packedRefs.fileName());
+    if (!file.open(QIODevice::WriteOnly) || file.write(kept) != kept.size() || !file.commit())
+        qWarning() << "WARN: could not remove" << ref << "from" << file.fileName() << ":" << file.errorString();
+}
+
+void PackImporter::setMark(quint64 mark, const ObjectId &id)
+{
+    m_marks.insert(mark, id);
+    if (!m_firstChangedMark || mark < m_firstChangedMark)
+        m_firstChangedMark = mark;
+}
+
+/*
+ * The marks file is ":<mark> <sha1>" per line, sorted by mark, as
+ * --export-marks writes it.  A last line without its newline is what a
+ * crash while writing the marks leaves behind; it is dropped, as it is
+ * past the run of commit marks svn2git resumes from.
+ */
+void PackImporter::loadMarks()
+{
+    QFile file(m_marksFile);
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+    bool inRun = true;
+    while (!file.atEnd()) {
+        QByteArray line = file.readLine();
+        if (!line.endsWith('\n')) {
+            qWarning() << "WARN: ignoring incomplete last line of" << m_marksFile;
+            m_firstChangedMark = m_marksRunEnd + 1;
+            break;
+        }
+        line = line.trimmed();
+        int space = line.indexOf(' ');
+        ObjectId id;
+        if (!line.startsWith(':') || space == -1 || !ObjectId::fromHex(line.mid(space + 1), &id))
+            qFatal("Corrupt mark line in %s: %s", qPrintable(m_marksFile), line.constData());
+        const quint64 mark = line.mid(1, space - 1).toULongLong();
+        m_marks.insert(mark, id);
+        if (inRun && (!m_marksRunEnd || mark == m_marksRunEnd + 1)) {
+            m_marksRunEnd = mark;
+            m_marksRunPos = file.pos();
+        } else {
+            inRun = false;
+        }
+    }
+}
+
+/*
+ * Writes the marks set since the last call.  The run of marks at the start
+ * of the file stays as it is, unless one of its marks was set again after
+ * a rewind; the lines after it are written anew.
+ */
+void PackImporter::writeMarks()
+{
+    if (!m_firstChangedMark)
+        return;
+    if (m_firstChangedMark <= m_marksRunEnd) {
+        m_marksRunEnd = 0;
+        m_marksRunPos = 0;
+    }
+
+    QByteArray data;
+    const qint64 start = m_marksRunPos;
+    bool inRun = true;
+    QMap<quint64, ObjectId>::const_iterator it = m_marks.upperBound(m_marksRunEnd);
+    for ( ; it != m_marks.constEnd(); ++it) {
+        data += ':' + QByteArray::number(it.key()) + ' ' + it.value().toHex() + '\n';
+        if (inRun && (!m_marksRunEnd || it.key() == m_marksRunEnd + 1)) {
+            m_marksRunEnd = it.key();
+            m_marksRunPos = start + data.size();
+        } else {
+            inRun = false;
+        }
+    }
+
+    QFile file(m_marksFile);
+    if (!file.open(QIODevice::ReadWrite) || !file.resize(start) || !file.seek(start)
+        || file.write(data) != data.size() || !file.flush())
+        qFatal("Failed to write %s: %s", qPrintable(m_marksFile), qPrintable(file.errorString()));
+    m_firstChangedMark = 0;
+}
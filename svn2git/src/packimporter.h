@@ -0,0 +1,238 @@
+/*
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PACKIMPORTER_H
+#define PACKIMPORTER_H
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QProcess>
+#include <QString>
+#include <QVector>
+
+#include <string.h>
+#include <zlib.h>
+
+// The name of a git object, the 20 bytes of its SHA-1. All zeros is the
+// null id.
+struct ObjectId
+{
+    ObjectId() { memset(sha1, 0, sizeof(sha1)); }
+    static ObjectId fromRaw(const char *data);
+    // false unless hex is 40 hex digits
+    static bool fromHex(const QByteArray &hex, ObjectId *id);
+
+    bool isNull() const;
+    QByteArray toHex() const;
+    bool operator==(const ObjectId &other) const { return !memcmp(sha1, other.sha1, sizeof(sha1)); }
+    bool operator!=(const ObjectId &other) const { return !(*this == other); }
+    bool operator<(const ObjectId &other) const { return memcmp(sha1, other.sha1, sizeof(sha1)) < 0; }
+
+    uchar sha1[20];
+};
+
+inline uint qHash(const ObjectId &id, uint seed = 0)
+{
+    uint h;
+    memcpy(&h, id.sha1, sizeof(h));
+    return h ^ seed;
+}
+
+/*
+ * Takes the place of git fast-import with --native-pack.  It is fed the
+ * same command stream, but hashes and deflates the objects itself and
+ * writes them into a packfile of the repository, together with its index,
+ * the refs and the marks file.  The trees are edited the way fast-import
+ * does it, so that the commits get the same hashes; compare_importers.sh
+ * checks that they do.  Only the commands svn2git sends are understood.
+ */
+class PackImporter
+{
+public:
+    PackImporter(const QString &gitDir, const QString &marksFile, const QString &logFile);
+    ~PackImporter();
+
+    // parses whatever is complete, the rest waits for the next call
+    void write(const char *data, qint64 len);
+    // what fast-import does on a checkpoint command and at the end of its
+    // input: closes the pack, then writes the refs and the marks
+    void checkpoint();
+    qint64 bytesRead() const { return m_bytes; }
+
+private:
+    Q_DISABLE_COPY(PackImporter)
+
+    enum ObjectType { CommitObject = 1, TreeObject = 2, BlobObject = 3, TagObject = 4 };
+    enum Command { NoCommand, BlobCommand, CommitCommand, ResetCommand, TagCommand };
+    enum DataTarget { BlobData, MessageData, NoteData };
+    enum { MaxActiveBranches = 5, CountNotes = 0xff };
+
+    struct TreeContent;
+    struct TreeEntry
+    {
+        TreeEntry() : mode(0), tree(0) {}
+        ~TreeEntry();
+        QByteArray name;
+        int mode;               // 0 once deleted, until the tree is stored
+        ObjectId id;            // null while a directory has changes
+        TreeContent *tree;      // the entries of a directory, once loaded
+    private:
+        Q_DISABLE_COPY(TreeEntry)
+    };
+    // entries in the order they were loaded or added, as in fast-import
+    struct TreeContent
+    {
+        ~TreeContent() { qDeleteAll(entries); }
+        QVector<TreeEntry *> entries;
+    };
+
+    struct Branch
+    {
+        Branch() : hasCommit(false), deleted(false), changed(false), notes(-1) { root.mode = 040000; }
+        QByteArray name;
+        bool hasCommit;
+        ObjectId commit;
+        TreeEntry root;
+        bool deleted;           // reset to the null id, the ref goes away
+        bool changed;           // since the refs were written
+        qint64 notes;           // notes in the tree, -1 until counted
+    };
+
+    struct PackedObject
+    {
+        int pack;
+        quint32 crc;
+        qint64 offset;
+    };
+
+    // the mapped index of a pack that was there before this run
+    struct PackIndex
+    {
+        QFile *file;
+        const uchar *fanout;    // 256 counts
+        const uchar *names;
+        int stride;             // 20, or 24 with the offsets of version 1
+    };
+
+    void handleLine(const QByteArray &line);
+    bool commitLine(const QByteArray &line);
+    void startData(qint64 length, DataTarget target);
+    void addData(const char *data, qint64 len);
+    void finishData();
+    void finishCommit();
+    void finishTag();
+    void progress(const QByteArray &line);
+
+    Branch *branch(const QByteArray &ref);
+    void touch(Branch *b);
+    void setFrom(Branch *b, const QByteArray &from);
+    ObjectId resolve(const QByteArray &spec, const char *what);
+    ObjectId commitTree(const ObjectId &commit);
+    ObjectId dataRef(const QByteArray &ref);
+
+    void fileModify(const QByteArray &line);
+    void fileRename(const QByteArray &line);
+    void noteModify(const ObjectId &note);
+
+    void loadTree(TreeEntry *root);
+    bool treeContentSet(TreeEntry *root, const char *p, const ObjectId &id, int mode, TreeContent *subtree);
+    bool treeContentRemove(TreeEntry *root, const char *p, TreeEntry *backupLeaf);
+    void replaceRoot(TreeEntry *root, const ObjectId &id, int mode, TreeContent *subtree);
+    void storeTree(TreeEntry *root);
+    qint64 changeNoteFanout(TreeEntry *root, int fanout);
+    qint64 changeNoteFanout(TreeEntry *origRoot, TreeEntry *root, const QByteArray &hex,
+                            const QByteArray &fullPath, int fanout);
+
+    void loadPackIndexes();
+    bool inOldPack(const ObjectId &id) const;
+    bool hasObject(const ObjectId &id) const { return m_objects.contains(id) || inOldPack(id); }
+    ObjectId storeObject(ObjectType type, const QByteArray &content);
+    void beginObject(ObjectType type, qint64 size);
+    void deflateData(const char *data, qint64 len, bool finish);
+    void packWrite(const char *data, qint64 len);
+    bool endObject(const ObjectId &id);
+    void startPack();
+    void endPack();
+    QByteArray readObject(const ObjectId &id, ObjectType *type);
+    QByteArray readPacked(const PackedObject &object, ObjectType *type);
+    bool catFile(const QByteArray &name, ObjectId *id, ObjectType *type, QByteArray *content);
+
+    void writeRefs();
+    void updateRef(const QByteArray &ref, const ObjectId &id);
+    void deleteRef(const QByteArray &ref);
+    void setMark(quint64 mark, const ObjectId &id);
+    void loadMarks();
+    void writeMarks();
+
+    QString m_gitDir;
+    QString m_marksFile;
+    QFile m_log;
+    qint64 m_bytes;
+
+    // the parser
+    QByteArray m_input;         // an incomplete line
+    qint64 m_dataLeft;          // -1 outside of a data command
+    bool m_skipLF;
+    DataTarget m_dataTarget;
+    QByteArray m_data;
+    Command m_command;
+    quint64 m_mark;
+    Branch *m_branch;
+    QByteArray m_tagName;
+    ObjectId m_tagFrom;
+    QByteArray m_author;
+    QByteArray m_committer;
+    QByteArray m_message;
+    QList<ObjectId> m_merges;
+    QByteArray m_noteTarget;
+    bool m_notesChanged;
+    int m_prevFanout;
+
+    QMap<QByteArray, Branch *> m_branches;
+    QList<Branch *> m_active;
+    QMap<QByteArray, ObjectId> m_tags;
+    QMap<quint64, ObjectId> m_marks;
+    // The marks file starts with an unbroken run of marks, the commits,
+    // which only ever grows.  At a checkpoint the lines after it are
+    // replaced and the run is extended, instead of rewriting the file.
+    quint64 m_marksRunEnd;      // the last mark of the run, 0 if none
+    qint64 m_marksRunPos;       // where the lines after the run start
+    quint64 m_firstChangedMark; // the lowest mark set since, 0 if none
+    QHash<ObjectId, ObjectId> m_commitTrees;
+
+    // the pack being written, and the objects of all packs written so far
+    QFile m_pack;
+    bool m_packOpen;
+    qint64 m_packSize;
+    quint32 m_crc;
+    qint64 m_objectStart;
+    z_stream m_zstream;
+    QByteArray m_deflated;
+    QCryptographicHash m_blobHash;
+    QVector<ObjectId> m_packObjects;
+    QHash<ObjectId, PackedObject> m_objects;
+    QVector<QString> m_packs;
+    QVector<PackIndex> m_oldPacks;
+    QFile m_reader;
+    int m_readerPack;
+
+    QProcess m_catFile;
+};
+
+#endif
@@ -17,14 +17,33 @@
  */
 
 #include "repository.h"
+#include "atoms.h"
+#include "metrics.h"
+#include "packimporter.h"
 #include "CommandLineParser.h"
 #include <QTextStream>
 #include <QDataStream>
 #include <QDebug>
 #include <QDir>
 #include <QFile>
+#include <QFileInfo>
+#include <QElapsedTimer>
 #include <QLinkedList>
+#include <QMutex>
 #include <QRegularExpression>
+#include <QSaveFile>
+#include <QTemporaryFile>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <functional>
+#include <queue>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
 
 static const int maxSimultaneousProcesses = 100;
 
@@ -32,6 +51,835 @@ typedef unsigned long long mark_t;
 static const mark_t initialMark = 42000000;
 static const mark_t maxMark = ULONG_MAX;
 
+/*
+ * Single producer, single consumer ring buffer in front of the pipe to
+ * git-fast-import.  The converter only blocks when the ring is full, i.e.
+ * when fast-import is behind by the whole buffer, and the thread doing the
+ * write(2) calls only sleeps when the ring is empty.
+ */
+class FastImportWriter : public QThread
+{
+public:
+    FastImportWriter(int fd, qint64 size, const QString &name);
+    ~FastImportWriter();
+
+    void write(const char *data, qint64 len);
+    bool flush(int msecs = -1);
+    void close();
+    void abandon();
+    qint64 pending() const { return head.load() - tail.load(); }
+
+protected:
+    void run();
+
+private:
+    int fd;
+    QString name;
+    QByteArray ring;
+    quint64 mask;
+    std::atomic<quint64> head;      // bytes put in by the converter
+    std::atomic<quint64> tail;      // bytes written to the pipe
+    std::atomic<bool> producerWaiting;
+    std::atomic<bool> consumerWaiting;
+    std::atomic<bool> closing;
+    std::atomic<bool> abandoned;
+    std::atomic<int> error;
+    QMutex mutex;
+    QWaitCondition dataAvailable;
+    QWaitCondition spaceAvailable;
+
+    qint64 stalls;
+    qint64 stalledTime;
+    quint64 reported;           // bytes passed on to the metrics
+
+    bool waitForSpace(quint64 needed, int msecs = -1);
+    void reportWritten();
+};
+
+FastImportWriter::FastImportWriter(int f, qint64 size, const QString &n)
+    : fd(f), name(n), head(0), tail(0), producerWaiting(false), consumerWaiting(false),
+      closing(false), abandoned(false), error(0), stalls(0), stalledTime(0), reported(0)
+{
+    // The thread polls while fast-import is not reading, so that abandon()
+    // gets through to it even then.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    // a power of two, so that positions wrap with a mask
+    quint64 capacity = 64 * 1024;
+    while (capacity < quint64(size))
+        capacity <<= 1;
+    ring = QByteArray(capacity, Qt::Uninitialized);
+    mask = capacity - 1;
+    start();
+}
+
+FastImportWriter::~FastImportWriter()
+{
+    close();
+    wait();
+    Stats::instance()->fastImportWrites(head.load(), stalls, stalledTime);
+    reportWritten();
+}
+
+void FastImportWriter::write(const char *data, qint64 len)
+{
+    while (len > 0) {
+        quint64 h = head.load(std::memory_order_relaxed);
+        quint64 space = ring.size() - (h - tail.load(std::memory_order_acquire));
+        if (!space) {
+            QElapsedTimer timer;
+            timer.start();
+            ++stalls;
+            waitForSpace(1);
+            stalledTime += timer.elapsed();
+            continue;
+        }
+
+        quint64 offset = h & mask;
+        quint64 chunk = qMin<quint64>(qMin<quint64>(space, len), ring.size() - offset);
+        memcpy(ring.data() + offset, data, chunk);
+        head.store(h + chunk);
+        data += chunk;
+        len -= chunk;
+
+        if (consumerWaiting.load()) {
+            QMutexLocker locker(&mutex);
+            dataAvailable.wakeOne();
+        }
+    }
+    // every megabyte, so the metrics keep up between checkpoints
+    if (head.load(std::memory_order_relaxed) - reported >= 1024 * 1024)
+        reportWritten();
+}
+
+// Blocks until fast-import has been handed everything written so far, or
+// for msecs at most.  Returns false if that was not long enough.
+bool FastImportWriter::flush(int msecs)
+{
+    return waitForSpace(ring.size(), msecs);
+}
+
+// Lets the thread close the pipe once the ring has drained.  Does not wait.
+void FastImportWriter::close()
+{
+    closing.store(true);
+    QMutexLocker locker(&mutex);
+    dataAvailable.wakeOne();
+}
+
+// Makes the thread drop whatever the ring still holds and close the pipe
+// right away, for when fast-import is being given up on.
+void FastImportWriter::abandon()
+{
+    abandoned.store(true);
+    close();
+}
+
+bool FastImportWriter::waitForSpace(quint64 needed, int msecs)
+{
+    QElapsedTimer timer;
+    timer.start();
+    bool waited = false;
+    bool enough = true;
+    QMutexLocker locker(&mutex);
+    while (ring.size() - (head.load() - tail.load()) < needed) {
+        if (error.load())
+            qFatal("Failed to write to process: %s", strerror(error.load()));
+        if (msecs >= 0 && timer.elapsed() >= msecs) {
+            enough = false;
+            break;
+        }
+        producerWaiting.store(true);
+        if (ring.size() - (head.load() - tail.load()) < needed) {
+            spaceAvailable.wait(&mutex, msecs < 0 ? ULONG_MAX : (unsigned long)(msecs - timer.elapsed()));
+            waited = true;
+        }
+        producerWaiting.store(false);
+    }
+    locker.unlock();
+    if (waited)
+        Metrics::instance()->pipeBlocked(name, timer.nsecsElapsed());
+    reportWritten();
+    return enough;
+}
+
+// Counts everything put into the ring, commands as well as blob data.
+void FastImportWriter::reportWritten()
+{
+    const quint64 h = head.load(std::memory_order_relaxed);
+    Metrics::instance()->fastImportWritten(name, h - reported);
+    reported = h;
+}
+
+void FastImportWriter::run()
+{
+    while (!abandoned.load()) {
+        quint64 t = tail.load(std::memory_order_relaxed);
+        quint64 h = head.load(std::memory_order_acquire);
+        if (h == t) {
+            if (closing.load() && head.load() == t)
+                break;
+            QMutexLocker locker(&mutex);
+            consumerWaiting.store(true);
+            if (head.load() == t && !closing.load())
+                dataAvailable.wait(&mutex);
+            consumerWaiting.store(false);
+            continue;
+        }
+
+        quint64 offset = t & mask;
+        quint64 chunk = qMin<quint64>(h - t, ring.size() - offset);
+        ssize_t written = ::write(fd, ring.constData() + offset, chunk);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            // let the converter find out on its next wait
+            error.store(errno);
+            QMutexLocker locker(&mutex);
+            spaceAvailable.wakeOne();
+            break;
+        }
+        tail.store(t + written);
+
+        if (producerWaiting.load()) {
+            QMutexLocker locker(&mutex);
+            spaceAvailable.wakeOne();
+        }
+    }
+    // closing the pipe is what gives fast-import its EOF
+    ::close(fd);
+}
+
+LoggingQProcess::~LoggingQProcess()
+{
+    delete writer;
+    delete importer;
+    if(logging) {
+        log.close();
+    }
+}
+
+void LoggingQProcess::startWithWriter(const QString &program, const QStringList &arguments, qint64 bufferSize)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        qFatal("Failed to create pipe for %s: %s", qPrintable(program), strerror(errno));
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    // setupChildProcess() puts the read end on the child's stdin
+    inputFd = fds[0];
+    start(program, arguments);
+    waitForStarted(-1);
+    ::close(inputFd);
+    inputFd = -1;
+
+    delete writer;
+    writer = new FastImportWriter(fds[1], bufferSize, name);
+}
+
+void LoggingQProcess::startImporter(const QString &gitDir, const QString &marksFile, const QString &logFile)
+{
+    importer = new PackImporter(gitDir, marksFile, logFile);
+    // QIODevice::write() ends up in writeData() once the device is open
+    QIODevice::open(QIODevice::WriteOnly | QIODevice::Unbuffered);
+}
+
+void LoggingQProcess::setupChildProcess()
+{
+    if (inputFd != -1)
+        dup2(inputFd, STDIN_FILENO);
+}
+
+void LoggingQProcess::closeWriteChannel()
+{
+    if (importer) {
+        importer->checkpoint();
+        return;
+    }
+    if (writer)
+        writer->close();
+    QProcess::closeWriteChannel();
+}
+
+qint64 LoggingQProcess::bytesToWrite() const
+{
+    if (importer)
+        return 0;
+    return writer ? writer->pending() : QProcess::bytesToWrite();
+}
+
+bool LoggingQProcess::waitForBytesWritten(int msecs)
+{
+    if (importer) {
+        Metrics::instance()->fastImportWritten(name, importer->bytesRead() - importerReported);
+        importerReported = importer->bytesRead();
+        return true;
+    }
+    if (!writer)
+        return QProcess::waitForBytesWritten(msecs);
+    return writer->flush(msecs);
+}
+
+bool LoggingQProcess::waitForFinished(int msecs)
+{
+    if (!importer) {
+        const bool finished = QProcess::waitForFinished(msecs);
+        if (writer) {
+            // Whatever the ring still holds is of no use to a fast-import
+            // that is gone or about to be killed, and the writer must not
+            // hold up the kill waiting for it to read.
+            if (!finished)
+                writer->abandon();
+            delete writer;
+            writer = 0;
+        }
+        return finished;
+    }
+    Metrics::instance()->fastImportWritten(name, importer->bytesRead() - importerReported);
+    importerReported = 0;
+    delete importer;
+    importer = 0;
+    setOpenMode(QIODevice::NotOpen);
+    return true;
+}
+
+qint64 LoggingQProcess::writeData(const char *data, qint64 len)
+{
+    if (importer) {
+        importer->write(data, len);
+        return len;
+    }
+    if (!writer)
+        return QProcess::writeData(data, len);
+    writer->write(data, len);
+    return len;
+}
+
+/*
+ * The refs of a repository as a tree of their path components.  git cannot
+ * have both refs/heads/a and refs/heads/a/b, and finding out whether a new
+ * ref runs into an existing one that way takes one step per component
+ * rather than a comparison with every branch.
+ */
+class RefTrie
+{
+public:
+    RefTrie() : m_nodes(1) {}
+
+    void insert(Atom ref, int branch);
+    // the branch whose ref is a directory of ref or lies below it, or -1
+    int conflict(Atom ref) const;
+    void clear() { m_nodes = QVector<Node>(1); }
+    qint64 memoryUsage() const;
+
+    // the rules of git check-ref-format
+    static bool isValidRef(Atom ref);
+
+private:
+    struct Node
+    {
+        Node() : branch(-1), below(-1) {}
+        QHash<Atom, int> children;
+        int branch;     // the branch whose ref ends here
+        int below;      // any branch with a ref further down
+    };
+    QVector<Node> m_nodes;
+};
+
+static inline int componentLength(const char *p)
+{
+    const char *slash = strchr(p, '/');
+    return slash ? slash - p : strlen(p);
+}
+
+void RefTrie::insert(Atom ref, int branch)
+{
+    int node = 0;
+    for (const char *p = ref; ; ) {
+        int len = componentLength(p);
+        Atom component = AtomTable::instance()->intern(p, len);
+        int child = m_nodes.at(node).children.value(component, -1);
+        if (child == -1) {
+            child = m_nodes.size();
+            m_nodes[node].children.insert(component, child);
+            m_nodes.append(Node());
+        }
+        if (m_nodes.at(node).below == -1)
+            m_nodes[node].below = branch;
+        node = child;
+        if (!p[len])
+            break;
+        p += len + 1;
+    }
+    if (m_nodes.at(node).branch == -1)
+        m_nodes[node].branch = branch;
+}
+
+int RefTrie::conflict(Atom ref) const
+{
+    int node = 0;
+    for (const char *p = ref; ; ) {
+        int len = componentLength(p);
+        // a component that was never interned is not in any ref
+        Atom component = AtomTable::instance()->find(p, len);
+        if (!component)
+            return -1;
+        node = m_nodes.at(node).children.value(component, -1);
+        if (node == -1)
+            return -1;
+        if (!p[len])
+            return m_nodes.at(node).below;
+        if (m_nodes.at(node).branch != -1)
+            return m_nodes.at(node).branch;
+        p += len + 1;
+    }
+}
+
+qint64 RefTrie::memoryUsage() const
+{
+    qint64 bytes = m_nodes.capacity() * sizeof(Node);
+    foreach (const Node &node, m_nodes)
+        bytes += node.children.capacity() * (sizeof(Atom) + sizeof(int) + 2 * sizeof(void *));
+    return bytes;
+}
+
+bool RefTrie::isValidRef(Atom ref)
+{
+    int size = AtomTable::size(ref);
+    if (!size || ref[size - 1] == '.' || !strcmp(ref, "@"))
+        return false;
+    for (const char *p = ref; ; ) {
+        int len = componentLength(p);
+        if (!len || p[0] == '.')
+            return false;
+        if (len >= 5 && !memcmp(p + len - 5, ".lock", 5))
+            return false;
+        for (int i = 0; i < len; ++i) {
+            uchar c = p[i];
+            if (c < 0x20 || c == 0x7f || strchr(" ~^:?*[\\", c))
+                return false;
+            if (i + 1 < len && ((c == '.' && p[i + 1] == '.') || (c == '@' && p[i + 1] == '{')))
+                return false;
+        }
+        if (!p[len])
+            return true;
+        p += len + 1;
+    }
+}
+
+/*
+ * The commits made on all branches of a repository, in the order they were
+ * made, kept as columns of revision and mark.  Branch names are interned
+ * to small ids, and each branch keeps the list of rows that are its own,
+ * so finding its commit as of some revision is a binary search that does
+ * not touch the other branches.  The branch of a row is only needed to
+ * write a snapshot, so it is not kept as a column but recovered from the
+ * row lists.
+ *
+ * Commit marks count up from initialMark, so a mark is kept as its 32-bit
+ * distance from there, and 0 stays 0.  The rare mark that does not fit is
+ * kept on the side.  A row costs 12 bytes, its revision, its mark and its
+ * place in the branch's row list, against the 8 of the int revision and
+ * mark the per-branch vectors kept, which could not hold a 64-bit mark.
+ */
+class BranchHistory
+{
+public:
+    int findAtom(Atom branch) const { return m_ids.value(branch, -1); }
+    int find(const QString &branch) const;
+    bool contains(const QString &branch) const { return find(branch) != -1; }
+    int idOf(Atom branch);
+    int id(const QString &branch) { return idOf(AtomTable::instance()->intern(branch)); }
+    int branchCount() const { return m_names.size(); }
+    const QString &name(int branch) const { return m_names.at(branch); }
+    // the UTF-8 name and the full ref it is written to
+    Atom atom(int branch) const { return m_atoms.at(branch); }
+    Atom ref(int branch) const { return m_refs.at(branch); }
+    // another branch whose ref git would not allow next to this one's, or -1
+    int conflict(int branch) const { return m_trie.conflict(m_refs.at(branch)); }
+
+    int created(int branch) const { return m_created.at(branch); }
+    void setCreated(int branch, int revnum) { m_created[branch] = revnum; }
+
+    void append(int branch, int revnum, mark_t mark);
+    bool isEmpty(int branch) const { return m_rows.at(branch).isEmpty(); }
+    int lastRevnum(int branch) const { return m_revnums.at(m_rows.at(branch).last()); }
+    mark_t lastMark(int branch) const { return m_marks.at(m_rows.at(branch).last()); }
+    // the last row of branch at or before revnum, or -1
+    int rowAt(int branch, int revnum) const;
+
+    int rowCount() const { return m_revnums.size(); }
+    int revnum(int row) const { return m_revnums.at(row); }
+    mark_t mark(int row) const;
+    // the branch of each of the first rows rows
+    QVector<int> branchColumn(int rows) const;
+
+    // for loading a snapshot; rebuilds the per-branch rows
+    void setColumns(const QVector<int> &revnums, const QVector<int> &branchIds,
+                    const QVector<mark_t> &marks);
+    void clear();
+
+    qint64 memoryUsage() const;
+    qint64 perBranchMemoryUsage() const;
+
+private:
+    QHash<Atom, int> m_ids;
+    QVector<QString> m_names;
+    QVector<Atom> m_atoms;
+    QVector<Atom> m_refs;
+    RefTrie m_trie;
+    QVector<int> m_created;
+    QVector<QVector<int> > m_rows;
+
+    enum { WideMark = 0xffffffffu };
+    static quint32 narrowMark(mark_t mark);
+    void appendRow(int revnum, mark_t mark);
+
+    QVector<int> m_revnums;
+    QVector<quint32> m_marks;
+    QHash<int, mark_t> m_wideMarks;
+};
+
+int BranchHistory::find(const QString &branch) const
+{
+    Atom atom = AtomTable::instance()->find(branch);
+    return atom ? findAtom(atom) : -1;
+}
+
+int BranchHistory::idOf(Atom branch)
+{
+    QHash<Atom, int>::const_iterator it = m_ids.constFind(branch);
+    if (it != m_ids.constEnd())
+        return *it;
+    int id = m_names.size();
+    m_ids.insert(branch, id);
+    m_names.append(AtomTable::string(branch));
+    m_atoms.append(branch);
+    if (strncmp(branch, "refs/", 5) == 0)
+        m_refs.append(branch);
+    else
+        m_refs.append(AtomTable::instance()->intern("refs/heads/" + AtomTable::bytes(branch)));
+    m_trie.insert(m_refs.last(), id);
+    m_created.append(0);
+    m_rows.append(QVector<int>());
+    return id;
+}
+
+// the mark as stored in m_marks, or WideMark if it has to go on the side
+quint32 BranchHistory::narrowMark(mark_t mark)
+{
+    if (!mark)
+        return 0;
+    if (mark <= initialMark || mark - initialMark >= WideMark)
+        return WideMark;
+    return quint32(mark - initialMark);
+}
+
+void BranchHistory::appendRow(int revnum, mark_t mark)
+{
+    quint32 narrow = narrowMark(mark);
+    if (narrow == WideMark)
+        m_wideMarks.insert(m_revnums.size(), mark);
+    m_revnums.append(revnum);
+    m_marks.append(narrow);
+}
+
+void BranchHistory::append(int branch, int revnum, mark_t mark)
+{
+    m_rows[branch].append(m_revnums.size());
+    appendRow(revnum, mark);
+}
+
+mark_t BranchHistory::mark(int row) const
+{
+    quint32 narrow = m_marks.at(row);
+    if (!narrow)
+        return 0;
+    if (narrow == WideMark)
+        return m_wideMarks.value(row);
+    return initialMark + narrow;
+}
+
+QVector<int> BranchHistory::branchColumn(int rows) const
+{
+    QVector<int> branchIds(rows);
+    for (int br = 0; br < m_rows.size(); ++br)
+        foreach (int row, m_rows.at(br)) {
+            if (row >= rows)
+                break;
+            branchIds[row] = br;
+        }
+    return branchIds;
+}
+
+int BranchHistory::rowAt(int branch, int revnum) const
+{
+    const QVector<int> &rows = m_rows.at(branch);
+    int lo = 0, hi = rows.size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (m_revnums.at(rows.at(mid)) <= revnum)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? rows.at(lo - 1) : -1;
+}
+
+void BranchHistory::setColumns(const QVector<int> &revnums, const QVector<int> &branchIds,
+                               const QVector<mark_t> &marks)
+{
+    m_revnums.clear();
+    m_marks.clear();
+    m_wideMarks.clear();
+    m_revnums.reserve(revnums.size());
+    m_marks.reserve(marks.size());
+    for (int b = 0; b < m_rows.size(); ++b)
+        m_rows[b].clear();
+    for (int row = 0; row < revnums.size(); ++row) {
+        m_rows[branchIds.at(row)].append(row);
+        appendRow(revnums.at(row), marks.at(row));
+    }
+}
+
+void BranchHistory::clear()
+{
+    m_ids.clear();
+    m_names.clear();
+    m_atoms.clear();
+    m_refs.clear();
+    m_trie.clear();
+    m_created.clear();
+    m_rows.clear();
+    m_revnums.clear();
+    m_marks.clear();
+    m_wideMarks.clear();
+}
+
+qint64 BranchHistory::memoryUsage() const
+{
+    qint64 bytes = m_revnums.capacity() * sizeof(int) + m_marks.capacity() * sizeof(quint32)
+                   + m_wideMarks.size() * (sizeof(int) + sizeof(mark_t) + 2 * sizeof(void *))
+                   + m_created.capacity() * sizeof(int) + m_rows.capacity() * sizeof(QVector<int>)
+                   + (m_atoms.capacity() + m_refs.capacity()) * sizeof(Atom);
+    foreach (const QVector<int> &rows, m_rows)
+        bytes += sizeof(QArrayData) + rows.capacity() * sizeof(int);
+    return bytes;
+}
+
+// what the same history took as a pair of int vectors per branch
+qint64 BranchHistory::perBranchMemoryUsage() const
+{
+    qint64 bytes = 0;
+    foreach (const QVector<int> &rows, m_rows)
+        bytes += sizeof(int) + 2 * (sizeof(QVector<int>) + sizeof(QArrayData) + rows.capacity() * sizeof(int));
+    return bytes;
+}
+
+/*
+ * Notes are held back until finalizeTags() so they can be written in commit
+ * date order.  Rather than keeping them in memory for the whole run, each
+ * note becomes a fixed-size record on disk, sorted in runs of RunRecords,
+ * with the texts it points to appended to a pool file next to it.  Writing
+ * them out is a merge of the runs, so memory use does not grow with the
+ * length of the history.
+ */
+class NotesSpool
+{
+public:
+    NotesSpool() : m_ready(false), m_count(0), m_latest(0) {}
+
+    // where the spool files go, they are removed again on exit
+    void setDirectory(const QString &dir) { m_dir = dir; }
+    void add(uint datetime, Atom branchRef, bool appending, const QByteArray &commit,
+             const QByteArray &text);
+    qint64 count() const { return m_count; }
+    // Writes the notes ordered by date, those with the same date in the
+    // order they were added. Each note is a commit of its own unless
+    // squash is set, then they all go into one commit dated like the last.
+    void writeSorted(LoggingQProcess &fastImport, mark_t noteMark, bool squash);
+
+private:
+    struct Record
+    {
+        quint32 datetime;
+        quint32 flags;
+        quint32 ref;            // index into m_refs
+        quint32 commitLength;   // 0 for a note on the tip of ref
+        qint64 offset;          // of the commit, followed by the text, in m_pool
+        quint32 textLength;
+        quint32 reserved;
+    };
+    enum { Appending = 1 };
+    enum { RunRecords = 64 * 1024, ReadRecords = 1024 };
+
+    struct Run
+    {
+        qint64 next;            // record numbers in m_records
+        qint64 end;
+        QVector<Record> buffer;
+        int pos;
+    };
+
+    void open();
+    void flushRun();
+    void fill(Run &run);
+
+    QString m_dir;
+    bool m_ready;
+    QTemporaryFile m_records;
+    QTemporaryFile m_pool;
+    QVector<Record> m_run;
+    QVector<qint64> m_runStarts;
+    QVector<Atom> m_refs;
+    QHash<Atom, quint32> m_refIds;
+    qint64 m_count;
+    uint m_latest;
+};
+
+void NotesSpool::open()
+{
+    QString dir = m_dir.isEmpty() ? QDir::tempPath() : m_dir;
+    m_records.setFileTemplate(dir + "/notesSpool-XXXXXX");
+    m_pool.setFileTemplate(dir + "/notesPool-XXXXXX");
+    if (!m_records.open() || !m_pool.open())
+        qFatal("Failed to create the notes spool in %s", qPrintable(dir));
+    m_run.reserve(RunRecords);
+    m_ready = true;
+}
+
+void NotesSpool::add(uint datetime, Atom branchRef, bool appending, const QByteArray &commit,
+                     const QByteArray &text)
+{
+    if (!m_ready)
+        open();
+
+    QHash<Atom, quint32>::const_iterator it = m_refIds.constFind(branchRef);
+    if (it == m_refIds.constEnd()) {
+        it = m_refIds.insert(branchRef, m_refs.size());
+        m_refs.append(branchRef);
+    }
+
+    Record r;
+    r.datetime = datetime;
+    r.flags = appending ? Appending : 0;
+    r.ref = *it;
+    r.commitLength = commit.size();
+    r.offset = m_pool.pos();
+    r.textLength = text.size();
+    r.reserved = 0;
+    if (m_pool.write(commit) != commit.size() || m_pool.write(text) != text.size())
+        qFatal("Failed to write to the notes spool: %s", qPrintable(m_pool.errorString()));
+
+    m_run.append(r);
+    ++m_count;
+    m_latest = qMax(m_latest, datetime);
+    if (m_run.size() == RunRecords)
+        flushRun();
+}
+
+void NotesSpool::flushRun()
+{
+    if (m_run.isEmpty())
+        return;
+    std::stable_sort(m_run.begin(), m_run.end(),
+                     [](const Record &a, const Record &b) { return a.datetime < b.datetime; });
+    m_runStarts.append(m_records.pos() / sizeof(Record));
+    qint64 bytes = m_run.size() * sizeof(Record);
+    if (m_records.write(reinterpret_cast<const char *>(m_run.constData()), bytes) != bytes)
+        qFatal("Failed to write to the notes spool: %s", qPrintable(m_records.errorString()));
+    m_run.clear();
+}
+
+void NotesSpool::fill(Run &run)
+{
+    int n = qMin<qint64>(ReadRecords, run.end - run.next);
+    run.buffer.resize(n);
+    run.pos = 0;
+    if (!n)
+        return;
+    qint64 bytes = n * sizeof(Record);
+    if (!m_records.seek(run.next * sizeof(Record))
+            || m_records.read(reinterpret_cast<char *>(run.buffer.data()), bytes) != bytes)
+        qFatal("Failed to read the notes spool: %s", qPrintable(m_records.errorString()));
+    run.next += n;
+}
+
+void NotesSpool::writeSorted(LoggingQProcess &fastImport, mark_t noteMark, bool squash)
+{
+    if (!m_count)
+        return;
+    flushRun();
+    if (!m_records.flush() || !m_pool.flush())
+        qFatal("Failed to write to the notes spool: %s", qPrintable(m_records.errorString()));
+
+    QVector<Run> runs(m_runStarts.size());
+    for (int i = 0; i < runs.size(); ++i) {
+        runs[i].next = m_runStarts.at(i);
+        runs[i].end = i + 1 < runs.size() ? m_runStarts.at(i + 1) : m_records.size() / sizeof(Record);
+        fill(runs[i]);
+    }
+
+    // ordered by date, then by run, which keeps equal dates in the order
+    // they were added as each run was sorted stably
+    typedef QPair<quint32, int> Head;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head> > heads;
+    for (int i = 0; i < runs.size(); ++i) {
+        if (!runs.at(i).buffer.isEmpty())
+            heads.push(Head(runs.at(i).buffer.at(0).datetime, i));
+    }
+
+    const QByteArray markLine = "mark :" + QByteArray::number(noteMark) + "\n";
+    if (squash) {
+        const QByteArray message = "These are the git notes pointing to SVN revisions of the converted repo.\n";
+        fastImport.write("commit refs/notes/commits\n" + markLine
+                         + "committer svn2git <svn2git@FreeBSD.org> " + QByteArray::number(m_latest) + " +0000\n"
+                         + "data " + QByteArray::number(message.length()) + "\n" + message + "\n");
+    }
+
+    QByteArray data;
+    while (!heads.empty()) {
+        const int i = heads.top().second;
+        Run &run = runs[i];
+        heads.pop();
+        const Record r = run.buffer.at(run.pos++);
+
+        data.resize(r.commitLength + r.textLength);
+        if (!m_pool.seek(r.offset) || m_pool.read(data.data(), data.size()) != data.size())
+            qFatal("Failed to read the notes spool: %s", qPrintable(m_pool.errorString()));
+        const QByteArray branchRef = QByteArray::fromRawData(m_refs.at(r.ref), AtomTable::size(m_refs.at(r.ref)));
+
+        QByteArray s;
+        if (!squash) {
+            const QByteArray message = ((r.flags & Appending) ? "Appending" : "Adding")
+                + QByteArray(" Git note for current ") + branchRef + "\n";
+            s.append("commit refs/notes/commits\n");
+            s.append(markLine);
+            s.append("committer svn2git <svn2git@FreeBSD.org> " + QByteArray::number(r.datetime) + " +0000" + "\n");
+            s.append("data " + QByteArray::number(message.length()) + "\n");
+            s.append(message + "\n");
+        }
+        s.append("N inline ");
+        s.append(r.commitLength ? data.left(r.commitLength) : branchRef);
+        s.append("\ndata " + QByteArray::number(r.textLength) + "\n");
+        s.append(data.constData() + r.commitLength, r.textLength);
+        s.append("\n");
+        fastImport.write(s);
+
+        if (run.pos == run.buffer.size())
+            fill(run);
+        if (run.pos < run.buffer.size())
+            heads.push(Head(run.buffer.at(run.pos).datetime, i));
+    }
+    if (squash)
+        fastImport.write("\n");
+}
+
 class FastImportRepository : public Repository
 {
 public:
@@ -50,6 +898,7 @@ public:
         friend class FastImportRepository;
 
         FastImportRepository *repository;
+        Atom branchAtom;
         QByteArray branch;
         QByteArray svnprefix;
         QByteArray author;
@@ -64,12 +913,15 @@ public:
         QMap<QString, int> merge_map;
         QVector<int> merges;
 
-        QStringList deletedFiles;
-        QList<QPair<QString, QString>> renamedFiles;
+        QList<QByteArray> deletedFiles;
+        QList<QPair<QByteArray, QByteArray>> renamedFiles;
         QByteArray modifiedFiles;
         QByteArray resetFromTree;
 
         inline Transaction() {}
+        // appends the fast-import commands of the commit to out
+        void serialize(QByteArray &out, Atom branchRef, mark_t mark, mark_t parentmark,
+                       const QByteArray &message, QByteArray &mergeDesc) const;
     public:
         ~Transaction();
         int commit();
@@ -83,16 +935,20 @@ public:
         void deleteFile(const QString &path);
         void renameFile(const QString &from, const QString &to);
         QIODevice *addFile(const QString &path, int mode, qint64 length);
+        bool addKnownFile(const QString &path, int mode, const QByteArray &checksum);
+        void noteFileBlob(int mode, const QByteArray &checksum, const QByteArray &blobSha1);
 
         bool commitNote(const QByteArray &noteText, bool append,
                         const QByteArray &commit = QByteArray());
         const QByteArray& getBranch() const { return branch; }
     };
     FastImportRepository(const Rules::Repository &rule);
+    static void benchmarkLog(const QString &fileName);
     int setupIncremental(int &cutoff);
     void restoreAnnotatedTags();
     void restoreBranchNotes();
     void restoreLog();
+    void restoreBlobIndex(int cutoff);
     ~FastImportRepository();
 
     void reloadBranches();
@@ -114,6 +970,7 @@ public:
     void commit();
 
     bool branchExists(const QString& branch) const;
+    int branchCommitRevnum(const QString& branch, int revnum);
     const QByteArray branchNote(const QString& branch) const;
     void setBranchNote(const QString& branch, const QByteArray& noteText);
 
@@ -122,19 +979,26 @@ public:
     QString getName() const;
     Repository *getEffectiveRepository();
 private:
-    struct Branch
+    BranchHistory branches;
+    QHash<QString, QByteArray> branchNotes;
+    QHash<QString, AnnotatedTag> annotatedTags;
+
+    /* svn SHA-1 and mode of every blob imported so far, mapped to the git
+     * blob SHA-1.  Entries are only written to disk at checkpoints, once
+     * fast-import has made the blobs durable. */
+    struct BlobIndexEntry
     {
-        int created;
-        QVector<int> commits;
-        QVector<int> marks;
+        QByteArray sha1;
+        int revnum;
     };
+    QHash<QByteArray, BlobIndexEntry> blobIndex;
+    QByteArray pendingBlobIndex;
+    void saveBlobIndex();
 
-    QHash<QString, Branch> branches;
-    QHash<QString, QByteArray> branchNotes;
-    QHash<QString, AnnotatedTag> annotatedTags;
-    std::vector<std::pair<uint, std::unique_ptr<QByteArray>>> delayed_notes;
+    NotesSpool delayedNotes;
     QString name;
     QString prefix;
+    QByteArray prefixUtf8;
     LoggingQProcess fastImport;
     int commitCount;
     int outstandingTransactions;
@@ -145,7 +1009,7 @@ private:
 
   /* Optional filter to fix up log messages */
     QProcess filterMsg;
-    QByteArray msgFilter(const QByteArray& msg);
+    static QByteArray msgFilter(const QByteArray& msg);
 
     /* starts at 0, and counts up.  */
     mark_t last_commit_mark;
@@ -155,6 +1019,32 @@ private:
 
     bool processHasStarted;
 
+    /* A checkpoint asked for by newTransaction() is made at the end of the
+     * revision, when everything in the branch table has been sent.  The
+     * table as it was then is kept in pendingSnapshot and written out once
+     * fast-import has echoed the progress line sent after the checkpoint,
+     * which is looked for whenever a revision ends.  The marks file
+     * position of the last snapshot is kept to avoid re-reading it from
+     * the start. */
+    struct PendingSnapshot
+    {
+        QByteArray sentinel;
+        qint64 logPos;          // where to look for the sentinel from
+        int rowCount;
+        QVector<int> created;
+        mark_t lastCommitMark;
+    };
+    bool checkpointPending;
+    bool snapshotPending;
+    PendingSnapshot pendingSnapshot;
+    qint64 snapshotMarksPos;
+    mark_t snapshotMarksMark;
+    void checkpoint();
+    bool restoreSnapshot(QFile &logfile, int cutoff, int *last_revnum);
+    void writeSnapshot(qint64 logPos);
+    void writeSnapshot(qint64 logPos, int rowCount, const QVector<int> &created, mark_t lastCommitMark);
+    void writePendingSnapshot();
+
     void startFastImport();
     void closeFastImport();
 
@@ -162,6 +1052,7 @@ private:
     void forgetTransaction(Transaction *t);
 
     int resetBranch(const QString &branch, int revnum, mark_t mark, const QByteArray &resetTo, const QByteArray &comment);
+    bool validRef(int br) const;
     long long markFrom(const QString &branchFrom, int branchRevNum, QByteArray &desc);
 
     friend class ProcessCache;
@@ -196,6 +1087,10 @@ public:
         void renameFile(const QString &from, const QString &to) { txn->renameFile(from, to); };
         QIODevice *addFile(const QString &path, int mode, qint64 length)
         { return txn->addFile(prefix + path, mode, length); }
+        bool addKnownFile(const QString &path, int mode, const QByteArray &checksum)
+        { return txn->addKnownFile(prefix + path, mode, checksum); }
+        void noteFileBlob(int mode, const QByteArray &checksum, const QByteArray &blobSha1)
+        { txn->noteFileBlob(mode, checksum, blobSha1); }
 
         bool commitNote(const QByteArray &noteText, bool append,
                         const QByteArray &commit)
@@ -210,6 +1105,7 @@ public:
     void restoreAnnotatedTags() {}
     void restoreBranchNotes() {}
     void restoreLog() {}
+    void restoreBlobIndex(int) {}
 
     void reloadBranches() { return repo->reloadBranches(); }
     int createBranch(const QString &branch, int revnum,
@@ -244,6 +1140,8 @@ public:
 
     bool branchExists(const QString& branch) const
     { return repo->branchExists(branch); }
+    int branchCommitRevnum(const QString& branch, int revnum)
+    { return repo->branchCommitRevnum(branch, revnum); }
     const QByteArray branchNote(const QString& branch) const
     { return repo->branchNote(branch); }
     void setBranchNote(const QString& branch, const QByteArray& noteText)
@@ -311,6 +1209,11 @@ QDataStream &operator>>(QDataStream &in, FastImportRepository::AnnotatedTag &ann
     return in;
 }
 
+void benchmarkFastImportLog(const QString &fileName)
+{
+    FastImportRepository::benchmarkLog(fileName);
+}
+
 Repository *createRepository(const Rules::Repository &rule, const QHash<QString, Repository *> &repositories)
 {
     if (rule.forwardTo.isEmpty())
@@ -344,19 +1247,35 @@ static QString branchNotesFileName(QString name)
     return name;
 }
 
-FastImportRepository::FastImportRepository(const Rules::Repository &rule)
-    : name(rule.name), prefix(rule.forwardTo), fastImport(name), commitCount(0), outstandingTransactions(0),
-      last_commit_mark(initialMark), next_file_mark(maxMark - 1), processHasStarted(false)
+static QString blobIndexFileName(QString name)
 {
-    foreach (Rules::Repository::Branch branchRule, rule.branches) {
-        Branch branch;
-        branch.created = 1;
+    name.replace('/', '_');
+    name.prepend("blobIndex-");
+    return name;
+}
 
-        branches.insert(branchRule.name, branch);
-    }
+static QString snapshotFileName(QString name)
+{
+    name.replace('/', '_');
+    name.prepend("snapshot-");
+    return name;
+}
+
+static QByteArray blobIndexKey(int mode, const QByteArray &checksum)
+{
+    return checksum + ' ' + QByteArray::number(mode, 8);
+}
+
+FastImportRepository::FastImportRepository(const Rules::Repository &rule)
+    : name(rule.name), prefix(rule.forwardTo), prefixUtf8(prefix.toUtf8()), fastImport(name), commitCount(0), outstandingTransactions(0),
+      last_commit_mark(initialMark), next_file_mark(maxMark - 1), processHasStarted(false),
+      checkpointPending(false), snapshotPending(false), snapshotMarksPos(0), snapshotMarksMark(initialMark)
+{
+    foreach (Rules::Repository::Branch branchRule, rule.branches)
+        branches.setCreated(branches.id(branchRule.name), 1);
 
     // create the default branch
-    branches["master"].created = 1;
+    branches.setCreated(branches.id("master"), 1);
 
     if (!CommandLineParser::instance()->contains("dry-run") && !CommandLineParser::instance()->contains("create-dump")) {
         fastImport.setWorkingDirectory(name);
@@ -386,6 +1305,7 @@ FastImportRepository::FastImportRepository(const Rules::Repository &rule)
                 marks.close();
             }
         }
+        delayedNotes.setDirectory(name);
     }
 }
 
@@ -399,7 +1319,13 @@ static QString logFileName(QString name)
     return name;
 }
 
-static mark_t lastValidMark(const QString& name)
+/*
+ * Returns the last mark of the unbroken run of commit marks at the start of
+ * the marks file.  If offset is given, parsing starts at the line it points
+ * to, provided that line still holds mark start, and it is set to the
+ * offset of the line holding the returned mark.
+ */
+static mark_t lastValidMark(const QString& name, qint64 *offset = 0, mark_t start = initialMark)
 {
     QFile marksfile(name + "/" + marksFileName(name));
     if (!marksfile.open(QIODevice::ReadOnly))
@@ -407,9 +1333,19 @@ static mark_t lastValidMark(const QString& name)
 
     qDebug()  << "marksfile " << marksfile.fileName() ;
     mark_t prev_mark = initialMark;
+    qint64 prev_pos = 0;
+
+    if (offset && start != initialMark && marksfile.seek(*offset)
+        && marksfile.readLine().startsWith(":" + QByteArray::number(start) + " ")) {
+        prev_mark = start;
+        prev_pos = *offset;
+    } else {
+        marksfile.seek(0);
+    }
 
     int lineno = 0;
     while (!marksfile.atEnd()) {
+        qint64 pos = marksfile.pos();
         QString line = marksfile.readLine();
         ++lineno;
         if (line.isEmpty())
@@ -443,8 +1379,11 @@ static mark_t lastValidMark(const QString& name)
             break;
 
         prev_mark = mark;
+        prev_pos = pos;
     }
 
+    if (offset)
+        *offset = prev_pos;
     return prev_mark;
 }
 
@@ -458,13 +1397,17 @@ int FastImportRepository::setupIncremental(int &cutoff)
 
     QRegExp progress("progress SVN r(\\d+) branch (.*) = :(\\d+)");
 
-    mark_t last_valid_mark = lastValidMark(name);
-
     int last_revnum = 0;
     qint64 pos = 0;
     int retval = 0;
     QString bkup = logfile.fileName() + ".old";
 
+    // only the part of the log past the snapshot needs replaying
+    if (!restoreSnapshot(logfile, cutoff, &last_revnum))
+        logfile.seek(0);
+    mark_t last_valid_mark = lastValidMark(name, &snapshotMarksPos, snapshotMarksMark);
+    snapshotMarksMark = last_valid_mark;
+
     while (!logfile.atEnd()) {
         pos = logfile.pos();
         QByteArray line = logfile.readLine();
@@ -500,13 +1443,14 @@ int FastImportRepository::setupIncremental(int &cutoff)
         if (last_commit_mark < mark)
             last_commit_mark = mark;
 
-        Branch &br = branches[branch];
-        if (!br.created || !mark || br.marks.isEmpty() || !br.marks.last())
-            br.created = revnum;
-        br.commits.append(revnum);
-        br.marks.append(mark);
+        int br = branches.id(branch);
+        if (!branches.created(br) || !mark || branches.isEmpty(br) || !branches.lastMark(br))
+            branches.setCreated(br, revnum);
+        branches.append(br, revnum, mark);
     }
 
+    writeSnapshot(logfile.pos());
+
     retval = last_revnum + 1;
     if (retval == cutoff)
         /*
@@ -525,9 +1469,262 @@ int FastImportRepository::setupIncremental(int &cutoff)
     // truncate, so that we ignore the rest of the revisions
     qDebug() << name << "truncating history to revision" << cutoff;
     logfile.resize(pos);
+    writeSnapshot(pos);
     return cutoff;
 }
 
+/*
+ * The snapshot is the branch history as replayed from the first logPos
+ * bytes of the log, in native byte order:
+ *
+ *   header, the logTail bytes before logPos, then for each branch
+ *   quint32 name size, qint32 created and the UTF-8 name, then the three
+ *   columns of BranchHistory: rowCount qint32 revisions, rowCount qint32
+ *   branch ids and rowCount quint64 marks.
+ *
+ * It is only trusted if the log still has the same bytes before logPos.
+ */
+struct SnapshotHeader
+{
+    char magic[8];
+    quint32 version;
+    quint32 branchCount;
+    quint32 rowCount;
+    quint32 reserved;
+    qint64 logPos;
+    qint64 marksPos;
+    quint64 marksMark;
+    quint64 lastCommitMark;
+    qint32 lastRevnum;
+    quint32 tailSize;
+};
+
+static const char snapshotMagic[8] = { 's', 'v', 'n', '2', 'g', 'i', 't', 'S' };
+static const quint32 snapshotVersion = 2;
+static const int snapshotTailSize = 256;
+
+template <typename T> static void appendRaw(QByteArray &out, const T &value)
+{
+    out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+static QByteArray logTail(QFile &logfile, qint64 logPos)
+{
+    qint64 start = qMax<qint64>(0, logPos - snapshotTailSize);
+    if (!logfile.seek(start))
+        return QByteArray();
+    return logfile.read(logPos - start);
+}
+
+bool FastImportRepository::restoreSnapshot(QFile &logfile, int cutoff, int *last_revnum)
+{
+    QFile snapshotFile(name + "/" + snapshotFileName(name));
+    if (!snapshotFile.open(QIODevice::ReadOnly))
+        return false;
+    const uchar *p = snapshotFile.map(0, snapshotFile.size());
+    if (!p)
+        return false;
+    const uchar *end = p + snapshotFile.size();
+
+    SnapshotHeader header;
+    if (end - p < qint64(sizeof(header)))
+        return false;
+    memcpy(&header, p, sizeof(header));
+    p += sizeof(header);
+    if (memcmp(header.magic, snapshotMagic, sizeof(snapshotMagic)) != 0
+        || header.version != snapshotVersion) {
+        qWarning() << "WARN:" << snapshotFile.fileName() << "has an unknown format, ignoring it";
+        return false;
+    }
+    // a resume before the snapshot has to truncate, which needs the log
+    if (header.lastRevnum >= cutoff || header.logPos > logfile.size()
+        || quint64(end - p) < header.tailSize
+        || logTail(logfile, header.logPos) != QByteArray::fromRawData(reinterpret_cast<const char *>(p), header.tailSize))
+        return false;
+    p += header.tailSize;
+
+    BranchHistory table;
+    for (quint32 i = 0; i < header.branchCount; ++i) {
+        quint32 nameSize;
+        qint32 created;
+        if (end - p < 8)
+            return false;
+        memcpy(&nameSize, p, 4);
+        memcpy(&created, p + 4, 4);
+        p += 8;
+        if (quint64(end - p) < nameSize)
+            return false;
+        int br = table.idOf(AtomTable::instance()->intern(reinterpret_cast<const char *>(p), nameSize));
+        table.setCreated(br, created);
+        p += nameSize;
+    }
+
+    const quint32 rows = header.rowCount;
+    if (quint64(end - p) < quint64(rows) * (2 * sizeof(qint32) + sizeof(quint64)))
+        return false;
+    QVector<int> revnums(rows), branchIds(rows);
+    QVector<mark_t> marks(rows);
+    memcpy(revnums.data(), p, rows * sizeof(qint32));
+    p += rows * sizeof(qint32);
+    memcpy(branchIds.data(), p, rows * sizeof(qint32));
+    p += rows * sizeof(qint32);
+    memcpy(marks.data(), p, rows * sizeof(quint64));
+    foreach (int br, branchIds)
+        if (br < 0 || br >= table.branchCount())
+            return false;
+
+    // every mark the table refers to must have been saved by fast-import,
+    // or the next commit would name a parent it does not know
+    mark_t newest = header.lastCommitMark;
+    foreach (mark_t mark, marks)
+        newest = qMax(newest, mark);
+    qint64 marksPos = header.marksPos;
+    if (lastValidMark(name, &marksPos, header.marksMark) < newest)
+        return false;
+
+    table.setColumns(revnums, branchIds, marks);
+    // branches the rules added since the snapshot was written
+    for (int br = 0; br < branches.branchCount(); ++br)
+        if (table.findAtom(branches.atom(br)) == -1)
+            table.setCreated(table.idOf(branches.atom(br)), branches.created(br));
+
+    branches = table;
+    last_commit_mark = header.lastCommitMark;
+    *last_revnum = header.lastRevnum;
+    snapshotMarksPos = header.marksPos;
+    snapshotMarksMark = header.marksMark;
+    logfile.seek(header.logPos);
+    qDebug() << name << "restored" << table.branchCount() << "branches from" << snapshotFile.fileName()
+             << "up to revision" << header.lastRevnum;
+    return true;
+}
+
+void FastImportRepository::writeSnapshot(qint64 logPos)
+{
+    QVector<int> created(branches.branchCount());
+    for (int br = 0; br < created.size(); ++br)
+        created[br] = branches.created(br);
+    writeSnapshot(logPos, branches.rowCount(), created, last_commit_mark);
+}
+
+/*
+ * Writes the first rowCount rows of the branch table, and the branches
+ * that had a created revision then, as replayed from the first logPos
+ * bytes of the log.
+ */
+void FastImportRepository::writeSnapshot(qint64 logPos, int rowCount, const QVector<int> &created,
+                                         mark_t lastCommitMark)
+{
+    if (CommandLineParser::instance()->contains("dry-run") || CommandLineParser::instance()->contains("create-dump"))
+        return;
+
+    QFile logfile(logFileName(name));
+    if (!logfile.open(QIODevice::ReadOnly))
+        return;
+    const QByteArray tail = logTail(logfile, logPos);
+    snapshotMarksMark = lastValidMark(name, &snapshotMarksPos, snapshotMarksMark);
+
+    // the newest revision any branch has got to
+    int last_revnum = 0;
+    for (int row = 0; row < rowCount; ++row)
+        last_revnum = qMax(last_revnum, branches.revnum(row));
+
+    SnapshotHeader header;
+    memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+    header.version = snapshotVersion;
+    header.branchCount = created.size();
+    header.rowCount = rowCount;
+    header.reserved = 0;
+    header.logPos = logPos;
+    header.marksPos = snapshotMarksPos;
+    header.marksMark = snapshotMarksMark;
+    header.lastCommitMark = lastCommitMark;
+    header.lastRevnum = last_revnum;
+    header.tailSize = tail.size();
+
+    QByteArray data;
+    appendRaw(data, header);
+    data.append(tail);
+    for (int br = 0; br < created.size(); ++br) {
+        Atom branchName = branches.atom(br);
+        appendRaw(data, quint32(AtomTable::size(branchName)));
+        appendRaw(data, qint32(created.at(br)));
+        data.append(branchName, AtomTable::size(branchName));
+    }
+    for (int row = 0; row < rowCount; ++row)
+        appendRaw(data, qint32(branches.revnum(row)));
+    foreach (int br, branches.branchColumn(rowCount))
+        appendRaw(data, qint32(br));
+    for (int row = 0; row < rowCount; ++row)
+        appendRaw(data, quint64(branches.mark(row)));
+
+    QSaveFile snapshotFile(name + "/" + snapshotFileName(name));
+    if (!snapshotFile.open(QIODevice::WriteOnly) || snapshotFile.write(data) != data.size()
+        || !snapshotFile.commit())
+        qWarning() << "WARN: could not write" << snapshotFile.fileName();
+}
+
+/*
+ * Called once the revision that asked for a checkpoint is out, so that
+ * the marks fast-import saves are all those the branch table refers to.
+ */
+void FastImportRepository::checkpoint()
+{
+    Metrics::Timer metricsTimer(Metrics::Checkpoint);
+    checkpointPending = false;
+    startFastImport();
+    // write everything to disk every 10000 commits
+    fastImport.write("checkpoint\n");
+    saveBlobIndex();
+    qDebug() << "checkpoint!, marks file truncated";
+
+    if (CommandLineParser::instance()->contains("dry-run") || CommandLineParser::instance()->contains("create-dump")) {
+        fastImport.waitForBytesWritten(-1);
+        return;
+    }
+
+    // what the checkpoint saves, to be written once fast-import is past it
+    pendingSnapshot.sentinel = "progress snapshot of " + name.toUtf8() + " after commit "
+                               + QByteArray::number(commitCount);
+    pendingSnapshot.logPos = QFileInfo(logFileName(name)).size();
+    pendingSnapshot.rowCount = branches.rowCount();
+    pendingSnapshot.created.resize(branches.branchCount());
+    for (int br = 0; br < branches.branchCount(); ++br)
+        pendingSnapshot.created[br] = branches.created(br);
+    pendingSnapshot.lastCommitMark = last_commit_mark;
+    snapshotPending = true;
+    fastImport.write(pendingSnapshot.sentinel + "\n\n");
+    fastImport.waitForBytesWritten(-1);
+}
+
+/*
+ * Writes the snapshot taken at the last checkpoint if fast-import has
+ * echoed its progress line by now.  Only reads what was added to the log
+ * since it last looked, and never waits.
+ */
+void FastImportRepository::writePendingSnapshot()
+{
+    QFile logfile(logFileName(name));
+    if (!logfile.open(QIODevice::ReadOnly) || logfile.size() <= pendingSnapshot.logPos
+        || !logfile.seek(pendingSnapshot.logPos))
+        return;
+    while (!logfile.atEnd()) {
+        QByteArray line = logfile.readLine();
+        if (!line.endsWith('\n'))
+            break;
+        pendingSnapshot.logPos = logfile.pos();
+        if (line.trimmed() == pendingSnapshot.sentinel) {
+            Metrics::Timer metricsTimer(Metrics::Checkpoint);
+            snapshotPending = false;
+            logfile.close();
+            writeSnapshot(pendingSnapshot.logPos, pendingSnapshot.rowCount, pendingSnapshot.created,
+                          pendingSnapshot.lastCommitMark);
+            pendingSnapshot.created.clear();
+            return;
+        }
+    }
+}
+
 void FastImportRepository::restoreAnnotatedTags()
 {
     QFile annotatedTagsFile(name + "/" + annotatedTagsFileName(name));
@@ -550,6 +1747,52 @@ void FastImportRepository::restoreBranchNotes()
     branchNotesFile.close();
 }
 
+void FastImportRepository::restoreBlobIndex(int cutoff)
+{
+    QFile blobIndexFile(name + "/" + blobIndexFileName(name));
+    if (!blobIndexFile.open(QIODevice::ReadOnly))
+        return;
+
+    // one "svn-sha1 mode git-sha1 revnum" line per blob
+    bool truncated = false;
+    while (!blobIndexFile.atEnd()) {
+        QList<QByteArray> fields = blobIndexFile.readLine().trimmed().split(' ');
+        if (fields.size() != 4)
+            continue;
+        BlobIndexEntry entry;
+        entry.sha1 = fields[2];
+        entry.revnum = fields[3].toInt();
+        // forget what was imported past the point we resume from, so a
+        // later gc of the unreferenced blobs cannot leave us dangling
+        if (entry.revnum >= cutoff) {
+            truncated = true;
+            continue;
+        }
+        blobIndex.insert(blobIndexKey(fields[1].toInt(0, 8), fields[0]), entry);
+    }
+    blobIndexFile.close();
+
+    if (truncated) {
+        blobIndexFile.open(QIODevice::WriteOnly | QIODevice::Truncate);
+        QHash<QByteArray, BlobIndexEntry>::const_iterator it = blobIndex.constBegin();
+        for ( ; it != blobIndex.constEnd(); ++it)
+            blobIndexFile.write(it.key() + ' ' + it.value().sha1 + ' '
+                                + QByteArray::number(it.value().revnum) + '\n');
+        blobIndexFile.close();
+    }
+    qDebug() << name << "knows" << blobIndex.size() << "imported blobs";
+}
+
+void FastImportRepository::saveBlobIndex()
+{
+    if (pendingBlobIndex.isEmpty())
+        return;
+    QFile blobIndexFile(name + "/" + blobIndexFileName(name));
+    if (blobIndexFile.open(QIODevice::WriteOnly | QIODevice::Append))
+        blobIndexFile.write(pendingBlobIndex);
+    pendingBlobIndex.clear();
+}
+
 void FastImportRepository::restoreLog()
 {
     QString file = logFileName(name);
@@ -564,11 +1807,13 @@ FastImportRepository::~FastImportRepository()
 {
     Q_ASSERT(outstandingTransactions == 0);
     closeFastImport();
+    Stats::instance()->branchHistoryUsage(branches.rowCount(), branches.branchCount(),
+                                          branches.memoryUsage(), branches.perBranchMemoryUsage());
 }
 
 void FastImportRepository::closeFastImport()
 {
-    if (fastImport.state() != QProcess::NotRunning) {
+    if (fastImport.importerState() != QProcess::NotRunning) {
         int fastImportTimeout = CommandLineParser::instance()->optionArgument(QLatin1String("fast-import-timeout"), QLatin1String("30")).toInt();
         if(fastImportTimeout == 0) {
             qDebug() << "Waiting forever for fast-import to finish.";
@@ -577,13 +1822,17 @@ void FastImportRepository::closeFastImport()
             qDebug() << "Waiting" << fastImportTimeout << "seconds for fast-import to finish.";
             fastImportTimeout *= 10000;
         }
+        // The ring drains in the background, within the same timeout.
         fastImport.write("checkpoint\n");
-        fastImport.waitForBytesWritten(-1);
         fastImport.closeWriteChannel();
         if (!fastImport.waitForFinished(fastImportTimeout)) {
             fastImport.terminate();
             if (!fastImport.waitForFinished(200))
                 qWarning() << "WARN: git-fast-import for repository" << name << "did not die";
+        } else {
+            saveBlobIndex();
+            if (snapshotPending)
+                writePendingSnapshot();
         }
     }
     processHasStarted = false;
@@ -593,11 +1842,10 @@ void FastImportRepository::closeFastImport()
 void FastImportRepository::reloadBranches()
 {
     bool reset_notes = false;
-    foreach (QString branch, branches.keys()) {
-        Branch &br = branches[branch];
-
-        if (br.marks.isEmpty() || !br.marks.last())
+    for (int br = 0; br < branches.branchCount(); ++br) {
+        if (branches.isEmpty(br) || !branches.lastMark(br))
             continue;
+        const QString &branch = branches.name(br);
 
         reset_notes = true;
 
@@ -607,7 +1855,7 @@ void FastImportRepository::reloadBranches()
 
         startFastImport();
         fastImport.write("reset " + branchRef +
-                        "\nfrom :" + QByteArray::number(br.marks.last()) + "\n\n"
+                        "\nfrom :" + QByteArray::number(branches.lastMark(br)) + "\n\n"
                         "progress Branch " + branchRef + " reloaded\n");
     }
 
@@ -623,28 +1871,28 @@ void FastImportRepository::reloadBranches()
 
 long long FastImportRepository::markFrom(const QString &branchFrom, int branchRevNum, QByteArray &branchFromDesc)
 {
-    // Avoid using operator[], which creates a new branch for branchFrom that
+    // Avoid using id(), which creates a new branch for branchFrom that
     // might not even exist.
-    if (!branches.contains(branchFrom)) {
+    int brFrom = branches.find(branchFrom);
+    if (brFrom == -1) {
         return -1;
     }
-    Branch &brFrom = branches[branchFrom];
-    if (!brFrom.created)
+    if (!branches.created(brFrom))
         return -1;
 
-    if (brFrom.commits.isEmpty()) {
+    if (branches.isEmpty(brFrom)) {
         return -1;
     }
-    if (branchRevNum == brFrom.commits.last()) {
-        return brFrom.marks.last();
+    if (branchRevNum == branches.lastRevnum(brFrom)) {
+        return branches.lastMark(brFrom);
     }
 
-    QVector<int>::const_iterator it = qUpperBound(brFrom.commits, branchRevNum);
-    if (it == brFrom.commits.begin()) {
+    int row = branches.rowAt(brFrom, branchRevNum);
+    if (row == -1) {
         return 0;
     }
 
-    int closestCommit = *--it;
+    int closestCommit = branches.revnum(row);
 
     if (!branchFromDesc.isEmpty()) {
         branchFromDesc += " at r" + QByteArray::number(branchRevNum);
@@ -653,7 +1901,7 @@ long long FastImportRepository::markFrom(const QString &branchFrom, int branchRe
         }
     }
 
-    return brFrom.marks[it - brFrom.commits.begin()];
+    return branches.mark(row);
 }
 
 int FastImportRepository::createBranch(const QString &branch, int revnum,
@@ -699,10 +1947,11 @@ int FastImportRepository::createBranch(const QString &branch, int revnum,
     if (!branchRef.startsWith("refs/"))
         branchRef.prepend("refs/heads/");
 
-    Branch &br = branches[branch];
-    br.created = revnum;
-    br.commits.append(revnum);
-    br.marks.append(0);
+    int br = branches.id(branch);
+    if (!validRef(br))
+        return EXIT_FAILURE;
+    branches.setCreated(br, revnum);
+    branches.append(br, revnum, 0);
 
     QByteArray cmd = "reset " + branchRef + /*"\nfrom " + resetTo + */"\n\n"
                      "progress SVN r" + QByteArray::number(revnum)
@@ -749,10 +1998,11 @@ int FastImportRepository::createBranch(const QString &branch, int revnum,
     if (!branchRef.startsWith("refs/"))
         branchRef.prepend("refs/heads/");
 
-    Branch &br = branches[branch];
-    br.created = revnum;
-    br.commits.append(revnum);
-    br.marks.append(mark);
+    int br = branches.id(branch);
+    if (!validRef(br))
+        return EXIT_FAILURE;
+    branches.setCreated(br, revnum);
+    branches.append(br, revnum, mark);
 
     QByteArray cmd = "reset " + branchRef + "\nfrom " + branchFromRef + "\n\n"
                      "progress SVN r" + QByteArray::number(revnum)
@@ -765,6 +2015,16 @@ int FastImportRepository::createBranch(const QString &branch, int revnum,
     return EXIT_SUCCESS;
 }
 
+// fast-import would die on a ref git does not accept, so stop here with
+// a message that names the branch
+bool FastImportRepository::validRef(int br) const
+{
+    if (RefTrie::isValidRef(branches.ref(br)))
+        return true;
+    qCritical() << branches.ref(br) << "in repository" << name << "is not a valid git ref name";
+    return false;
+}
+
 int FastImportRepository::deleteBranch(const QString &branch, int revnum)
 {
     static QByteArray null_sha(40, '0');
@@ -777,9 +2037,11 @@ int FastImportRepository::resetBranch(const QString &branch, int revnum, mark_t
     if (!branchRef.startsWith("refs/"))
         branchRef.prepend("refs/heads/");
 
-    Branch &br = branches[branch];
+    int br = branches.id(branch);
+    if (comment != "delete" && !validRef(br))
+        return EXIT_FAILURE;
     QByteArray backupCmd;
-    if (br.created && br.created != revnum && !br.marks.isEmpty() && br.marks.last()) {
+    if (branches.created(br) && branches.created(br) != revnum && !branches.isEmpty(br) && branches.lastMark(br)) {
         QByteArray backupBranch;
         if ((comment == "delete") && branchRef.startsWith("refs/heads/"))
             backupBranch = "refs/tags/backups/" + branchRef.mid(11) + "@" + QByteArray::number(revnum);
@@ -790,9 +2052,8 @@ int FastImportRepository::resetBranch(const QString &branch, int revnum, mark_t
         backupCmd = "reset " + backupBranch + "\nfrom " + branchRef + "\n\n";
     }
 
-    br.created = revnum;
-    br.commits.append(revnum);
-    br.marks.append(mark);
+    branches.setCreated(br, revnum);
+    branches.append(br, revnum, mark);
 
     QByteArray cmd = "reset " + branchRef + "\nfrom " + resetTo + "\n\n"
                      "progress SVN r" + QByteArray::number(revnum)
@@ -844,26 +2105,29 @@ Repository::Transaction *FastImportRepository::newTransaction(const QString &bra
 
     Transaction *txn = new Transaction;
     txn->repository = this;
-    txn->branch = branch.toUtf8();
+    txn->branchAtom = AtomTable::instance()->intern(branch);
+    // shares the atom's bytes, they are never freed
+    txn->branch = QByteArray::fromRawData(txn->branchAtom, AtomTable::size(txn->branchAtom));
     txn->svnprefix = svnprefix.toUtf8();
     txn->datetime = 0;
     txn->revnum = revnum;
 
     static auto n = CommandLineParser::instance()->optionArgument(QLatin1String("commit-interval"), QLatin1String("25000")).toInt();
-    if (++commitCount % n == 0) {
-        startFastImport();
-        // write everything to disk every 10000 commits
-        fastImport.write("checkpoint\n");
-        qDebug() << "checkpoint!, marks file truncated";
-    }
+    if (++commitCount % n == 0)
+        checkpointPending = true;
     outstandingTransactions++;
     return txn;
 }
 
 void FastImportRepository::forgetTransaction(Transaction * /*unused*/)
 {
-    if (!--outstandingTransactions)
+    if (!--outstandingTransactions) {
         next_file_mark = maxMark - 1;
+        if (snapshotPending)
+            writePendingSnapshot();
+        if (checkpointPending)
+            checkpoint();
+    }
 }
 
 void FastImportRepository::createAnnotatedTag(const QString &ref, const QString &svnprefix,
@@ -962,12 +2226,7 @@ void FastImportRepository::finalizeTags()
     // commitNote didn't actually commit anything, fool! But now we have all
     // the potential refs/notes/commits gathered, can sort them and dump them
     // out.
-    std::stable_sort(
-        delayed_notes.begin(), delayed_notes.end(),
-        [](const auto &a, const auto &b) { return a.first < b.first; });
-    for (const auto &n : delayed_notes) {
-        fastImport.write(*n.second);
-    }
+    delayedNotes.writeSorted(fastImport, maxMark, CommandLineParser::instance()->contains("squash-notes"));
 
     while (fastImport.bytesToWrite())
         if (!fastImport.waitForBytesWritten(-1))
@@ -1018,7 +2277,7 @@ void FastImportRepository::startFastImport()
 {
     processCache.touch(this);
 
-    if (fastImport.state() == QProcess::NotRunning) {
+    if (fastImport.importerState() == QProcess::NotRunning) {
         if (processHasStarted)
             qFatal("git-fast-import has been started once and crashed?");
         processHasStarted = true;
@@ -1033,12 +2292,15 @@ void FastImportRepository::startFastImport()
         fastImport.setStandardOutputFile(logFileName(name), QIODevice::Append);
         fastImport.setProcessChannelMode(QProcess::MergedChannels);
 
-        if (!CommandLineParser::instance()->contains("dry-run") && !CommandLineParser::instance()->contains("create-dump")) {
-            fastImport.start("git", QStringList() << "fast-import" << marksOptions);
+        static qint64 bufferSize = CommandLineParser::instance()->optionArgument(QLatin1String("write-buffer"), QLatin1String("4")).toLongLong() * 1024 * 1024;
+        if (CommandLineParser::instance()->contains("native-pack") && !CommandLineParser::instance()->contains("dry-run")
+            && !CommandLineParser::instance()->contains("create-dump")) {
+            fastImport.startImporter(name, name + "/" + marksFile, logFileName(name));
+        } else if (!CommandLineParser::instance()->contains("dry-run") && !CommandLineParser::instance()->contains("create-dump")) {
+            fastImport.startWithWriter("git", QStringList() << "fast-import" << marksOptions, bufferSize);
         } else {
-            fastImport.start("cat", QStringList());
+            fastImport.startWithWriter("cat", QStringList(), bufferSize);
         }
-        fastImport.waitForStarted(-1);
 
         reloadBranches();
     }
@@ -1058,6 +2320,18 @@ bool FastImportRepository::branchExists(const QString& branch) const
     return branches.contains(branch);
 }
 
+// Whether branch has an exported commit at or before revnum to branch from
+int FastImportRepository::branchCommitRevnum(const QString& branch, int revnum)
+{
+    int br = branches.find(branch);
+    if (br == -1 || !branches.created(br))
+        return -1;
+    int row = branches.rowAt(br, revnum);
+    if (row == -1 || !branches.mark(row))
+        return -1;
+    return branches.revnum(row);
+}
+
 const QByteArray FastImportRepository::branchNote(const QString& branch) const
 {
     return branchNotes.value(branch);
@@ -1087,7 +2361,9 @@ Repository *FastImportRepository::getEffectiveRepository()
 
 FastImportRepository::Transaction::~Transaction()
 {
-    repository->forgetTransaction(this);
+    // --benchmark makes some without a repository
+    if (repository)
+        repository->forgetTransaction(this);
 }
 
 void FastImportRepository::Transaction::setAuthor(const QByteArray &a)
@@ -1168,12 +2444,12 @@ void FastImportRepository::Transaction::noteCopyFromBranch(const QString &branch
         // are.) Anyway, we blast away the branch reset whenever we find a
         // higher numbered mark (on the same branch).
         // This revision creates the branch, make sure the mark is the highest possible.
-        if (repository->branches.contains(branch)
-                && revnum == repository->branches[branch].created
+        int br = repository->branches.findAtom(branchAtom);
+        if (br != -1
+                && revnum == repository->branches.created(br)
                 && repository->resetBranchNames.contains(branchRef)) {
             const QString rb = repository->resetBranches;
-            const Branch &br = repository->branches[branch];
-            if (br.marks.last() < mark && rb.contains("from branch "+branchFrom)) {
+            if (repository->branches.lastMark(br) < mark && rb.contains("from branch "+branchFrom)) {
                 if (!allow_heuristic) {
                     qDebug() << "WARN: found branchpoint from lower mark, ignoring due to manual rule override";
                     return;
@@ -1204,7 +2480,8 @@ void FastImportRepository::Transaction::noteCopyFromBranch(const QString &branch
 
 void FastImportRepository::Transaction::deleteFile(const QString &path)
 {
-    QString pathNoSlash = repository->prefix + path;
+    QByteArray pathNoSlash = repository->prefixUtf8;
+    appendUtf8(pathNoSlash, path);
     if(pathNoSlash.endsWith('/'))
         pathNoSlash.chop(1);
     deletedFiles.append(pathNoSlash);
@@ -1216,14 +2493,16 @@ void FastImportRepository::Transaction::renameFile(const QString &from, const QS
     // deletion, but we later want to rename it to something else to patch up
     // CVS repo copies and the like. So undelete the files before renaming
     // them.
-    QString fromNoSlash = repository->prefix + from;
-    QString toNoSlash = repository->prefix + to;
+    QByteArray fromNoSlash = repository->prefixUtf8;
+    QByteArray toNoSlash = repository->prefixUtf8;
+    appendUtf8(fromNoSlash, from);
+    appendUtf8(toNoSlash, to);
     if (fromNoSlash.endsWith('/'))
       fromNoSlash.chop(1);
     if (toNoSlash.endsWith('/'))
       toNoSlash.chop(1);
     deletedFiles.removeOne(fromNoSlash);
-    renamedFiles.append(QPair<QString, QString>(fromNoSlash, toNoSlash));
+    renamedFiles.append(QPair<QByteArray, QByteArray>(fromNoSlash, toNoSlash));
 }
 
 QIODevice *FastImportRepository::Transaction::addFile(const QString &path, int mode, qint64 length)
@@ -1240,8 +2519,10 @@ QIODevice *FastImportRepository::Transaction::addFile(const QString &path, int m
     modifiedFiles.append(" :");
     modifiedFiles.append(QByteArray::number(mark));
     modifiedFiles.append(' ');
-    modifiedFiles.append(repository->prefix + path.toUtf8());
+    modifiedFiles.append(repository->prefixUtf8);
+    appendUtf8(modifiedFiles, path);
     modifiedFiles.append("\n");
+    Metrics::instance()->blobWritten(repository->name, branch, length, false);
 
     // it is returned for being written to, so start the process in any case
     repository->startFastImport();
@@ -1256,6 +2537,40 @@ QIODevice *FastImportRepository::Transaction::addFile(const QString &path, int m
     return &repository->fastImport;
 }
 
+bool FastImportRepository::Transaction::addKnownFile(const QString &path, int mode, const QByteArray &checksum)
+{
+    QHash<QByteArray, BlobIndexEntry>::const_iterator it =
+        repository->blobIndex.constFind(blobIndexKey(mode, checksum));
+    if (it == repository->blobIndex.constEnd())
+        return false;
+
+    if (modifiedFiles.capacity() == 0)
+        modifiedFiles.reserve(2048);
+    modifiedFiles.append("M ");
+    modifiedFiles.append(QByteArray::number(mode, 8));
+    modifiedFiles.append(' ');
+    modifiedFiles.append(it.value().sha1);
+    modifiedFiles.append(' ');
+    modifiedFiles.append(repository->prefixUtf8);
+    appendUtf8(modifiedFiles, path);
+    modifiedFiles.append("\n");
+    Metrics::instance()->blobWritten(repository->name, branch, 0, true);
+    return true;
+}
+
+void FastImportRepository::Transaction::noteFileBlob(int mode, const QByteArray &checksum, const QByteArray &blobSha1)
+{
+    QByteArray key = blobIndexKey(mode, checksum);
+    if (repository->blobIndex.contains(key))
+        return;
+
+    BlobIndexEntry entry;
+    entry.sha1 = blobSha1;
+    entry.revnum = revnum;
+    repository->blobIndex.insert(key, entry);
+    repository->pendingBlobIndex.append(key + ' ' + blobSha1 + ' ' + QByteArray::number(revnum) + '\n');
+}
+
 bool FastImportRepository::Transaction::commitNote(const QByteArray &noteText, bool append, const QByteArray &commit)
 {
     QByteArray branchRef = branch;
@@ -1263,8 +2578,7 @@ bool FastImportRepository::Transaction::commitNote(const QByteArray &noteText, b
     {
         branchRef.prepend("refs/heads/");
     }
-    const QByteArray &commitRef = commit.isNull() ? branchRef : commit;
-    QByteArray message = "Adding Git note for current " + branchRef + "\n";
+    bool appending = false;
     QByteArray text = noteText;
     if (noteText[noteText.size() - 1] != '\n')
     {
@@ -1286,100 +2600,48 @@ bool FastImportRepository::Transaction::commitNote(const QByteArray &noteText, b
             //message = "Replacing Git note for current " + branchRef + "\n";
         } else {
             text = branchNote + text;
-            message = "Appending Git note for current " + branchRef + "\n";
+            appending = true;
         }
     }
 
     repository->setBranchNote(QString::fromUtf8(branch), text);
 
-    auto s = std::make_unique<QByteArray>("");
-    s->append("commit refs/notes/commits\n");
-    s->append("mark :" + QByteArray::number(maxMark) + "\n");
-    s->append("committer svn2git <svn2git@FreeBSD.org> " + QString::number(datetime) + " +0000" + "\n");
-    s->append("data " + QString::number(message.length()) + "\n");
-    s->append(message + "\n");
-    s->append("N inline " + commitRef + "\n");
-    s->append("data " + QString::number(text.length()) + "\n");
-    s->append(text + "\n");
-    repository->delayed_notes.emplace_back(datetime, std::move(s));
+    repository->delayedNotes.add(datetime, AtomTable::instance()->intern(branchRef), appending,
+                                 commit, text);
 
     // We delay this till the end so we can sort the notes into the regular
     // refs/notes/commits stream.
     return false;
 }
 
-int FastImportRepository::Transaction::commit()
+void FastImportRepository::Transaction::serialize(QByteArray &out, Atom branchRef, mark_t mark, mark_t parentmark,
+                                                  const QByteArray &message, QByteArray &mergeDesc) const
 {
-    foreach (QString branchName, repository->branches.keys())
-    {
-        if (branchName.toUtf8().startsWith(branch + "/") || branch.startsWith((branchName + "/").toUtf8()))
-        {
-            qCritical() << "Branch" << branch << "conflicts with already existing branch" << branchName;
-            return EXIT_FAILURE;
-        }
-    }
-
-    repository->startFastImport();
-
-    // We might be tempted to use the SVN revision number as the fast-import commit mark.
-    // However, a single SVN revision can modify multiple branches, and thus lead to multiple
-    // commits in the same repo.  So, we need to maintain a separate commit mark counter.
-    mark_t  mark = ++repository->last_commit_mark;
-
-    // in case the two mark allocations meet, we might as well just abort
-    Q_ASSERT(mark < repository->next_file_mark - 1);
-
-    // create the commit message
-    QByteArray message = log;
-    if (!message.endsWith('\n'))
-        message += '\n';
-    if (CommandLineParser::instance()->contains("add-metadata"))
-        message += "\n" + Repository::formatMetadataMessage(svnprefix, revnum);
-
-    // Call external message filter if provided
-    message = repository->msgFilter(message);
-
-    mark_t parentmark = 0;
-    Branch &br = repository->branches[branch];
-    if (br.created && !br.marks.isEmpty() && br.marks.last()) {
-        parentmark = br.marks.last();
-    } else {
-        if (revnum > 1) {
-            // Any branch at revision 1 isn't going to exist, so lets not alarm the user.
-            qWarning() << "WARN: Branch" << branch << "in repository" << repository->name << "doesn't exist at revision"
-                       << revnum << "-- did you resume from the wrong revision?";
-        }
-        br.created = revnum;
-    }
-    br.commits.append(revnum);
-    br.marks.append(mark);
-
-    QByteArray branchRef = branch;
-    if (!branchRef.startsWith("refs/"))
-        branchRef.prepend("refs/heads/");
-
-    QByteArray s("");
-    s.append("commit " + branchRef + "\n");
-    s.append("mark :" + QByteArray::number(mark) + "\n");
-    s.append("committer " + author + " " + QString::number(datetime).toUtf8() + " +0000" + "\n");
-    s.append("data " + QString::number(message.length()) + "\n");
-    s.append(message + "\n");
-    repository->fastImport.write(s);
+    out.reserve(out.size() + message.size() + modifiedFiles.size() + resetFromTree.size() + 256);
+    out.append("commit ");
+    out.append(branchRef, AtomTable::size(branchRef));
+    out.append("\nmark :");
+    out.append(QByteArray::number(mark));
+    out.append("\ncommitter ");
+    out.append(author);
+    out.append(' ');
+    out.append(QByteArray::number(datetime));
+    out.append(" +0000\ndata ");
+    out.append(QByteArray::number(message.length()));
+    out.append('\n');
+    out.append(message);
+    out.append('\n');
 
     // note some of the inferred merges
-    QByteArray desc = "";
-    mark_t i = !!parentmark;        // if parentmark != 0, there's at least one parent
-
     foreach (const mark_t merge, merges) {
         if (merge == parentmark) {
             qDebug() << "Skipping marking" << merge << "as a merge point as it matches the parent";
             continue;
         }
-        ++i;
 
         QByteArray m = " :" + QByteArray::number(merge);
-        desc += m;
-        repository->fastImport.write("merge" + m + "\n");
+        mergeDesc += m;
+        out.append("merge" + m + "\n");
     }
     // If we suppress the branchpoint, we still need to start out with the
     // previous tree, all we want is to suppress the creation of a parent.
@@ -1389,44 +2651,184 @@ int FastImportRepository::Transaction::commit()
     // isn't clever enough to treat a commit mark as just taking the tree of
     // that commit. We use the tree-hash instead, which should be fairly
     // stable.
-    if (resetFromTree.size() > 0) {
-        repository->fastImport.write(resetFromTree);
-    }
+    out.append(resetFromTree);
 
     // write the file deletions
     if (deletedFiles.contains(""))
-        repository->fastImport.write("deleteall\n");
+        out.append("deleteall\n");
     else
-        foreach (QString df, deletedFiles)
-            repository->fastImport.write("D " + df.toUtf8() + "\n");
+        foreach (const QByteArray &df, deletedFiles)
+            out.append("D " + df + "\n");
 
     // write the file modifications
-    repository->fastImport.write(modifiedFiles);
+    out.append(modifiedFiles);
 
     // run through the rename pairs, potentially deleting paths
-    QPair<QString, QString> pair;
+    QPair<QByteArray, QByteArray> pair;
     foreach (pair, renamedFiles) {
-        const QString& from = pair.first;
-        const QString& to = pair.second;
+        const QByteArray& from = pair.first;
+        const QByteArray& to = pair.second;
         // We want our delete fixups to happen *after* the modifications were
         // written, so that we can undo CVS repo copies. We cannot abuse the
         // regular delete mechanics above though, as that would interfere
         // horribly with the regular SVN export. So basically handle renames to
         // "/dev/null" as such post-export deletes.
         if (to == "" || to == "/dev/null") {
-            repository->fastImport.write("D " + from.toUtf8() + "\n");
+            out.append("D " + from + "\n");
         } else {
-            repository->fastImport.write("R " + from.toUtf8() + " " + to.toUtf8() + "\n");
+            out.append("R " + from + " " + to + "\n");
         }
     }
 
-    repository->fastImport.write("\nprogress SVN r" + QByteArray::number(revnum)
-                                 + " branch " + branch + " = :" + QByteArray::number(mark)
-                                 + (desc.isEmpty() ? "" : " # merge from") + desc
-                                 + "\n\n");
+    out.append("\nprogress SVN r" + QByteArray::number(revnum)
+               + " branch " + branch + " = :" + QByteArray::number(mark)
+               + (mergeDesc.isEmpty() ? "" : " # merge from") + mergeDesc
+               + "\n\n");
+}
+
+/*
+ * Reads the commits back from a fast-import log, such as the gitlog-* files
+ * written with --debug-rules, and times msgFilter() and serialize() on their
+ * messages and file changes.  Notes commits are skipped.
+ */
+void FastImportRepository::benchmarkLog(const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCritical() << "Could not open" << fileName << ":" << file.errorString();
+        return;
+    }
+    const QByteArray stream = file.readAll();
+
+    QList<Transaction *> commits;
+    QVector<Atom> refs;
+    QVector<mark_t> marks;
+    Transaction *txn = 0;
+    int pos = 0;
+    while (pos < stream.size()) {
+        int eol = stream.indexOf('\n', pos);
+        if (eol == -1)
+            eol = stream.size();
+        const QByteArray line = stream.mid(pos, eol - pos);
+        pos = eol + 1;
+
+        if (line.startsWith("data ")) {
+            const int length = line.mid(5).toInt();
+            if (txn && txn->log.isNull())
+                txn->log = stream.mid(pos, length);
+            pos += length;
+            if (pos < stream.size() && stream.at(pos) == '\n')
+                ++pos;
+        } else if (line.startsWith("commit ")) {
+            txn = 0;
+            if (line == "commit refs/notes/commits")
+                continue;
+            txn = new Transaction;
+            txn->repository = 0;
+            txn->datetime = 0;
+            txn->revnum = 0;
+            commits.append(txn);
+            refs.append(AtomTable::instance()->intern(line.mid(7)));
+            marks.append(0);
+        } else if (!txn) {
+            continue;
+        } else if (line.startsWith("mark :")) {
+            marks.last() = line.mid(6).toULongLong();
+        } else if (line.startsWith("committer ")) {
+            // NAME <EMAIL> TIME +0000
+            const int zone = line.lastIndexOf(' ');
+            const int time = line.lastIndexOf(' ', zone - 1);
+            txn->author = line.mid(10, time - 10);
+            txn->datetime = line.mid(time + 1, zone - time - 1).toUInt();
+        } else if (line.startsWith("merge :")) {
+            txn->merges.append(line.mid(7).toInt());
+        } else if (line.startsWith("M ")) {
+            txn->modifiedFiles.append(line + '\n');
+        } else if (line.startsWith("D ")) {
+            txn->deletedFiles.append(line.mid(2));
+        } else if (line == "deleteall") {
+            txn->deletedFiles.append(QByteArray());
+        } else if (line.startsWith("R ")) {
+            const int space = line.indexOf(' ', 2);
+            txn->renamedFiles.append(qMakePair(line.mid(2, space - 2), line.mid(space + 1)));
+        } else if (line.startsWith("progress SVN r")) {
+            // progress SVN rREV branch BRANCH = :MARK
+            const int branch = line.indexOf(" branch ");
+            const int equals = line.lastIndexOf(" = :");
+            txn->revnum = line.mid(14, branch - 14).toInt();
+            txn->branch = line.mid(branch + 8, equals - branch - 8);
+            txn = 0;
+        }
+    }
+    printf("%d commits in %s\n", commits.size(), qPrintable(fileName));
+
+    benchmark("FastImportRepository::msgFilter", commits.size(), [&]() {
+        foreach (Transaction *txn, commits)
+            msgFilter(txn->log);
+    });
+    benchmark("Transaction::serialize", commits.size(), [&]() {
+        for (int i = 0; i < commits.size(); ++i) {
+            QByteArray out;
+            QByteArray desc;
+            commits.at(i)->serialize(out, refs.at(i), marks.at(i), 0, commits.at(i)->log, desc);
+        }
+    });
+    qDeleteAll(commits);
+}
+
+int FastImportRepository::Transaction::commit()
+{
+    int br = repository->branches.idOf(branchAtom);
+    if (!repository->validRef(br))
+        return EXIT_FAILURE;
+    int other = repository->branches.conflict(br);
+    if (other != -1)
+    {
+        qCritical() << "Branch" << branch << "conflicts with already existing branch" << repository->branches.name(other);
+        return EXIT_FAILURE;
+    }
+
+    repository->startFastImport();
+
+    // We might be tempted to use the SVN revision number as the fast-import commit mark.
+    // However, a single SVN revision can modify multiple branches, and thus lead to multiple
+    // commits in the same repo.  So, we need to maintain a separate commit mark counter.
+    mark_t  mark = ++repository->last_commit_mark;
+
+    // in case the two mark allocations meet, we might as well just abort
+    Q_ASSERT(mark < repository->next_file_mark - 1);
+
+    // create the commit message
+    QByteArray message = log;
+    if (!message.endsWith('\n'))
+        message += '\n';
+    if (CommandLineParser::instance()->contains("add-metadata"))
+        message += "\n" + Repository::formatMetadataMessage(svnprefix, revnum);
+
+    // Call external message filter if provided
+    message = repository->msgFilter(message);
+
+    mark_t parentmark = 0;
+    if (repository->branches.created(br) && !repository->branches.isEmpty(br) && repository->branches.lastMark(br)) {
+        parentmark = repository->branches.lastMark(br);
+    } else {
+        if (revnum > 1) {
+            // Any branch at revision 1 isn't going to exist, so lets not alarm the user.
+            qWarning() << "WARN: Branch" << branch << "in repository" << repository->name << "doesn't exist at revision"
+                       << revnum << "-- did you resume from the wrong revision?";
+        }
+        repository->branches.setCreated(br, revnum);
+    }
+    repository->branches.append(br, revnum, mark);
+
+    QByteArray s;
+    QByteArray desc;
+    serialize(s, repository->branches.ref(br), mark, parentmark, message, desc);
+    repository->fastImport.write(s);
+    Metrics::instance()->commitWritten(repository->name, branch);
     printf(" %d modifications from SVN %s to %s/%s",
            deletedFiles.count() + modifiedFiles.count('\n'), svnprefix.data(),
-           qPrintable(repository->name), branch.data());
+           qPrintable(repository->name), branch.constData());
 
     // Commit metadata note if requested
     // All our refs/tags are annotated and will be exported last. This is to
@@ -1436,9 +2838,5 @@ int FastImportRepository::Transaction::commit()
         commitNote(Repository::formatMetadataMessage(svnprefix, revnum), false, ":"+QByteArray::number(mark));
     }
 
-    while (repository->fastImport.bytesToWrite())
-        if (!repository->fastImport.waitForBytesWritten(-1))
-            qFatal("Failed to write to process: %s for repository %s", qPrintable(repository->fastImport.errorString()), qPrintable(repository->name));
-
     return EXIT_SUCCESS;
 }
@@ -26,12 +26,20 @@
 #include "ruleparser.h"
 #include "CommandLineParser.h"
 
+class FastImportWriter;
+class PackImporter;
+
 class LoggingQProcess : public QProcess
 {
     QFile log;
     bool logging;
+    QString name;
+    FastImportWriter *writer;
+    PackImporter *importer;
+    qint64 importerReported;    // bytes of the importer passed on to the metrics
+    int inputFd;
 public:
-    LoggingQProcess(const QString filename) : QProcess(), log() {
+    LoggingQProcess(const QString filename) : QProcess(), log(), name(filename), writer(0), importer(0), importerReported(0), inputFd(-1) {
         if(CommandLineParser::instance()->contains("debug-rules")) {
             logging = true;
             QString name = filename;
@@ -43,52 +51,65 @@ public:
             logging = false;
         }
     };
-    ~LoggingQProcess() {
-        if(logging) {
-            log.close();
-        }
-    };
+    ~LoggingQProcess();
+
+    // Like start(), but the child reads its stdin from a pipe that a
+    // writer thread feeds from a ring buffer of bufferSize bytes.
+    void startWithWriter(const QString &program, const QStringList &arguments, qint64 bufferSize);
+    // Like start(), but the stream goes to a PackImporter in this process
+    // instead of git fast-import. It counts as running until waitForFinished().
+    void startImporter(const QString &gitDir, const QString &marksFile, const QString &logFile);
+    // state() of the process, or Running while a PackImporter takes the stream
+    QProcess::ProcessState importerState() const { return importer ? QProcess::Running : state(); }
+    void closeWriteChannel();
+    qint64 bytesToWrite() const;
+    bool waitForBytesWritten(int msecs = 30000);
+    bool waitForFinished(int msecs = 30000);
 
     qint64 write(const char *data) {
-        Q_ASSERT(state() == QProcess::Running);
+        Q_ASSERT(importerState() == QProcess::Running);
         if(logging) {
             log.write(data);
         }
         return QProcess::write(data);
     }
     qint64 write(const char *data, qint64 length) {
-        Q_ASSERT(state() == QProcess::Running);
+        Q_ASSERT(importerState() == QProcess::Running);
         if(logging) {
             log.write(data);
         }
         return QProcess::write(data, length);
     }
     qint64 write(const QByteArray &data) {
-        Q_ASSERT(state() == QProcess::Running);
+        Q_ASSERT(importerState() == QProcess::Running);
         if(logging) {
             log.write(data);
         }
         return QProcess::write(data);
     }
     qint64 writeNoLog(const char *data) {
-        Q_ASSERT(state() == QProcess::Running);
+        Q_ASSERT(importerState() == QProcess::Running);
         return QProcess::write(data);
     }
     qint64 writeNoLog(const char *data, qint64 length) {
-        Q_ASSERT(state() == QProcess::Running);
+        Q_ASSERT(importerState() == QProcess::Running);
         return QProcess::write(data, length);
     }
     qint64 writeNoLog(const QByteArray &data) {
-        Q_ASSERT(state() == QProcess::Running);
+        Q_ASSERT(importerState() == QProcess::Running);
         return QProcess::write(data);
     }
     bool putChar( char c) {
-        Q_ASSERT(state() == QProcess::Running);
+        Q_ASSERT(importerState() == QProcess::Running);
         if(logging) {
             log.putChar(c);
         }
         return QProcess::putChar(c);
     }
+
+protected:
+    qint64 writeData(const char *data, qint64 len);
+    void setupChildProcess();
 };
 
 class Repository
@@ -112,6 +133,10 @@ public:
         virtual void deleteFile(const QString &path) = 0;
         virtual void renameFile(const QString &from, const QString &to) = 0;
         virtual QIODevice *addFile(const QString &path, int mode, qint64 length) = 0;
+        // Reuse a blob imported earlier with the same svn SHA-1 and mode.
+        // Returns false if there is none and the data has to be sent.
+        virtual bool addKnownFile(const QString &path, int mode, const QByteArray &checksum) = 0;
+        virtual void noteFileBlob(int mode, const QByteArray &checksum, const QByteArray &blobSha1) = 0;
 
         virtual bool commitNote(const QByteArray &noteText, bool append,
                                 const QByteArray &commit = QByteArray()) = 0;
@@ -121,6 +146,7 @@ public:
     virtual void restoreAnnotatedTags() = 0;
     virtual void restoreBranchNotes() = 0;
     virtual void restoreLog() = 0;
+    virtual void restoreBlobIndex(int cutoff) = 0;
     virtual ~Repository() {}
 
     virtual void reloadBranches() = 0;
@@ -145,6 +171,8 @@ public:
                                             const QByteArray &tag = QByteArray());
 
     virtual bool branchExists(const QString& branch) const = 0;
+    // the revision of branch's last exported commit at or before revnum, or -1
+    virtual int branchCommitRevnum(const QString& branch, int revnum) = 0;
     virtual const QByteArray branchNote(const QString& branch) const = 0;
     virtual void setBranchNote(const QString& branch, const QByteArray& noteText) = 0;
 
@@ -155,5 +183,7 @@ public:
 };
 
 Repository *createRepository(const Rules::Repository &rule, const QHash<QString, Repository *> &repositories);
+// times message filtering and commit serialization on a fast-import log
+void benchmarkFastImportLog(const QString &fileName);
 
 #endif
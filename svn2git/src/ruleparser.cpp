@@ -19,16 +19,25 @@
 #include <QList>
 #include <QFile>
 #include <QDebug>
+#include <QScopedPointer>
+
+#include <algorithm>
+#include <limits.h>
+#include <stdio.h>
 
 #include "ruleparser.h"
 #include "CommandLineParser.h"
+#include "metrics.h"
 
 RulesList::RulesList(const QString &filenames)
   : m_filenames(filenames)
 {
 }
 
-RulesList::~RulesList() {}
+RulesList::~RulesList()
+{
+    qDeleteAll(m_rules);
+}
 
 void RulesList::load()
 {
@@ -58,6 +67,634 @@ const QList<Rules*> RulesList::rules() const
   return m_rules;
 }
 
+MatchRuleIndex::MatchRuleIndex()
+{
+    build(QList<Rules::Match>());
+}
+
+MatchRuleIndex::MatchRuleIndex(const QList<Rules::Match> &rules)
+{
+    build(rules);
+}
+
+// Returns the position of the ')' closing the group opened at open, or -1.
+static int closingParen(const QString &pattern, int open)
+{
+    int depth = 0;
+    bool inClass = false;
+    for (int i = open; i < pattern.size(); ++i) {
+        const QChar c = pattern.at(i);
+        if (c == '\\') {
+            ++i;
+        } else if (inClass) {
+            if (c == ']')
+                inClass = false;
+        } else if (c == '[') {
+            inClass = true;
+        } else if (c == '(') {
+            ++depth;
+        } else if (c == ')' && --depth == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Splits pattern at its top-level '|'s.
+static QStringList alternatives(const QString &pattern)
+{
+    QStringList result;
+    int depth = 0;
+    int start = 0;
+    bool inClass = false;
+    for (int i = 0; i < pattern.size(); ++i) {
+        const QChar c = pattern.at(i);
+        if (c == '\\') {
+            ++i;
+        } else if (inClass) {
+            if (c == ']')
+                inClass = false;
+        } else if (c == '[') {
+            inClass = true;
+        } else if (c == '(') {
+            ++depth;
+        } else if (c == ')') {
+            --depth;
+        } else if (c == '|' && depth == 0) {
+            result << pattern.mid(start, i - start);
+            start = i + 1;
+        }
+    }
+    result << pattern.mid(start);
+    return result;
+}
+
+/*
+ * Whether the first match PCRE finds may be shorter than the longest one,
+ * which QRegExp returns: that takes an alternation, a quantified group or
+ * a lazy quantifier.  Greedy quantifiers on a single character or class
+ * only give way to let the rest of the pattern match, so they are fine.
+ */
+static bool isAmbiguous(const QString &pattern)
+{
+    bool inClass = false;
+    for (int i = 0; i < pattern.size(); ++i) {
+        const QChar c = pattern.at(i);
+        if (c == '\\') {
+            ++i;
+        } else if (inClass) {
+            if (c == ']')
+                inClass = false;
+        } else if (c == '[') {
+            inClass = true;
+        } else if (c == '|') {
+            return true;
+        } else if (i > 0 && QStringLiteral("*+?{").contains(c)) {
+            const QChar previous = pattern.at(i - 1);
+            if (previous == ')')
+                return true;
+            if (c == '?' && QStringLiteral("*+?}").contains(previous)
+                && (i < 2 || pattern.at(i - 2) != '\\'))
+                return true;
+        }
+    }
+    return false;
+}
+
+static QStringList literalPrefixes(const QString &pattern, bool *complete)
+{
+    static const QString meta = QStringLiteral("\\^$.[](){}*+?|");
+    static const QString quantifiers = QStringLiteral("*+?{");
+    // Past this many alternatives the index would only get bigger, not faster.
+    static const int maxPrefixes = 64;
+
+    const QStringList alts = alternatives(pattern);
+    if (alts.size() > 1) {
+        QStringList prefixes;
+        *complete = true;
+        foreach (const QString &alt, alts) {
+            bool altComplete;
+            prefixes += literalPrefixes(alt, &altComplete);
+            *complete = *complete && altComplete;
+        }
+        if (prefixes.size() > maxPrefixes) {
+            *complete = false;
+            return QStringList(QString());
+        }
+        prefixes.removeDuplicates();
+        return prefixes;
+    }
+
+    *complete = false;
+    QStringList prefixes(QString());
+    int i = 0;
+    if (pattern.startsWith('^'))
+        ++i;
+    while (i < pattern.size()) {
+        const QChar c = pattern.at(i);
+        int next = i + 1;
+        QStringList literals;
+        bool literalsComplete = true;
+        if (c == '(') {
+            const int close = closingParen(pattern, i);
+            if (close == -1 || pattern.at(next) == '?')
+                break;
+            literals = literalPrefixes(pattern.mid(next, close - next), &literalsComplete);
+            next = close + 1;
+        } else if (c == '\\') {
+            if (next >= pattern.size() || pattern.at(next).isLetterOrNumber())
+                break;
+            literals << pattern.at(next++);
+        } else if (meta.contains(c)) {
+            break;
+        } else {
+            literals << c;
+        }
+        if (next < pattern.size() && quantifiers.contains(pattern.at(next)))
+            break;
+        if (prefixes.size() * literals.size() > maxPrefixes)
+            break;
+
+        QStringList extended;
+        foreach (const QString &prefix, prefixes)
+            foreach (const QString &literal, literals)
+                extended << prefix + literal;
+        prefixes = extended;
+        if (!literalsComplete)
+            return prefixes;
+        i = next;
+    }
+    *complete = i == pattern.size();
+    return prefixes;
+}
+
+/*
+ * Returns texts one of which every match of pattern has to start with.
+ * This is deliberately conservative: we stop at the first metacharacter
+ * and give up the last literal if it is followed by a quantifier.  Groups
+ * such as the "(head)" in "/(head)/" are looked through, and alternations
+ * like "/(head|cvs2svn)/" yield one prefix per alternative.
+ */
+QStringList MatchRuleIndex::literalPrefixes(const QString &pattern)
+{
+    bool complete;
+    return ::literalPrefixes(pattern, &complete);
+}
+
+void MatchRuleIndex::build(const QList<Rules::Match> &rules)
+{
+    QVector<QVector<int> > own;
+    m_nodes.append(Node());
+    own.append(QVector<int>());
+
+    for (int i = 0; i < rules.size(); ++i) {
+        foreach (const QString &prefix, literalPrefixes(rules.at(i).rx.pattern())) {
+            int n = 0;
+            foreach (const QChar c, prefix) {
+                int child = m_nodes.at(n).children.value(c, -1);
+                if (child == -1) {
+                    child = m_nodes.size();
+                    m_nodes[n].children.insert(c, child);
+                    m_nodes.append(Node());
+                    own.append(QVector<int>());
+                }
+                n = child;
+            }
+            own[n].append(i);
+        }
+    }
+
+    // Every node carrying rules gets a bucket holding its own rules merged
+    // with those of all its ancestors, and a rule with several prefixes,
+    // one extending the other, still shows up in it only once.  The root
+    // always has a bucket, possibly empty, so a lookup can simply return
+    // the deepest bucket it passes.
+    QVector<QVector<int> > buckets;
+    buckets.append(own.at(0));
+    m_nodes[0].bucket = 0;
+
+    QVector<QPair<int, int> > stack;
+    stack.append(qMakePair(0, 0));
+    while (!stack.isEmpty()) {
+        const QPair<int, int> top = stack.takeLast();
+        foreach (int child, m_nodes.at(top.first).children) {
+            int bucket = top.second;
+            if (!own.at(child).isEmpty()) {
+                const QVector<int> &inherited = buckets.at(top.second);
+                QVector<int> merged(inherited.size() + own.at(child).size());
+                QVector<int>::iterator end =
+                    std::set_union(inherited.constBegin(), inherited.constEnd(),
+                                   own.at(child).constBegin(), own.at(child).constEnd(),
+                                   merged.begin());
+                merged.resize(end - merged.begin());
+                bucket = buckets.size();
+                buckets.append(merged);
+                m_nodes[child].bucket = bucket;
+            }
+            stack.append(qMakePair(child, bucket));
+        }
+    }
+
+    // Children are always created after their parent, so walking backwards
+    // sees every subtree before the node it hangs off.
+    for (int n = m_nodes.size() - 1; n >= 0; --n) {
+        foreach (int child, m_nodes.at(n).children) {
+            int lowest = m_nodes.at(child).extendingRule;
+            if (!own.at(child).isEmpty())
+                lowest = qMin(lowest, own.at(child).first());
+            m_nodes[n].extendingRule = qMin(m_nodes.at(n).extendingRule, lowest);
+        }
+    }
+
+    m_bucketCount = buckets.size();
+    buildEpochs(rules, buckets);
+}
+
+void MatchRuleIndex::buildEpochs(const QList<Rules::Match> &rules,
+                                 const QVector<QVector<int> > &buckets)
+{
+    QVector<int> boundaries;
+    boundaries.append(INT_MIN);
+    foreach (const Rules::Match &rule, rules) {
+        if (rule.minRevision != -1)
+            boundaries.append(rule.minRevision);
+        if (rule.maxRevision != -1 && rule.maxRevision < INT_MAX)
+            boundaries.append(rule.maxRevision + 1);
+    }
+    std::sort(boundaries.begin(), boundaries.end());
+    boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+
+    for (int e = 0; e < boundaries.size(); ++e) {
+        Epoch epoch;
+        epoch.firstRevision = boundaries.at(e);
+        epoch.lastRevision = e + 1 < boundaries.size() ? boundaries.at(e + 1) - 1 : INT_MAX;
+
+        const int revnum = epoch.firstRevision;
+        for (int b = 0; b < buckets.size(); ++b) {
+            QVector<int> active;
+            foreach (int i, buckets.at(b)) {
+                const Rules::Match &rule = rules.at(i);
+                if (rule.minRevision > revnum)
+                    continue;
+                if (rule.maxRevision != -1 && rule.maxRevision < revnum)
+                    continue;
+                active.append(i);
+            }
+            if (!m_epochs.isEmpty() && m_epochs.last().buckets.at(b) == active)
+                epoch.buckets.append(m_epochs.last().buckets.at(b));
+            else
+                epoch.buckets.append(active);
+        }
+        m_epochs.append(epoch);
+    }
+}
+
+const MatchRuleIndex::Epoch &MatchRuleIndex::epoch(int revnum) const
+{
+    int lo = 0, hi = m_epochs.size() - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (m_epochs.at(mid).firstRevision <= revnum)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return m_epochs.at(lo);
+}
+
+/*
+ * If extendingRule is given, it receives the lowest rule whose prefix
+ * starts with all of path, as those are not among the candidates for path
+ * itself but may be for longer paths below it.
+ */
+const QVector<int> &MatchRuleIndex::candidates(const QString &path, const Epoch &epoch,
+                                               int *extendingRule) const
+{
+    int n = 0;
+    int bucket = 0;
+    int i;
+    for (i = 0; i < path.size(); ++i) {
+        const QHash<QChar, int> &children = m_nodes.at(n).children;
+        QHash<QChar, int>::const_iterator it = children.constFind(path.at(i));
+        if (it == children.constEnd())
+            break;
+        n = it.value();
+        if (m_nodes.at(n).bucket != -1)
+            bucket = m_nodes.at(n).bucket;
+    }
+    if (extendingRule)
+        *extendingRule = i == path.size() ? m_nodes.at(n).extendingRule : INT_MAX;
+    return epoch.buckets.at(bucket);
+}
+
+/*
+ * Matches rule at the start of subject.  The rules were written for
+ * QRegExp, which keeps the longest match, so for an ambiguous rule the
+ * longest prefix exactRx matches in full is taken over PCRE's first match.
+ */
+static RuleMatch matchRule(const Rules::Match &rule, int index, const QString &subject)
+{
+    const QRegularExpressionMatch m = rule.rx.match(subject, 0, QRegularExpression::NormalMatch,
+                                                    QRegularExpression::AnchoredMatchOption);
+    if (!m.hasMatch())
+        return RuleMatch();
+    int length = m.capturedLength();
+    if (rule.ambiguous) {
+        for (int end = subject.size(); end > length; --end) {
+            if (rule.exactRx.match(subject.left(end)).hasMatch()) {
+                length = end;
+                break;
+            }
+        }
+    }
+    return RuleMatch(rule, index, length);
+}
+
+RuleMatch findMatchRule(const MatchRuleList &matchRules, int revnum, const QString &current,
+                        int ruleMask)
+{
+    Metrics::Timer timer(Metrics::FindMatchRule);
+    // Rules outside their min/max revision are not in the epoch's buckets.
+    const QVector<int> &candidates =
+        matchRules.index.candidates(current, matchRules.epoch(revnum));
+    int visited = 0;
+    foreach (int i, candidates) {
+        const Rules::Match &rule = matchRules.at(i);
+        ++visited;
+        if (rule.action == Rules::Match::Ignore && ruleMask & NoIgnoreRule)
+            continue;
+        if (rule.action == Rules::Match::Recurse && ruleMask & NoRecurseRule)
+            continue;
+        const RuleMatch match = matchRule(rule, i, current);
+        if (match.isValid()) {
+            Stats::instance()->ruleMatched(rule, revnum);
+            Stats::instance()->ruleLookup(visited, i + 1);
+            return match;
+        }
+    }
+
+    // no match
+    Stats::instance()->ruleLookup(visited, matchRules.size());
+    return RuleMatch();
+}
+
+RuleMatchCache::~RuleMatchCache()
+{
+    Stats::instance()->ruleCacheUsage(m_hits, m_misses);
+}
+
+RuleMatch RuleMatchCache::find(const MatchRuleList &matchRules, int revnum,
+                               const QString &path, int ruleMask)
+{
+    int end = path.size() - 1;
+    if (path.endsWith('/'))
+        --end;
+    const QString dir = path.left(path.lastIndexOf('/', end) + 1);
+    if (dir.isEmpty())
+        return findMatchRule(matchRules, revnum, path, ruleMask);
+
+    const Decision &d = decision(matchRules, revnum, dir, ruleMask);
+    if (!d.decided) {
+        ++m_misses;
+        return findMatchRule(matchRules, revnum, path, ruleMask);
+    }
+    ++m_hits;
+    if (d.match.isValid())
+        Stats::instance()->ruleMatched(d.match.rule(), revnum);
+    return d.match;
+}
+
+bool RuleMatchCache::decides(const MatchRuleList &matchRules, int revnum, const QString &dir,
+                             RuleMatch *match, int ruleMask)
+{
+    const Decision &d = decision(matchRules, revnum, dir, ruleMask);
+    if (d.decided)
+        *match = d.match;
+    return d.decided;
+}
+
+const RuleMatchCache::Decision &RuleMatchCache::decision(const MatchRuleList &matchRules, int revnum,
+                                                         const QString &dir, int ruleMask)
+{
+    // The epoch identifies both the rule list and the rules active in it.
+    const Key key(qMakePair(static_cast<const void *>(&matchRules.epoch(revnum)), ruleMask), dir);
+    QHash<Key, Decision>::const_iterator it = m_decisions.constFind(key);
+    if (it == m_decisions.constEnd())
+        it = m_decisions.insert(key, decide(matchRules, revnum, dir, ruleMask));
+    return *it;
+}
+
+/*
+ * Matches the directory on its own, using hard partial matching so that we
+ * learn whether a rule would have needed to see more than dir to decide.
+ * As QRegExp keeps the longest match, every way a rule can match has to
+ * end within dir, not just the first one PCRE finds.
+ */
+RuleMatchCache::Decision RuleMatchCache::decide(const MatchRuleList &matchRules, int revnum,
+                                                const QString &dir, int ruleMask) const
+{
+    Decision decision;
+    decision.decided = false;
+
+    int extendingRule;
+    const QVector<int> &candidates =
+        matchRules.index.candidates(dir, matchRules.epoch(revnum), &extendingRule);
+    foreach (int i, candidates) {
+        if (i > extendingRule)
+            return decision;
+        const Rules::Match &rule = matchRules.at(i);
+        if (rule.action == Rules::Match::Ignore && ruleMask & NoIgnoreRule)
+            continue;
+        if (rule.action == Rules::Match::Recurse && ruleMask & NoRecurseRule)
+            continue;
+        if (rule.extentRx.match(dir, 0, QRegularExpression::PartialPreferFirstMatch,
+                                QRegularExpression::AnchoredMatchOption).hasPartialMatch())
+            return decision;
+        decision.match = matchRule(rule, i, dir);
+        if (decision.match.isValid()) {
+            decision.decided = true;
+            return decision;
+        }
+    }
+
+    // Nothing can match below dir, unless a longer prefix says otherwise.
+    decision.decided = extendingRule == INT_MAX;
+    return decision;
+}
+
+// Parses one line of a --debug-rules log, see checkMatchRules().
+static bool parseMatchPathLine(const QString &line, int *revnum, QString *path)
+{
+    static const QRegularExpression debugLine("^rev (\\d+) (.+) matched rule:");
+    static const QRegularExpression revLine("^(\\d+)\\s+(\\S.*)$");
+    if (line.isEmpty())
+        return false;
+
+    QRegularExpressionMatch m = debugLine.match(line);
+    if (!m.hasMatch())
+        m = revLine.match(line);
+    if (m.hasMatch()) {
+        *revnum = m.captured(1).toInt();
+        *path = m.captured(2);
+        return true;
+    }
+    if (!line.startsWith('/'))
+        return false;
+    *revnum = INT_MAX;
+    *path = line;
+    return true;
+}
+
+bool readMatchPaths(const QString &fileName, MatchPathList *paths)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCritical() << "Could not open" << fileName << ":" << file.errorString();
+        return false;
+    }
+
+    QTextStream in(&file);
+    int revnum;
+    QString path;
+    while (!in.atEnd()) {
+        if (parseMatchPathLine(in.readLine().trimmed(), &revnum, &path))
+            paths->append(qMakePair(revnum, path));
+    }
+    return true;
+}
+
+/*
+ * Times findMatchRule() against the rule lists on their own, and the way
+ * svn.cpp uses it, through a RuleMatchCache that lives for a revision.
+ */
+void benchmarkMatchRules(const QList<MatchRuleList> &allMatchRules, const MatchPathList &paths)
+{
+    const qint64 ops = qint64(paths.size()) * allMatchRules.size();
+    benchmark("findMatchRule", ops, [&]() {
+        foreach (const MatchRuleList &matchRules, allMatchRules)
+            for (int i = 0; i < paths.size(); ++i)
+                findMatchRule(matchRules, paths.at(i).first, paths.at(i).second);
+    });
+    benchmark("RuleMatchCache::find", ops, [&]() {
+        foreach (const MatchRuleList &matchRules, allMatchRules) {
+            QScopedPointer<RuleMatchCache> cache(new RuleMatchCache);
+            for (int i = 0; i < paths.size(); ++i) {
+                if (i && paths.at(i).first != paths.at(i - 1).first)
+                    cache.reset(new RuleMatchCache);
+                cache->find(matchRules, paths.at(i).first, paths.at(i).second);
+            }
+        }
+    });
+}
+
+// The first rule whose regexp matches path at its start, by linear scan.
+template <typename Matcher>
+static int linearMatch(const MatchRuleList &matchRules, int revnum, const QString &path,
+                       Matcher matcher, int *length)
+{
+    for (int i = 0; i < matchRules.size(); ++i) {
+        const Rules::Match &rule = matchRules.at(i);
+        if (rule.minRevision > revnum)
+            continue;
+        if (rule.maxRevision != -1 && rule.maxRevision < revnum)
+            continue;
+        *length = matcher(i, path);
+        if (*length != -1)
+            return i;
+    }
+    *length = -1;
+    return -1;
+}
+
+static QString describeMatch(const MatchRuleList &matchRules, int index, int length)
+{
+    if (index == -1)
+        return QStringLiteral("nothing");
+    return QString("%1 (length %2)").arg(matchRules.at(index).info()).arg(length);
+}
+
+/*
+ * Replays the paths of a conversion log through a linear scan using PCRE
+ * as it is, and one using QRegExp, the engine the rules were originally
+ * written for, and reports every path for which the two disagree, along
+ * with whether findMatchRule(), which prefers the longest match for
+ * ambiguous rules, agrees with QRegExp there.  Lines as printed by
+ * --debug-rules ("rev N PATH matched rule: ...") are understood, as well
+ * as "N PATH" and bare paths, which are matched as of the last revision.
+ * Returns the number of paths for which findMatchRule() and QRegExp
+ * disagree.
+ */
+int checkMatchRules(const QList<MatchRuleList> &allMatchRules, const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qCritical() << "Could not open" << fileName << ":" << file.errorString();
+        return -1;
+    }
+
+    QList<QVector<QRegExp> > legacy;
+    foreach (const MatchRuleList &matchRules, allMatchRules) {
+        QVector<QRegExp> rxs;
+        foreach (const Rules::Match &rule, matchRules)
+            rxs.append(QRegExp(rule.rx.pattern(), Qt::CaseSensitive, QRegExp::RegExp2));
+        legacy.append(rxs);
+    }
+
+    int paths = 0, differences = 0, mismatches = 0;
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        int revnum;
+        QString path;
+        if (!parseMatchPathLine(in.readLine().trimmed(), &revnum, &path))
+            continue;
+        ++paths;
+
+        for (int l = 0; l < allMatchRules.size(); ++l) {
+            const MatchRuleList &matchRules = allMatchRules.at(l);
+
+            int pcreLength;
+            const int pcre = linearMatch(matchRules, revnum, path, [&](int i, const QString &subject) {
+                const QRegularExpressionMatch m =
+                    matchRules.at(i).rx.match(subject, 0, QRegularExpression::NormalMatch,
+                                              QRegularExpression::AnchoredMatchOption);
+                return m.hasMatch() ? m.capturedLength() : -1;
+            }, &pcreLength);
+            int expectedLength;
+            const int expected = linearMatch(matchRules, revnum, path, [&](int i, const QString &subject) {
+                QRegExp &rx = legacy[l][i];
+                return rx.indexIn(subject) == 0 ? rx.matchedLength() : -1;
+            }, &expectedLength);
+            const RuleMatch match = findMatchRule(matchRules, revnum, path);
+            const int length = match.isValid() ? match.matchedLength() : -1;
+            const bool agrees = match.index() == expected && length == expectedLength;
+            if (!agrees)
+                ++mismatches;
+
+            if (pcre == expected && pcreLength == expectedLength) {
+                if (agrees)
+                    continue;
+                printf("rev %d %s: findMatchRule() matched %s, QRegExp matched %s\n",
+                       revnum, qPrintable(path),
+                       qPrintable(describeMatch(matchRules, match.index(), length)),
+                       qPrintable(describeMatch(matchRules, expected, expectedLength)));
+                continue;
+            }
+
+            ++differences;
+            printf("rev %d %s: PCRE matched %s, QRegExp matched %s, %s\n",
+                   revnum, qPrintable(path),
+                   qPrintable(describeMatch(matchRules, pcre, pcreLength)),
+                   qPrintable(describeMatch(matchRules, expected, expectedLength)),
+                   agrees ? "findMatchRule() agrees with QRegExp"
+                          : qPrintable("findMatchRule() matched " + describeMatch(matchRules, match.index(), length)));
+        }
+    }
+
+    printf("%d paths checked, PCRE and QRegExp disagree on %d, %d mismatches after taking the longest match\n",
+           paths, differences, mismatches);
+    return mismatches;
+}
+
 Rules::Rules(const QString &fn)
     : filename(fn)
 {
@@ -317,11 +954,17 @@ void Rules::load(const QString &filename)
                 // match rule
                 state = ReadingMatch;
                 match = Match();
-                match.rx = QRegExp(matchLine.cap(1), Qt::CaseSensitive, QRegExp::RegExp2);
+                match.rx = QRegularExpression(matchLine.cap(1));
                 if( !match.rx.isValid() )
                     qFatal("Malformed regular expression '%s' in file:'%s':%d, Error: %s",
                            qPrintable(matchLine.cap(1)), qPrintable(filename), lineNumber,
                            qPrintable(match.rx.errorString()));
+                match.rx.optimize();
+                match.exactRx = QRegularExpression("\\A(?:" + matchLine.cap(1) + ")\\z");
+                match.exactRx.optimize();
+                match.ambiguous = isAmbiguous(matchLine.cap(1));
+                match.extentRx = QRegularExpression("(?:" + matchLine.cap(1) + ")(?!)");
+                match.extentRx.optimize();
                 match.lineNumber = lineNumber;
                 match.filename = filename;
             } else if (isVariableRule) {
@@ -346,8 +989,41 @@ public:
     void printStats() const;
     void ruleMatched(const Rules::Match &rule, const int rev);
     void addRule(const Rules::Match &rule);
+    void ruleLookup(int visited, int linearVisited);
+    void ruleCacheUsage(int hits, int misses);
+    void blobExported(qint64 length, bool reused);
+    void revisionPrefetched(bool ready);
+    void fastImportWrites(qint64 bytes, qint64 stalls, qint64 stalledMsecs);
+    void branchHistoryUsage(qint64 commits, qint64 branches, qint64 bytes, qint64 perBranchBytes);
+    void atomTableUsage(qint64 atoms, qint64 bytes);
+    void revisionRootLookup(bool hit);
+    void nodeKindLookup(bool hit);
 private:
     QMap<Rules::Match,int> m_usedRules;
+    qint64 m_cacheHits;
+    qint64 m_cacheMisses;
+    qint64 m_lookups;
+    qint64 m_visited;
+    qint64 m_linearVisited;
+    qint64 m_blobsSent;
+    qint64 m_bytesSent;
+    qint64 m_blobsReused;
+    qint64 m_bytesReused;
+    qint64 m_prefetchHits;
+    qint64 m_prefetchMisses;
+    qint64 m_bytesWritten;
+    qint64 m_writeStalls;
+    qint64 m_writeStalledMsecs;
+    qint64 m_historyCommits;
+    qint64 m_historyBranches;
+    qint64 m_historyBytes;
+    qint64 m_historyPerBranchBytes;
+    qint64 m_atoms;
+    qint64 m_atomBytes;
+    qint64 m_rootHits;
+    qint64 m_rootMisses;
+    qint64 m_kindHits;
+    qint64 m_kindMisses;
 };
 
 Stats::Stats() : d(new Private())
@@ -390,7 +1066,26 @@ void Stats::addRule( const Rules::Match &rule)
         d->addRule(rule);
 }
 
+void Stats::ruleLookup(int visited, int linearVisited)
+{
+    if(use)
+        d->ruleLookup(visited, linearVisited);
+}
+
+void Stats::ruleCacheUsage(int hits, int misses)
+{
+    if(use)
+        d->ruleCacheUsage(hits, misses);
+}
+
 Stats::Private::Private()
+    : m_cacheHits(0), m_cacheMisses(0), m_lookups(0), m_visited(0), m_linearVisited(0),
+      m_blobsSent(0), m_bytesSent(0), m_blobsReused(0), m_bytesReused(0),
+      m_prefetchHits(0), m_prefetchMisses(0),
+      m_bytesWritten(0), m_writeStalls(0), m_writeStalledMsecs(0),
+      m_historyCommits(0), m_historyBranches(0), m_historyBytes(0), m_historyPerBranchBytes(0),
+      m_atoms(0), m_atomBytes(0),
+      m_rootHits(0), m_rootMisses(0), m_kindHits(0), m_kindMisses(0)
 {
 }
 
@@ -400,6 +1095,89 @@ void Stats::Private::printStats() const
     foreach(const Rules::Match rule, m_usedRules.keys()) {
         printf("%s was matched %i times\n", qPrintable(rule.info()), m_usedRules[rule]);
     }
+
+    printf("\nRule index stats\n");
+    printf("%lld lookups visited %lld rules, a linear scan would have visited %lld\n",
+           m_lookups, m_visited, m_linearVisited);
+    if (m_visited)
+        printf("%.1fx fewer rules visited\n", double(m_linearVisited) / m_visited);
+    printf("%lld lookups answered by the per-directory cache, %lld had to be matched\n",
+           m_cacheHits, m_cacheMisses);
+
+    printf("\nBlob stats\n");
+    printf("%lld blobs (%lld bytes) sent to fast-import\n", m_blobsSent, m_bytesSent);
+    printf("%lld blobs (%lld bytes) reused by checksum\n", m_blobsReused, m_bytesReused);
+
+    if (m_prefetchHits + m_prefetchMisses) {
+        printf("\nPrefetch stats\n");
+        printf("%lld revisions were prefetched in time, %lld were not (%.1f%% ready in time)\n",
+               m_prefetchHits, m_prefetchMisses,
+               100.0 * m_prefetchHits / (m_prefetchHits + m_prefetchMisses));
+    }
+
+    printf("\nfast-import pipe stats\n");
+    printf("%lld bytes written, waited %lld times for fast-import for %lld ms in total\n",
+           m_bytesWritten, m_writeStalls, m_writeStalledMsecs);
+
+    printf("\nBranch history stats\n");
+    printf("%lld commits on %lld branches take %lld KiB, per-branch vectors would take %lld KiB\n",
+           m_historyCommits, m_historyBranches, m_historyBytes / 1024, m_historyPerBranchBytes / 1024);
+
+    printf("\nAtom table stats\n");
+    printf("%lld path prefixes and branch names interned in %lld KiB\n", m_atoms, m_atomBytes / 1024);
+
+    if (m_rootHits + m_rootMisses) {
+        printf("\nRevision root cache stats\n");
+        printf("%lld of %lld revision roots were already open (%.1f%% hit rate)\n",
+               m_rootHits, m_rootHits + m_rootMisses,
+               100.0 * m_rootHits / (m_rootHits + m_rootMisses));
+        if (m_kindHits + m_kindMisses)
+            printf("%lld of %lld node kinds were already known (%.1f%% hit rate)\n",
+                   m_kindHits, m_kindHits + m_kindMisses,
+                   100.0 * m_kindHits / (m_kindHits + m_kindMisses));
+    }
+}
+
+void Stats::blobExported(qint64 length, bool reused)
+{
+    if(use)
+        d->blobExported(length, reused);
+}
+
+void Stats::revisionPrefetched(bool ready)
+{
+    if(use)
+        d->revisionPrefetched(ready);
+}
+
+void Stats::fastImportWrites(qint64 bytes, qint64 stalls, qint64 stalledMsecs)
+{
+    if(use)
+        d->fastImportWrites(bytes, stalls, stalledMsecs);
+}
+
+void Stats::branchHistoryUsage(qint64 commits, qint64 branches, qint64 bytes, qint64 perBranchBytes)
+{
+    if(use)
+        d->branchHistoryUsage(commits, branches, bytes, perBranchBytes);
+}
+
+void Stats::atomTableUsage(qint64 atoms, qint64 bytes)
+{
+    if(use)
+        d->atomTableUsage(atoms, bytes);
+}
+
+void Stats::revisionRootLookup(bool hit)
+{
+    if(use)
+        d->revisionRootLookup(hit);
+}
+
+void Stats::nodeKindLookup(bool hit)
+{
+    if(use)
+        d->nodeKindLookup(hit);
 }
 
 void Stats::Private::ruleMatched(const Rules::Match &rule, const int rev)
@@ -413,6 +1191,75 @@ void Stats::Private::ruleMatched(const Rules::Match &rule, const int rev)
     }
 }
 
+void Stats::Private::ruleLookup(int visited, int linearVisited)
+{
+    ++m_lookups;
+    m_visited += visited;
+    m_linearVisited += linearVisited;
+}
+
+void Stats::Private::ruleCacheUsage(int hits, int misses)
+{
+    m_cacheHits += hits;
+    m_cacheMisses += misses;
+}
+
+void Stats::Private::blobExported(qint64 length, bool reused)
+{
+    if (reused) {
+        ++m_blobsReused;
+        m_bytesReused += length;
+    } else {
+        ++m_blobsSent;
+        m_bytesSent += length;
+    }
+}
+
+void Stats::Private::revisionPrefetched(bool ready)
+{
+    if (ready)
+        ++m_prefetchHits;
+    else
+        ++m_prefetchMisses;
+}
+
+void Stats::Private::fastImportWrites(qint64 bytes, qint64 stalls, qint64 stalledMsecs)
+{
+    m_bytesWritten += bytes;
+    m_writeStalls += stalls;
+    m_writeStalledMsecs += stalledMsecs;
+}
+
+void Stats::Private::branchHistoryUsage(qint64 commits, qint64 branches, qint64 bytes, qint64 perBranchBytes)
+{
+    m_historyCommits += commits;
+    m_historyBranches += branches;
+    m_historyBytes += bytes;
+    m_historyPerBranchBytes += perBranchBytes;
+}
+
+void Stats::Private::atomTableUsage(qint64 atoms, qint64 bytes)
+{
+    m_atoms = atoms;
+    m_atomBytes = bytes;
+}
+
+void Stats::Private::revisionRootLookup(bool hit)
+{
+    if (hit)
+        ++m_rootHits;
+    else
+        ++m_rootMisses;
+}
+
+void Stats::Private::nodeKindLookup(bool hit)
+{
+    if (hit)
+        ++m_kindHits;
+    else
+        ++m_kindMisses;
+}
+
 void Stats::Private::addRule( const Rules::Match &rule)
 {
     if(m_usedRules.contains(rule))
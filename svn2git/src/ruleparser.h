@@ -18,12 +18,17 @@
 #ifndef RULEPARSER_H
 #define RULEPARSER_H
 
+#include <QHash>
 #include <QList>
 #include <QMap>
 #include <QRegExp>
+#include <QRegularExpression>
 #include <QString>
 #include <QStringList>
 #include <QStringBuilder>
+#include <QVector>
+
+#include <limits.h>
 
 class Rules
 {
@@ -66,7 +71,19 @@ public:
             QString& apply(QString &string) { return string.replace(pattern, replacement); }
         };
 
-        QRegExp rx;
+        QRegularExpression rx;
+        // rx anchored at both ends.  The substitutions are applied to the
+        // matched prefix with it, and the matched length of an ambiguous
+        // rule is found by matching it against ever shorter prefixes.
+        QRegularExpression exactRx;
+        // Whether rx has alternations or optional groups, where PCRE takes
+        // the first match and QRegExp, the engine the rules were written
+        // for, the longest one.
+        bool ambiguous;
+        // rx followed by a failing assertion, so that a hard partial match
+        // tries every way rx can match and reports whether any of them
+        // needs more of the subject than it was given.
+        QRegularExpression extentRx;
         QString repository;
         QList<Substitution> repo_substs;
         QString branch;
@@ -86,7 +103,7 @@ public:
             Recurse
         } action;
 
-        Match() : minRevision(-1), maxRevision(-1), annotate(false), action(Ignore) { }
+        Match() : ambiguous(false), minRevision(-1), maxRevision(-1), annotate(false), action(Ignore) { }
         bool operator<(const Match other) const {
             if (filename != other.filename)
                 return filename < other.filename;
@@ -114,6 +131,148 @@ private:
     QMap<QString,QString> m_variables;
 };
 
+// Buckets match rules by the literal text their regular expression starts
+// with, so that a path only has to be tested against the rules whose prefix
+// it shares.  Candidates are returned in rule order, which keeps the
+// first-match semantics of a plain linear scan.
+//
+// The rule set is further split into revision epochs at every min/max
+// revision boundary; the buckets of an epoch only hold the rules active
+// throughout it.  Buckets that do not change between epochs are shared.
+class MatchRuleIndex
+{
+public:
+    struct Epoch
+    {
+        int firstRevision;
+        int lastRevision;   // INT_MAX if open-ended
+        QVector<QVector<int> > buckets;
+
+        bool contains(int revnum) const {
+            return revnum >= firstRevision && revnum <= lastRevision;
+        }
+    };
+
+    MatchRuleIndex();
+    explicit MatchRuleIndex(const QList<Rules::Match> &rules);
+
+    const Epoch &epoch(int revnum) const;
+    const QVector<int> &candidates(const QString &path, const Epoch &epoch,
+                                   int *extendingRule = 0) const;
+    int nodeCount() const { return m_nodes.size(); }
+    int bucketCount() const { return m_bucketCount; }
+    int epochCount() const { return m_epochs.size(); }
+
+    static QStringList literalPrefixes(const QString &pattern);
+
+private:
+    void build(const QList<Rules::Match> &rules);
+    void buildEpochs(const QList<Rules::Match> &rules, const QVector<QVector<int> > &buckets);
+
+    struct Node
+    {
+        QHash<QChar, int> children;
+        int bucket;
+        int extendingRule;  // lowest rule whose prefix runs past this node
+        Node() : bucket(-1), extendingRule(INT_MAX) {}
+    };
+    QVector<Node> m_nodes;
+    QVector<Epoch> m_epochs;
+    int m_bucketCount;
+};
+
+// A list of match rules together with its index.  Copies share both.
+class MatchRuleList : public QList<Rules::Match>
+{
+public:
+    MatchRuleList() : current(0) { }
+    MatchRuleList(const QList<Rules::Match> &rules)
+        : QList<Rules::Match>(rules), index(rules), current(0) { }
+
+    // Remember the epoch of the revision being exported, so lookups for it
+    // do not have to search for the epoch again.
+    void selectRevision(int revnum) { current = &index.epoch(revnum); }
+
+    const MatchRuleIndex::Epoch &epoch(int revnum) const {
+        if (current && current->contains(revnum))
+            return *current;
+        return index.epoch(revnum);
+    }
+
+    MatchRuleIndex index;
+
+private:
+    const MatchRuleIndex::Epoch *current;
+};
+
+// The outcome of matching a path against a MatchRuleList.  Nothing is left
+// behind in the rule's regular expression, so several lookups can be in
+// flight at once.
+class RuleMatch
+{
+public:
+    RuleMatch() : m_rule(0), m_index(-1), m_length(-1) { }
+    RuleMatch(const Rules::Match &rule, int index, int length)
+        : m_rule(&rule), m_index(index), m_length(length) { }
+
+    bool isValid() const { return m_rule != 0; }
+    const Rules::Match &rule() const { return *m_rule; }
+    int index() const { return m_index; }
+    int matchedLength() const { return m_length; }
+
+private:
+    const Rules::Match *m_rule;
+    int m_index;
+    int m_length;
+};
+
+enum RuleType { AnyRule = 0, NoIgnoreRule = 0x01, NoRecurseRule = 0x02 };
+
+RuleMatch findMatchRule(const MatchRuleList &matchRules, int revnum, const QString &current,
+                        int ruleMask = AnyRule);
+int checkMatchRules(const QList<MatchRuleList> &allMatchRules, const QString &fileName);
+
+// The revisions and paths of a --debug-rules log, in the formats that
+// checkMatchRules() understands.
+typedef QList<QPair<int, QString> > MatchPathList;
+bool readMatchPaths(const QString &fileName, MatchPathList *paths);
+void benchmarkMatchRules(const QList<MatchRuleList> &allMatchRules, const MatchPathList &paths);
+
+// Remembers, per directory, which rule all of its entries resolve to.  A
+// directory only gets an entry if its own text is enough to decide the
+// match: every earlier rule must be unable to match anything below it and
+// the chosen rule must not look past it.  Meant to live for one revision.
+class RuleMatchCache
+{
+public:
+    RuleMatchCache() : m_hits(0), m_misses(0) { }
+    ~RuleMatchCache();
+
+    RuleMatch find(const MatchRuleList &matchRules, int revnum, const QString &path,
+                   int ruleMask = AnyRule);
+    // True if dir, which ends in '/', and everything below it resolve to
+    // the same match, which is then stored in *match.
+    bool decides(const MatchRuleList &matchRules, int revnum, const QString &dir,
+                 RuleMatch *match, int ruleMask = AnyRule);
+
+private:
+    struct Decision
+    {
+        bool decided;
+        RuleMatch match;
+    };
+    typedef QPair<QPair<const void *, int>, QString> Key;
+
+    const Decision &decision(const MatchRuleList &matchRules, int revnum, const QString &dir,
+                             int ruleMask);
+    Decision decide(const MatchRuleList &matchRules, int revnum, const QString &dir,
+                    int ruleMask) const;
+
+    QHash<Key, Decision> m_decisions;
+    int m_hits;
+    int m_misses;
+};
+
 class RulesList
 {
 public:
@@ -139,6 +298,15 @@ public:
     void printStats() const;
     void ruleMatched(const Rules::Match &rule, const int rev = -1);
     void addRule( const Rules::Match &rule);
+    void ruleLookup(int visited, int linearVisited);
+    void ruleCacheUsage(int hits, int misses);
+    void blobExported(qint64 length, bool reused);
+    void revisionPrefetched(bool ready);
+    void fastImportWrites(qint64 bytes, qint64 stalls, qint64 stalledMsecs);
+    void branchHistoryUsage(qint64 commits, qint64 branches, qint64 bytes, qint64 perBranchBytes);
+    void atomTableUsage(qint64 atoms, qint64 bytes);
+    void revisionRootLookup(bool hit);
+    void nodeKindLookup(bool hit);
     static void init();
     ~Stats();
 
@@ -33,18 +33,24 @@ QMAKE_CXXFLAGS_DEBUG += -O2 -Wno-deprecated-declarations
 
 INCLUDEPATH += . $$SVN_INCLUDE $$APR_INCLUDE
 !isEmpty(SVN_LIBDIR): LIBS += -L$$SVN_LIBDIR
-LIBS += -lsvn_fs-1 -lsvn_repos-1 -lapr-1 -lsvn_subr-1
+LIBS += -lsvn_fs-1 -lsvn_repos-1 -lapr-1 -lsvn_subr-1 -lz
 #LIBS += -lprofiler
 #LIBS += -fsanitize=address
 
 # Input
 SOURCES += ruleparser.cpp \
+    atoms.cpp \
+    metrics.cpp \
     repository.cpp \
+    packimporter.cpp \
     svn.cpp \
     main.cpp \
     CommandLineParser.cpp \
 
 HEADERS += ruleparser.h \
+    atoms.h \
+    metrics.h \
     repository.h \
+    packimporter.h \
     svn.h \
     CommandLineParser.h \
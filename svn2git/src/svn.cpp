@@ -38,19 +38,29 @@
 #include <apr_getopt.h>
 #include <apr_general.h>
 
+#include <svn_cache_config.h>
+#include <svn_checksum.h>
 #include <svn_fs.h>
+#include <svn_mergeinfo.h>
 #include <svn_pools.h>
+#include <svn_props.h>
 #include <svn_repos.h>
 #include <svn_types.h>
 #include <svn_version.h>
 
 #include <algorithm>
+#include <QCryptographicHash>
 #include <QDir>
 #include <QFile>
 #include <QDebug>
+#include <QMutex>
+#include <QThread>
+#include <QWaitCondition>
 #include <QRegularExpression>
 
 #include "repository.h"
+#include "atoms.h"
+#include "metrics.h"
 
 #undef SVN_ERR
 #define SVN_ERR(expr) SVN_INT_ERR(expr)
@@ -59,7 +69,6 @@
 #define svn_stream_read_full svn_stream_read
 #endif
 
-typedef QList<Rules::Match> MatchRuleList;
 typedef QHash<QString, Repository *> RepositoryHash;
 typedef QHash<QByteArray, QByteArray> IdentityHash;
 
@@ -83,6 +92,285 @@ public:
     inline operator apr_pool_t *() const { return pool; }
 };
 
+static int openFs(svn_fs_t **fs, const QString &pathToRepository, apr_pool_t *pool, apr_pool_t *scratch_pool)
+{
+    svn_repos_t *repos;
+    QString path = pathToRepository;
+    while (path.endsWith('/')) // no trailing slash allowed
+        path = path.mid(0, path.length()-1);
+#if SVN_VER_MAJOR == 1 && SVN_VER_MINOR < 9
+    Q_UNUSED(scratch_pool);
+    SVN_ERR(svn_repos_open2(&repos, QFile::encodeName(path), NULL, pool));
+#else
+    SVN_ERR(svn_repos_open3(&repos, QFile::encodeName(path), NULL, pool, scratch_pool));
+#endif
+    *fs = svn_repos_fs(repos);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Reads the revisions after the one being exported on threads of their
+ * own, each with its own svn_fs_t, so that the change lists, node
+ * revisions, properties and file contents are in svn's in-process cache
+ * and the OS page cache by the time exportRevision() wants them.  The
+ * export itself still does every read in revision order, so nothing
+ * prefetched can change the output.
+ */
+class RevisionPrefetcher
+{
+public:
+    RevisionPrefetcher(const QString &pathToRepository, int depth, int threads, int lastRevision);
+    ~RevisionPrefetcher();
+
+    // called before revnum is exported; workers may run depth revisions ahead
+    void advance(int revnum);
+
+private:
+    class Worker : public QThread
+    {
+    public:
+        Worker(RevisionPrefetcher *p) : prefetcher(p) {}
+        void run();
+    private:
+        int prefetch(svn_fs_t *fs, int revnum, apr_pool_t *pool);
+        RevisionPrefetcher *prefetcher;
+    };
+
+    QString path;
+    int depth;
+    QMutex mutex;
+    QWaitCondition wanted;
+    int current;  // revision being exported
+    int next;     // next revision for a worker to take
+    int limit;    // last revision workers may take
+    int last;     // last revision that will be exported
+    bool stopping;
+    QSet<int> ready;
+    QList<Worker *> workers;
+};
+
+RevisionPrefetcher::RevisionPrefetcher(const QString &pathToRepository, int d, int threads, int lastRevision)
+    : path(pathToRepository), depth(d), current(-1), next(0), limit(-1), last(lastRevision), stopping(false)
+{
+    for (int i = 0; i < threads; ++i) {
+        workers.append(new Worker(this));
+        workers.last()->start(QThread::LowPriority);
+    }
+}
+
+RevisionPrefetcher::~RevisionPrefetcher()
+{
+    mutex.lock();
+    stopping = true;
+    wanted.wakeAll();
+    mutex.unlock();
+    foreach (Worker *worker, workers) {
+        worker->wait();
+        delete worker;
+    }
+}
+
+void RevisionPrefetcher::advance(int revnum)
+{
+    QMutexLocker locker(&mutex);
+    if (next <= revnum)
+        next = revnum + 1;
+    // A revision that is still being read counts as a miss, too.
+    Stats::instance()->revisionPrefetched(ready.remove(revnum));
+    // skipped by --revisions-file
+    for (QSet<int>::iterator it = ready.begin(); it != ready.end(); ) {
+        if (*it < revnum)
+            it = ready.erase(it);
+        else
+            ++it;
+    }
+    current = revnum;
+    limit = qMin(revnum + depth, last);
+    wanted.wakeAll();
+}
+
+void RevisionPrefetcher::Worker::run()
+{
+    AprAutoPool pool;
+    AprAutoPool revpool(pool);
+    svn_fs_t *fs;
+    if (openFs(&fs, prefetcher->path, pool, revpool) != EXIT_SUCCESS) {
+        qWarning() << "WARN: prefetch thread could not open the repository";
+        return;
+    }
+
+    forever {
+        prefetcher->mutex.lock();
+        while (!prefetcher->stopping && prefetcher->next > prefetcher->limit)
+            prefetcher->wanted.wait(&prefetcher->mutex);
+        if (prefetcher->stopping) {
+            prefetcher->mutex.unlock();
+            return;
+        }
+        int revnum = prefetcher->next++;
+        prefetcher->mutex.unlock();
+
+        revpool.clear();
+        int result = prefetch(fs, revnum, revpool);
+
+        QMutexLocker locker(&prefetcher->mutex);
+        // the exporter may have passed it already
+        if (result == EXIT_SUCCESS && revnum > prefetcher->current)
+            prefetcher->ready.insert(revnum);
+    }
+}
+
+int RevisionPrefetcher::Worker::prefetch(svn_fs_t *fs, int revnum, apr_pool_t *pool)
+{
+    svn_fs_root_t *fs_root;
+    SVN_ERR(svn_fs_revision_root(&fs_root, fs, revnum, pool));
+
+    apr_hash_t *changes;
+    SVN_ERR(svn_fs_paths_changed2(&changes, fs_root, pool));
+
+    AprAutoPool pathpool(pool);
+    for (apr_hash_index_t *i = apr_hash_first(pool, changes); i; i = apr_hash_next(i)) {
+        pathpool.clear();
+        const void *vkey;
+        void *value;
+        apr_hash_this(i, &vkey, NULL, &value);
+        const char *key = reinterpret_cast<const char *>(vkey);
+        svn_fs_path_change2_t *change = reinterpret_cast<svn_fs_path_change2_t *>(value);
+        if (change->change_kind == svn_fs_path_change_delete)
+            continue;
+
+        svn_node_kind_t kind;
+        SVN_ERR(svn_fs_check_path(&kind, fs_root, key, pathpool));
+        svn_revnum_t rev_from;
+        const char *path_from;
+        SVN_ERR(svn_fs_copied_from(&rev_from, &path_from, fs_root, key, pathpool));
+        apr_hash_t *props;
+        SVN_ERR(svn_fs_node_proplist(&props, fs_root, key, pathpool));
+
+        if (kind == svn_node_file && (change->text_mod || path_from)) {
+            svn_stream_t *in_stream;
+            SVN_ERR(svn_fs_file_contents(&in_stream, fs_root, key, pathpool));
+            SVN_ERR(svn_stream_copy3(in_stream, svn_stream_empty(pathpool), NULL, NULL, pathpool));
+        } else if (kind == svn_node_dir) {
+            apr_hash_t *entries;
+            SVN_ERR(svn_fs_dir_entries(&entries, fs_root, key, pathpool));
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * The roots of the revisions looked at last, and the node kinds looked up in
+ * them.  Exporting a revision mostly asks about revnum - 1 and a handful of
+ * copy sources, often about the same paths once per matching rule set, and
+ * opening a root for each of those questions is what this saves.  A root
+ * handed out stays valid until Size other revisions have been asked for.
+ */
+class RevisionRoots
+{
+public:
+    enum { Size = 8, MaxKinds = 64 * 1024 };
+
+    RevisionRoots(svn_fs_t *fs) : m_fs(fs), m_clock(0) {}
+    ~RevisionRoots();
+
+    svn_error_t *root(svn_fs_root_t **root_p, svn_revnum_t revnum);
+    svn_error_t *checkPath(svn_node_kind_t *kind, svn_revnum_t revnum, const char *path);
+
+private:
+    struct Entry
+    {
+        svn_revnum_t revnum;
+        apr_pool_t *pool;
+        svn_fs_root_t *root;
+        quint64 used;
+        QHash<QByteArray, svn_node_kind_t> kinds;
+    };
+    Entry *entry(svn_revnum_t revnum, svn_error_t **err);
+
+    svn_fs_t *m_fs;
+    quint64 m_clock;
+    QVector<Entry> m_entries;
+};
+
+RevisionRoots::~RevisionRoots()
+{
+    foreach (const Entry &e, m_entries)
+        svn_pool_destroy(e.pool);
+}
+
+RevisionRoots::Entry *RevisionRoots::entry(svn_revnum_t revnum, svn_error_t **err)
+{
+    *err = SVN_NO_ERROR;
+    int lru = 0;
+    for (int i = 0; i < m_entries.size(); ++i) {
+        if (m_entries.at(i).revnum == revnum) {
+            Stats::instance()->revisionRootLookup(true);
+            m_entries[i].used = ++m_clock;
+            return &m_entries[i];
+        }
+        if (m_entries.at(i).used < m_entries.at(lru).used)
+            lru = i;
+    }
+    Stats::instance()->revisionRootLookup(false);
+
+    Entry e;
+    e.revnum = revnum;
+    e.pool = svn_pool_create(NULL);
+    e.used = ++m_clock;
+    *err = svn_fs_revision_root(&e.root, m_fs, revnum, e.pool);
+    if (*err) {
+        svn_pool_destroy(e.pool);
+        return 0;
+    }
+    if (m_entries.size() < Size) {
+        m_entries.append(e);
+        return &m_entries.last();
+    }
+    svn_pool_destroy(m_entries.at(lru).pool);
+    m_entries[lru] = e;
+    return &m_entries[lru];
+}
+
+svn_error_t *RevisionRoots::root(svn_fs_root_t **root_p, svn_revnum_t revnum)
+{
+    svn_error_t *err;
+    Entry *e = entry(revnum, &err);
+    if (e)
+        *root_p = e->root;
+    return err;
+}
+
+svn_error_t *RevisionRoots::checkPath(svn_node_kind_t *kind, svn_revnum_t revnum, const char *path)
+{
+    svn_error_t *err;
+    Entry *e = entry(revnum, &err);
+    if (!e)
+        return err;
+
+    const QByteArray key(path);
+    QHash<QByteArray, svn_node_kind_t>::const_iterator it = e->kinds.constFind(key);
+    if (it != e->kinds.constEnd()) {
+        Stats::instance()->nodeKindLookup(true);
+        *kind = *it;
+        return SVN_NO_ERROR;
+    }
+    Stats::instance()->nodeKindLookup(false);
+
+    // the scratch memory of svn_fs_check_path is small, and the root's pool
+    // is destroyed with the root anyway
+    AprAutoPool pool(e->pool);
+    err = svn_fs_check_path(kind, e->root, path, pool);
+    if (err)
+        return err;
+    if (e->kinds.size() >= MaxKinds)
+        e->kinds.clear();
+    e->kinds.insert(key, *kind);
+    return SVN_NO_ERROR;
+}
+
 class SvnPrivate
 {
 public:
@@ -97,12 +385,16 @@ public:
     int exportRevision(int revnum);
 
     int openRepository(const QString &pathToRepository);
+    void startPrefetch(int depth, int lastRevision);
 
 private:
+    RevisionPrefetcher *prefetcher;
+    RevisionRoots *roots;
     AprAutoPool global_pool;
     AprAutoPool scratch_pool;
     svn_fs_t *fs;
     svn_revnum_t youngest_rev;
+    QString repo_path;
     QString svn_repo_path;
 };
 
@@ -116,6 +408,20 @@ void Svn::initialize()
 
     // static destructor
     static struct Destructor { ~Destructor() { apr_terminate(); } } destructor;
+
+    // The prefetch threads warm svn's cache for the exporting one, which
+    // only works if the cache is shared, so set it up before any fs opens.
+    int prefetchDepth = CommandLineParser::instance()->optionArgument(QLatin1String("prefetch"), QLatin1String("0")).toInt();
+    if (prefetchDepth > 0) {
+        svn_cache_config_t config = *svn_cache_config_get();
+        config.single_threaded = FALSE;
+        config.cache_size = qMax<apr_uint64_t>(config.cache_size,
+            CommandLineParser::instance()->optionArgument(QLatin1String("prefetch-cache"), QLatin1String("512")).toULongLong() * 1024 * 1024);
+        svn_cache_config_set(&config);
+
+        static AprAutoPool fs_pool;
+        svn_fs_initialize(fs_pool);
+    }
 }
 
 Svn::Svn(const QString &pathToRepository)
@@ -128,9 +434,16 @@ Svn::~Svn()
     delete d;
 }
 
-void Svn::setMatchRules(const QList<MatchRuleList> &allMatchRules)
+void Svn::setMatchRules(const QList<QList<Rules::Match> > &allMatchRules)
 {
-    d->allMatchRules = allMatchRules;
+    d->allMatchRules.clear();
+    foreach (const QList<Rules::Match> &matchRules, allMatchRules) {
+        MatchRuleList indexed(matchRules);
+        qDebug() << "Indexed" << indexed.size() << "match rules into"
+                 << indexed.index.bucketCount() << "prefix buckets and"
+                 << indexed.index.epochCount() << "revision epochs";
+        d->allMatchRules.append(indexed);
+    }
 }
 
 void Svn::setRepositories(const RepositoryHash &repositories)
@@ -153,13 +466,61 @@ int Svn::youngestRevision()
     return d->youngestRevision();
 }
 
+void Svn::startPrefetch(int depth, int lastRevision)
+{
+    d->startPrefetch(depth, lastRevision);
+}
+
 bool Svn::exportRevision(int revnum)
 {
     return d->exportRevision(revnum) == EXIT_SUCCESS;
 }
 
+/*
+ * Splits the exported paths of a --debug-rules log, dropping the cache of
+ * splits whenever the revision changes, as a new SvnRevision would.
+ */
+void Svn::benchmarkSplitPathName(const QList<MatchRuleList> &allMatchRules, const MatchPathList &paths)
+{
+    AprAutoPool pool;
+    QString repoPath;
+    SvnRevision rev(0, NULL, pool, repoPath);
+
+    struct Input
+    {
+        int revnum;
+        QString path;
+        RuleMatch match;
+    };
+    QVector<Input> inputs;
+    for (int i = 0; i < paths.size(); ++i) {
+        foreach (const MatchRuleList &matchRules, allMatchRules) {
+            Input input;
+            input.revnum = paths.at(i).first;
+            input.path = paths.at(i).second;
+            input.match = findMatchRule(matchRules, input.revnum, input.path, NoIgnoreRule);
+            if (input.match.isValid() && input.match.rule().action == Rules::Match::Export)
+                inputs.append(input);
+        }
+    }
+
+    benchmark("SvnRevision::splitPathName", inputs.size(), [&]() {
+        QString svnprefix, repository, effectiveRepository, branch, path;
+        int revnum = -1;
+        foreach (const Input &input, inputs) {
+            if (input.revnum != revnum) {
+                rev.splitCache.clear();
+                revnum = input.revnum;
+            }
+            rev.splitPathName(input.match, input.path, &svnprefix, &repository, &effectiveRepository,
+                              &branch, &path);
+        }
+    });
+}
+
 SvnPrivate::SvnPrivate(const QString &pathToRepository)
-    : global_pool(NULL) , scratch_pool(NULL), svn_repo_path(pathToRepository)
+    : prefetcher(NULL), roots(NULL), global_pool(NULL) , scratch_pool(NULL), repo_path(pathToRepository),
+      svn_repo_path(pathToRepository)
 {
     if( openRepository(pathToRepository) != EXIT_SUCCESS) {
         qCritical() << "Failed to open repository";
@@ -169,56 +530,31 @@ SvnPrivate::SvnPrivate(const QString &pathToRepository)
 
     // get the youngest revision
     svn_fs_youngest_rev(&youngest_rev, fs, global_pool);
+    roots = new RevisionRoots(fs);
 }
 
-SvnPrivate::~SvnPrivate() {}
-
-int SvnPrivate::youngestRevision()
+SvnPrivate::~SvnPrivate()
 {
-    return youngest_rev;
+    delete roots;
+    delete prefetcher;
 }
 
-int SvnPrivate::openRepository(const QString &pathToRepository)
+void SvnPrivate::startPrefetch(int depth, int lastRevision)
 {
-    svn_repos_t *repos;
-    QString path = pathToRepository;
-    while (path.endsWith('/')) // no trailing slash allowed
-        path = path.mid(0, path.length()-1);
-#if SVN_VER_MAJOR == 1 && SVN_VER_MINOR < 9
-    SVN_ERR(svn_repos_open2(&repos, QFile::encodeName(path), NULL, global_pool));
-#else
-    SVN_ERR(svn_repos_open3(&repos, QFile::encodeName(path), NULL, global_pool, scratch_pool));
-#endif
-    fs = svn_repos_fs(repos);
-
-    return EXIT_SUCCESS;
+    delete prefetcher;
+    int threads = qBound(1, QThread::idealThreadCount() - 1, depth);
+    qDebug() << "Prefetching up to" << depth << "revisions ahead with" << threads << "threads";
+    prefetcher = new RevisionPrefetcher(repo_path, depth, threads, qMin<int>(lastRevision, youngest_rev));
 }
 
-enum RuleType { AnyRule = 0, NoIgnoreRule = 0x01, NoRecurseRule = 0x02 };
-
-static MatchRuleList::ConstIterator
-findMatchRule(const MatchRuleList &matchRules, int revnum, const QString &current,
-              int ruleMask = AnyRule)
+int SvnPrivate::youngestRevision()
 {
-    MatchRuleList::ConstIterator it = matchRules.constBegin(),
-                                end = matchRules.constEnd();
-    for ( ; it != end; ++it) {
-        if (it->minRevision > revnum)
-            continue;
-        if (it->maxRevision != -1 && it->maxRevision < revnum)
-            continue;
-        if (it->action == Rules::Match::Ignore && ruleMask & NoIgnoreRule)
-            continue;
-        if (it->action == Rules::Match::Recurse && ruleMask & NoRecurseRule)
-            continue;
-        if (it->rx.indexIn(current) == 0) {
-            Stats::instance()->ruleMatched(*it, revnum);
-            return it;
-        }
-    }
+    return youngest_rev;
+}
 
-    // no match
-    return end;
+int SvnPrivate::openRepository(const QString &pathToRepository)
+{
+    return openFs(&fs, pathToRepository, global_pool, scratch_pool);
 }
 
 static int pathMode(svn_fs_root_t *fs_root, const char *pathname, apr_pool_t *pool)
@@ -235,14 +571,11 @@ static int pathMode(svn_fs_root_t *fs_root, const char *pathname, apr_pool_t *po
 svn_error_t *QIODevice_write(void *baton, const char *data, apr_size_t *len)
 {
     QIODevice *device = reinterpret_cast<QIODevice *>(baton);
-    device->write(data, *len);
-
-    while (device->bytesToWrite() > 32*1024) {
-        if (!device->waitForBytesWritten(-1)) {
-            qFatal("Failed to write to process: %s", qPrintable(device->errorString()));
-            return svn_error_createf(APR_EOF, SVN_NO_ERROR, "Failed to write to process: %s",
-                                     qPrintable(device->errorString()));
-        }
+    // fast-import's writer thread takes care of pacing
+    if (device->write(data, *len) != qint64(*len)) {
+        qFatal("Failed to write to process: %s", qPrintable(device->errorString()));
+        return svn_error_createf(APR_EOF, SVN_NO_ERROR, "Failed to write to process: %s",
+                                 qPrintable(device->errorString()));
     }
     return SVN_NO_ERROR;
 }
@@ -255,9 +588,27 @@ static svn_stream_t *streamForDevice(QIODevice *device, apr_pool_t *pool)
     return stream;
 }
 
+// Hashes the data on its way to fast-import the way git names a blob
+struct BlobWriter
+{
+    QIODevice *device;
+    QCryptographicHash hash;
+
+    BlobWriter(QIODevice *d, qint64 length) : device(d), hash(QCryptographicHash::Sha1)
+    { hash.addData("blob " + QByteArray::number(length) + '\0'); }
+};
+
+static svn_error_t *BlobWriter_write(void *baton, const char *data, apr_size_t *len)
+{
+    BlobWriter *writer = reinterpret_cast<BlobWriter *>(baton);
+    writer->hash.addData(data, *len);
+    return QIODevice_write(writer->device, data, len);
+}
+
 static int dumpBlob(Repository::Transaction *txn, svn_fs_root_t *fs_root,
                     const char *pathname, const QString &finalPathName, apr_pool_t *pool)
 {
+    Metrics::Timer timer(Metrics::DumpBlob);
     AprAutoPool dumppool(pool);
     // what type is it?
     int mode = pathMode(fs_root, pathname, dumppool);
@@ -266,69 +617,92 @@ static int dumpBlob(Repository::Transaction *txn, svn_fs_root_t *fs_root,
 
     SVN_ERR(svn_fs_file_length(&stream_length, fs_root, pathname, dumppool));
 
+    // the SHA-1 svn stored with the representation, if any; it is only
+    // looked up, never computed, so old repositories simply don't dedup
+    QByteArray checksum;
     svn_stream_t *in_stream, *out_stream;
     if (!CommandLineParser::instance()->contains("dry-run")) {
-        // open the file
-        SVN_ERR(svn_fs_file_contents(&in_stream, fs_root, pathname, dumppool));
+        svn_checksum_t *sha1;
+        SVN_ERR(svn_fs_file_checksum(&sha1, svn_checksum_sha1, fs_root, pathname, FALSE, dumppool));
+        if (sha1)
+            checksum = svn_checksum_to_cstring(sha1, dumppool);
     }
 
     // maybe it's a symlink?
     svn_string_t *propvalue;
     SVN_ERR(svn_fs_node_prop(&propvalue, fs_root, pathname, "svn:special", dumppool));
-    if (propvalue) {
+    bool isLink = false;
+    if (propvalue && !CommandLineParser::instance()->contains("dry-run")) {
+        // open the file
+        SVN_ERR(svn_fs_file_contents(&in_stream, fs_root, pathname, dumppool));
+
         apr_size_t len = strlen("link ");
-        if (!CommandLineParser::instance()->contains("dry-run")) {
-            QByteArray buf;
-            buf.reserve(len);
-            SVN_ERR(svn_stream_read_full(in_stream, buf.data(), &len));
-            if (len == strlen("link ") && strncmp(buf, "link ", len) == 0) {
-                mode = 0120000;
-                stream_length -= len;
-            } else {
-                //this can happen if a link changed into a file in one commit
-                qWarning("file %s is svn:special but not a symlink", pathname);
-                // re-open the file as we tried to read "link "
-                svn_stream_close(in_stream);
-                SVN_ERR(svn_fs_file_contents(&in_stream, fs_root, pathname, dumppool));
-            }
+        QByteArray buf;
+        buf.reserve(len);
+        SVN_ERR(svn_stream_read_full(in_stream, buf.data(), &len));
+        if (len == strlen("link ") && strncmp(buf, "link ", len) == 0) {
+            mode = 0120000;
+            stream_length -= len;
+            isLink = true;
+        } else {
+            //this can happen if a link changed into a file in one commit
+            qWarning("file %s is svn:special but not a symlink", pathname);
+            svn_stream_close(in_stream);
         }
     }
 
+    if (!checksum.isEmpty() && txn->addKnownFile(finalPathName, mode, checksum)) {
+        Stats::instance()->blobExported(stream_length, true);
+        return EXIT_SUCCESS;
+    }
+
+    if (!isLink && !CommandLineParser::instance()->contains("dry-run")) {
+        // open the file; symlinks already are, past "link "
+        SVN_ERR(svn_fs_file_contents(&in_stream, fs_root, pathname, dumppool));
+    }
+
     QIODevice *io = txn->addFile(finalPathName, mode, stream_length);
+    Stats::instance()->blobExported(stream_length, false);
 
     if (!CommandLineParser::instance()->contains("dry-run")) {
         // open a generic svn_stream_t for the QIODevice
-        out_stream = streamForDevice(io, dumppool);
+        BlobWriter writer(io, stream_length);
+        if (checksum.isEmpty()) {
+            out_stream = streamForDevice(io, dumppool);
+        } else {
+            out_stream = svn_stream_create(&writer, dumppool);
+            svn_stream_set_write(out_stream, BlobWriter_write);
+        }
         SVN_ERR(svn_stream_copy3(in_stream, out_stream, NULL, NULL, dumppool));
 
         // print an ending newline
         io->putChar('\n');
+
+        if (!checksum.isEmpty())
+            txn->noteFileBlob(mode, checksum, writer.hash.result().toHex());
     }
 
     return EXIT_SUCCESS;
 }
 
-static bool wasDir(svn_fs_t *fs, int revnum, const char *pathname, apr_pool_t *pool)
+static bool wasDir(RevisionRoots *roots, int revnum, const char *pathname)
 {
-    AprAutoPool subpool(pool);
-    svn_fs_root_t *fs_root;
-    if (svn_fs_revision_root(&fs_root, fs, revnum, subpool) != SVN_NO_ERROR)
-        return false;
-
-    svn_boolean_t is_dir;
-    if (svn_fs_is_dir(&is_dir, fs_root, pathname, subpool) != SVN_NO_ERROR)
+    svn_node_kind_t kind;
+    svn_error_t *err = roots->checkPath(&kind, revnum, pathname);
+    if (err != SVN_NO_ERROR) {
+        svn_error_clear(err);
         return false;
-
-    return is_dir;
+    }
+    return kind == svn_node_dir;
 }
 
-static int recursiveDumpDir(Repository::Transaction *txn, svn_fs_t *fs, svn_fs_root_t *fs_root,
+static int recursiveDumpDir(Repository::Transaction *txn, RevisionRoots *roots, svn_fs_root_t *fs_root,
                             const QByteArray &pathname, const QString &finalPathName,
                             apr_pool_t *pool, svn_revnum_t revnum,
                             const Rules::Match &rule, const MatchRuleList &matchRules,
-                            bool ruledebug)
+                            RuleMatchCache &ruleCache, bool ruledebug, bool isDir = false)
 {
-    if (!wasDir(fs, revnum, pathname.data(), pool)) {
+    if (!isDir && !wasDir(roots, revnum, pathname.data())) {
         if (dumpBlob(txn, fs_root, pathname, finalPathName, pool) == EXIT_FAILURE)
             return EXIT_FAILURE;
         return EXIT_SUCCESS;
@@ -361,17 +735,17 @@ static int recursiveDumpDir(Repository::Transaction *txn, svn_fs_t *fs, svn_fs_r
             entryFinalName += '/';
             QString entryNameQString = entryName + '/';
 
-            MatchRuleList::ConstIterator match = findMatchRule(matchRules, revnum, entryNameQString);
-            if (match == matchRules.constEnd()) continue; // no match of parent repo? (should not happen)
+            const RuleMatch match = ruleCache.find(matchRules, revnum, entryNameQString);
+            if (!match.isValid()) continue; // no match of parent repo? (should not happen)
 
-            const Rules::Match &matchedRule = *match;
+            const Rules::Match &matchedRule = match.rule();
             if (matchedRule.action != Rules::Match::Export || matchedRule.repository != rule.repository) {
                 if (ruledebug)
                     qDebug() << "recursiveDumpDir:" << entryNameQString << "skip entry for different/ignored repository";
                 continue;
             }
 
-            if (recursiveDumpDir(txn, fs, fs_root, entryName, entryFinalName, dirpool, revnum, rule, matchRules, ruledebug) == EXIT_FAILURE)
+            if (recursiveDumpDir(txn, roots, fs_root, entryName, entryFinalName, dirpool, revnum, rule, matchRules, ruleCache, ruledebug, true) == EXIT_FAILURE)
                 return EXIT_FAILURE;
         } else if (i.value() == svn_node_file) {
             printf("+");
@@ -384,6 +758,93 @@ static int recursiveDumpDir(Repository::Transaction *txn, svn_fs_t *fs, svn_fs_r
     return EXIT_SUCCESS;
 }
 
+static bool exportsToRepository(const RuleMatch &match, const Rules::Match &rule)
+{
+    return match.isValid() && match.rule().action == Rules::Match::Export
+        && match.rule().repository == rule.repository;
+}
+
+/*
+ * Like recursiveDumpDir, but for a branch whose parent commit is known to
+ * hold exactly from_pathname as of from_revnum, with the rules taking the
+ * whole of both trees into this repository: only what differs between
+ * the two svn trees is sent, and a subdirectory that shares its node with
+ * the source is kept from the parent.
+ */
+static int recursiveDumpDirDiff(Repository::Transaction *txn, RevisionRoots *roots, svn_fs_root_t *fs_root,
+                                const QByteArray &pathname, const QString &finalPathName,
+                                svn_fs_root_t *from_root, const QByteArray &from_pathname,
+                                apr_pool_t *pool, svn_revnum_t revnum,
+                                const Rules::Match &rule, const MatchRuleList &matchRules,
+                                RuleMatchCache &ruleCache, bool ruledebug)
+{
+    apr_hash_t *entries, *from_entries;
+    SVN_ERR(svn_fs_dir_entries(&entries, fs_root, pathname, pool));
+    SVN_ERR(svn_fs_dir_entries(&from_entries, from_root, from_pathname, pool));
+    AprAutoPool dirpool(pool);
+
+    // sorted, for the same reason as in recursiveDumpDir
+    QMap<QByteArray, svn_fs_dirent_t *> map, from_map;
+    for (apr_hash_index_t *i = apr_hash_first(pool, entries); i; i = apr_hash_next(i)) {
+        void *value;
+        apr_hash_this(i, NULL, NULL, &value);
+        svn_fs_dirent_t *dirent = reinterpret_cast<svn_fs_dirent_t *>(value);
+        map.insert(QByteArray(dirent->name), dirent);
+    }
+    for (apr_hash_index_t *i = apr_hash_first(pool, from_entries); i; i = apr_hash_next(i)) {
+        void *value;
+        apr_hash_this(i, NULL, NULL, &value);
+        svn_fs_dirent_t *dirent = reinterpret_cast<svn_fs_dirent_t *>(value);
+        from_map.insert(QByteArray(dirent->name), dirent);
+    }
+
+    QMapIterator<QByteArray, svn_fs_dirent_t *> f(from_map);
+    while (f.hasNext()) {
+        f.next();
+        if (!map.contains(f.key()))
+            txn->deleteFile(finalPathName + QString::fromUtf8(f.key()));
+    }
+
+    QMapIterator<QByteArray, svn_fs_dirent_t *> i(map);
+    while (i.hasNext()) {
+        dirpool.clear();
+        i.next();
+        const svn_fs_dirent_t *dirent = i.value();
+        const svn_fs_dirent_t *from = from_map.value(i.key());
+        QByteArray entryName = pathname + '/' + i.key();
+        QString entryFinalName = finalPathName + QString::fromUtf8(i.key());
+
+        if (from && from->kind == dirent->kind && svn_fs_compare_ids(dirent->id, from->id) == 0) {
+            if (ruledebug)
+                qDebug() << "recursiveDumpDirDiff:" << entryName << "unchanged, kept from parent";
+            continue;
+        }
+        if (dirent->kind == svn_node_dir) {
+            entryFinalName += '/';
+            if (from && from->kind == svn_node_dir) {
+                if (recursiveDumpDirDiff(txn, roots, fs_root, entryName, entryFinalName, from_root,
+                                         from_pathname + '/' + i.key(), dirpool, revnum, rule,
+                                         matchRules, ruleCache, ruledebug) == EXIT_FAILURE)
+                    return EXIT_FAILURE;
+                continue;
+            }
+            if (from)
+                txn->deleteFile(entryFinalName);
+            if (recursiveDumpDir(txn, roots, fs_root, entryName, entryFinalName, dirpool, revnum, rule, matchRules, ruleCache, ruledebug, true) == EXIT_FAILURE)
+                return EXIT_FAILURE;
+        } else if (dirent->kind == svn_node_file) {
+            if (from && from->kind != svn_node_file)
+                txn->deleteFile(entryFinalName);
+            printf("+");
+            fflush(stdout);
+            if (dumpBlob(txn, fs_root, entryName, entryFinalName, dirpool) == EXIT_FAILURE)
+                return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
 time_t get_epoch(const char* svn_date)
 {
     struct tm tm;
@@ -404,6 +865,7 @@ public:
     QString userdomain;
 
     svn_fs_t *fs;
+    RevisionRoots *roots;
     svn_fs_root_t *fs_root;
     int revnum;
 
@@ -425,6 +887,19 @@ public:
     QMap<QString, QSet<QString>> deletions_;
     QMap<QString, QMap<QString, QString>> renames_;
 
+    // Rule decisions and path splits of this revision, shared by all the
+    // entries of a directory.
+    struct SplitPath
+    {
+        QString svnprefix;
+        QString repository;
+        QString effectiveRepository;
+        QString branch;
+        QString prefix;
+    };
+    RuleMatchCache ruleCache;
+    QHash<QPair<const Rules::Match *, Atom>, SplitPath> splitCache;
+
     // There are some handful of mergeinfo changes that are bogus and need to be skipped
     // r306199 - Revert svn:mergeinfo added inadvertantly in last commit r306197
     // r305318 - Handle missed mergeinfo by merging r305031 (the missing revision according to svn merge)
@@ -455,7 +930,7 @@ public:
     // lots more, especially on stable/X branches
 
     SvnRevision(int revision, svn_fs_t *f, apr_pool_t *parent_pool, QString& svn_repo_path)
-        : pool(parent_pool), fs(f), fs_root(0), revnum(revision), propsFetched(false), svn_repo_path(svn_repo_path)
+        : pool(parent_pool), fs(f), roots(0), fs_root(0), revnum(revision), propsFetched(false), svn_repo_path(svn_repo_path)
     {
         ruledebug = CommandLineParser::instance()->contains( QLatin1String("debug-rules"));
     }
@@ -473,11 +948,11 @@ public:
     int exportEntry(const char *key, const svn_fs_path_change2_t *change, apr_hash_t *changes);
     int exportDispatch(const char *key, const svn_fs_path_change2_t *change,
                        const char *path_from, svn_revnum_t rev_from,
-                       apr_hash_t *changes, const QString &current, const Rules::Match &rule,
+                       apr_hash_t *changes, const QString &current, const RuleMatch &match,
                        const MatchRuleList &matchRules, apr_pool_t *pool);
     int exportInternal(const char *key, const svn_fs_path_change2_t *change,
                        const char *path_from, svn_revnum_t rev_from,
-                       const QString &current, const Rules::Match &rule, const MatchRuleList &matchRules);
+                       const QString &current, const RuleMatch &match, const MatchRuleList &matchRules);
     int recurse(const char *path, const svn_fs_path_change2_t *change,
                 const char *path_from, const MatchRuleList &matchRules, svn_revnum_t rev_from,
                 apr_hash_t *changes, apr_pool_t *pool);
@@ -485,17 +960,28 @@ public:
                      svn_fs_root_t *fs_root, Repository::Transaction *txn, const char *content = NULL);
     int fetchIgnoreProps(QString *ignore, apr_pool_t *pool, const char *key, svn_fs_root_t *fs_root);
     int fetchUnknownProps(apr_pool_t *pool, const char *key, svn_fs_root_t *fs_root);
+    bool parentTreeMatches(Repository *repo, const QString &prevbranch, const char *path_from,
+                           svn_revnum_t rev_from, const QString &previous, const QString &current,
+                           const Rules::Match &rule, const MatchRuleList &matchRules,
+                           svn_fs_root_t **from_root);
 private:
-    void splitPathName(const Rules::Match &rule, const QString &pathName, QString *svnprefix_p,
+    void splitPathName(const RuleMatch &match, const QString &pathName, QString *svnprefix_p,
                        QString *repository_p, QString *effectiveRepository_p, QString *branch_p, QString *path_p);
     QString match_path_to_branch(const QString& path);
-    bool maybeParseSimpleMergeinfo(const int revnum, QList<mergeinfo>* mi_list);
+    bool maybeParseSimpleMergeinfo(const int revnum, const QMap<QByteArray, svn_fs_path_change2_t*> &changes,
+                                   QList<mergeinfo>* mi_list);
 };
 
 int SvnPrivate::exportRevision(int revnum)
 {
+    if (prefetcher)
+        prefetcher->advance(revnum);
+
     SvnRevision rev(revnum, fs, global_pool, svn_repo_path);
+    rev.roots = roots;
     rev.allMatchRules = allMatchRules;
+    for (MatchRuleList &matchRules : rev.allMatchRules)
+        matchRules.selectRevision(revnum);
     rev.repositories = repositories;
     rev.identities = identities;
     rev.userdomain = userdomain;
@@ -507,66 +993,86 @@ int SvnPrivate::exportRevision(int revnum)
     if (rev.open() == EXIT_FAILURE)
         return EXIT_FAILURE;
 
-    if (rev.prepareTransactions() == EXIT_FAILURE)
-        return EXIT_FAILURE;
+    {
+        Metrics::Timer timer(Metrics::PrepareTransactions);
+        if (rev.prepareTransactions() == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
 
     if (!rev.needCommit) {
         printf(" nothing to do\n");
         return EXIT_SUCCESS;    // no changes?
     }
 
-    if (rev.commit() == EXIT_FAILURE)
-        return EXIT_FAILURE;
+    {
+        Metrics::Timer timer(Metrics::Commit);
+        if (rev.commit() == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
 
     printf(" done\n");
     return EXIT_SUCCESS;
 }
 
-void SvnRevision::splitPathName(const Rules::Match &rule, const QString &pathName, QString *svnprefix_p,
+void SvnRevision::splitPathName(const RuleMatch &match, const QString &pathName, QString *svnprefix_p,
                                 QString *repository_p, QString *effectiveRepository_p, QString *branch_p, QString *path_p)
 {
-    QString svnprefix = pathName;
-    svnprefix.truncate(rule.rx.matchedLength());
+    const Rules::Match &rule = match.rule();
+    const int prefixLength = match.matchedLength();
+
+    // The substitutions only depend on the rule and the prefix it matched,
+    // which is looked up as an atom so a hit copies no strings.
+    const QPair<const Rules::Match *, Atom> key(&rule, AtomTable::instance()->intern(pathName.constData(), prefixLength));
+    QHash<QPair<const Rules::Match *, Atom>, SplitPath>::const_iterator it = splitCache.constFind(key);
+    if (it == splitCache.constEnd()) {
+        const QString svnprefix = pathName.left(prefixLength);
+        SplitPath split;
+        split.svnprefix = svnprefix;
+        split.repository = svnprefix;
+        split.repository.replace(rule.exactRx, rule.repository);
+        foreach (Rules::Match::Substitution subst, rule.repo_substs) {
+            subst.apply(split.repository);
+        }
+
+        split.effectiveRepository = split.repository;
+        Repository *repository = repositories.value(split.effectiveRepository, 0);
+        if (repository) {
+            split.effectiveRepository = repository->getEffectiveRepository()->getName();
+        }
+
+        split.branch = svnprefix;
+        split.branch.replace(rule.exactRx, rule.branch);
+        foreach (Rules::Match::Substitution subst, rule.branch_substs) {
+            subst.apply(split.branch);
+        }
+
+        split.prefix = svnprefix;
+        split.prefix.replace(rule.exactRx, rule.prefix);
+
+        it = splitCache.insert(key, split);
+    }
 
     if (svnprefix_p) {
-        *svnprefix_p = svnprefix;
+        *svnprefix_p = it->svnprefix;
     }
 
     if (repository_p) {
-        *repository_p = svnprefix;
-        repository_p->replace(rule.rx, rule.repository);
-        foreach (Rules::Match::Substitution subst, rule.repo_substs) {
-            subst.apply(*repository_p);
-        }
+        *repository_p = it->repository;
     }
 
     if (effectiveRepository_p) {
-        *effectiveRepository_p = svnprefix;
-        effectiveRepository_p->replace(rule.rx, rule.repository);
-        foreach (Rules::Match::Substitution subst, rule.repo_substs) {
-            subst.apply(*effectiveRepository_p);
-        }
-        Repository *repository = repositories.value(*effectiveRepository_p, 0);
-        if (repository) {
-            *effectiveRepository_p = repository->getEffectiveRepository()->getName();
-        }
+        *effectiveRepository_p = it->effectiveRepository;
     }
 
     if (branch_p) {
-        *branch_p = svnprefix;
-        branch_p->replace(rule.rx, rule.branch);
-        foreach (Rules::Match::Substitution subst, rule.branch_substs) {
-            subst.apply(*branch_p);
-        }
+        *branch_p = it->branch;
     }
 
     if (path_p) {
-        QString prefix = svnprefix;
-        prefix.replace(rule.rx, rule.prefix);
-        QString suffix = pathName.mid(svnprefix.length());
+        QStringRef suffix = pathName.midRef(prefixLength);
         if (suffix.startsWith(rule.strip))
-            suffix.replace(0, rule.strip.length(), "");
-        *path_p = prefix + suffix;
+            suffix = suffix.mid(rule.strip.length());
+        *path_p = it->prefix % suffix;
     }
 }
 
@@ -576,14 +1082,14 @@ SvnRevision::match_path_to_branch(const QString& path)
     QString branch;
     // There's really just 1 rule file ...
     foreach (const MatchRuleList matchRules, allMatchRules) {
-        MatchRuleList::ConstIterator match = findMatchRule(matchRules, revnum, path);
-        if (match != matchRules.constEnd()) {
-            const Rules::Match &rule = *match;
+        const RuleMatch match = ruleCache.find(matchRules, revnum, path);
+        if (match.isValid()) {
+            const Rules::Match &rule = match.rule();
             QString svnprefix, repository, effectiveRepository, prefix;
             switch (rule.action) {
                 case Rules::Match::Export:
                 case Rules::Match::Recurse:
-                    splitPathName(rule, path, &svnprefix, &repository, &effectiveRepository, &branch, &prefix);
+                    splitPathName(match, path, &svnprefix, &repository, &effectiveRepository, &branch, &prefix);
                     break;
                 case Rules::Match::Ignore:
                     break;
@@ -597,48 +1103,159 @@ SvnRevision::match_path_to_branch(const QString& path)
 }
 
 
+static bool isIgnoredMergeinfoNeighbour(const char *name)
+{
+    // Property changes that commonly ride along with a merge and carry no
+    // information about it.
+    static const QRegularExpression ignored(
+            R"(^(fbsd|svn):(executable|n?o?keywords|notbinary|eol-style|mime-type)$)");
+    return ignored.match(QLatin1String(name)).hasMatch();
+}
+
+static QString rangesToString(svn_rangelist_t *ranges, apr_pool_t *pool)
+{
+    svn_string_t *str;
+    if (svn_rangelist_to_string(&str, ranges, pool) != SVN_NO_ERROR)
+        return QString("?");
+    return QString::fromUtf8(str->data, str->len);
+}
+
+static QString catalogToString(svn_mergeinfo_t catalog, apr_pool_t *pool)
+{
+    QStringList sources;
+    for (apr_hash_index_t *i = apr_hash_first(pool, catalog); i; i = apr_hash_next(i)) {
+        const void *source;
+        void *ranges;
+        apr_hash_this(i, &source, NULL, &ranges);
+        sources << QString::fromUtf8(reinterpret_cast<const char *>(source)) + ":r"
+                   + rangesToString(reinterpret_cast<svn_rangelist_t *>(ranges), pool);
+    }
+    sources.sort();
+    return sources.join(" ");
+}
+
+/*
+ * Classifies the svn:mergeinfo changes of this revision.  For every
+ * changed path, the mergeinfo of the revnum-1 and revnum roots is parsed
+ * and diffed with svn_mergeinfo_diff2().  A path is understood if it adds
+ * one merge source, or takes one away (an svn rollback, which needs no
+ * action), and otherwise only touches properties that do not matter.
+ * Empty and delete-only mergeinfo is skipped.  Anything else is written
+ * to mi/rN.txt for inspection.
+ */
 bool
-SvnRevision::maybeParseSimpleMergeinfo(const int revnum, QList<mergeinfo>* mi_list)
+SvnRevision::maybeParseSimpleMergeinfo(const int revnum, const QMap<QByteArray, svn_fs_path_change2_t*> &changes,
+                                       QList<mergeinfo>* mi_list)
 {
-    QProcess svn;
-    // svn diff -c 179481 --properties-only file:///$PWD/base
-    svn.start("svn",
-            QStringList() << "diff"
-            << "-c" << QString::number(revnum)
-            << "--properties-only" << svn_repo_path);
-
-    if (!svn.waitForFinished(-1)) {
-        fprintf(stderr, "svn fork terminated abnormally for rev %d\n", revnum);
+    Metrics::Timer timer(Metrics::Mergeinfo);
+    AprAutoPool mipool(pool);
+    svn_fs_root_t *prev_root;
+    if (roots->root(&prev_root, revnum - 1) != SVN_NO_ERROR) {
+        fprintf(stderr, "Could not open the root of rev %d\n", revnum - 1);
         exit(1);
     }
 
-    const QString result = QString(svn.readAll()).remove("\\ No newline at end of property\n");
-
-    // If there are N mergeinfo hits, and they all look like so, we have fully
-    // empty mergeinfo and can skip this rev.
-    // Added: svn:mergeinfo
-    // ## -0,0 +0,0 ##
-    // or
-    // Deleted: svn:mergeinfo
-    // ## -0,0 +0,0 ##
-    // see r183713 for an interesting case. Maybe we should just delete all the
-    // above strings?
-    int del_mi = result.count(QRegularExpression(R"(^Deleted: svn:mergeinfo$)", QRegularExpression::MultilineOption));
-    int add_mi = result.count(QRegularExpression(R"(^Added: svn:mergeinfo$)", QRegularExpression::MultilineOption));
-    int diff_mi = result.count(QRegularExpression(R"(^Modified: svn:mergeinfo$)", QRegularExpression::MultilineOption));
-
-    int del_mi_empty = result.count(QRegularExpression(R"(^Deleted: svn:mergeinfo
-## -0,0 \+0,0 ##$)", QRegularExpression::MultilineOption));
-    int add_mi_empty = result.count(QRegularExpression(R"(^Added: svn:mergeinfo
-## -0,0 \+0,0 ##$)", QRegularExpression::MultilineOption));
-    int diff_mi_empty = result.count(QRegularExpression(R"(^Modified: svn:mergeinfo
-## -0,0 \+0,0 ##$)", QRegularExpression::MultilineOption));
+    int del_mi = 0, add_mi = 0, diff_mi = 0;
+    int del_mi_empty = 0, add_mi_empty = 0, diff_mi_empty = 0;
+    bool unparsed = false;
+    QString report;
+    QList<QPair<mergeinfo, QPair<QString, QString> > > merged;
+
+    QMapIterator<QByteArray, svn_fs_path_change2_t*> c(changes);
+    while (c.hasNext()) {
+        c.next();
+        const char *path = c.key().constData();
+        const svn_fs_path_change2_t *change = c.value();
+        if (change->change_kind == svn_fs_path_change_modify && !change->prop_mod)
+            continue;
+
+        // Copies are compared against nothing, as svn diff does.
+        apr_hash_t *old_props = apr_hash_make(mipool);
+        apr_hash_t *new_props = apr_hash_make(mipool);
+        if (change->change_kind != svn_fs_path_change_add
+            && svn_fs_node_proplist(&old_props, prev_root, path, mipool) != SVN_NO_ERROR) {
+            fprintf(stderr, "Could not read the properties of %s in rev %d\n", path, revnum - 1);
+            exit(1);
+        }
+        if (change->change_kind != svn_fs_path_change_delete
+            && svn_fs_node_proplist(&new_props, fs_root, path, mipool) != SVN_NO_ERROR) {
+            fprintf(stderr, "Could not read the properties of %s in rev %d\n", path, revnum);
+            exit(1);
+        }
+
+        apr_array_header_t *diffs;
+        if (svn_prop_diffs(&diffs, new_props, old_props, mipool) != SVN_NO_ERROR)
+            exit(1);
+        for (int i = 0; i < diffs->nelts; ++i) {
+            const svn_prop_t *prop = &APR_ARRAY_IDX(diffs, i, svn_prop_t);
+            if (strcmp(prop->name, SVN_PROP_MERGEINFO) != 0) {
+                if (!isIgnoredMergeinfoNeighbour(prop->name)) {
+                    report += QString("%1: %2 changed\n").arg(QString::fromUtf8(path)).arg(prop->name);
+                    unparsed = true;
+                }
+                continue;
+            }
+
+            const svn_string_t *from = reinterpret_cast<const svn_string_t *>(
+                    apr_hash_get(old_props, SVN_PROP_MERGEINFO, APR_HASH_KEY_STRING));
+            const svn_string_t *to = prop->value;
+            int *counter = !from ? &add_mi : !to ? &del_mi : &diff_mi;
+            int *empty_counter = !from ? &add_mi_empty : !to ? &del_mi_empty : &diff_mi_empty;
+            ++*counter;
+
+            svn_mergeinfo_t from_mi, to_mi, deleted, added;
+            if (svn_mergeinfo_parse(&from_mi, from ? from->data : "", mipool) != SVN_NO_ERROR
+                || svn_mergeinfo_parse(&to_mi, to ? to->data : "", mipool) != SVN_NO_ERROR
+                || svn_mergeinfo_diff2(&deleted, &added, from_mi, to_mi, TRUE,
+                                       mipool, mipool) != SVN_NO_ERROR) {
+                report += QString("%1: unparseable mergeinfo\n").arg(QString::fromUtf8(path));
+                unparsed = true;
+                continue;
+            }
+            report += QString("%1: reverse-merged %2, merged %3\n").arg(QString::fromUtf8(path))
+                .arg(catalogToString(deleted, mipool)).arg(catalogToString(added, mipool));
+
+            const unsigned n_deleted = apr_hash_count(deleted);
+            const unsigned n_added = apr_hash_count(added);
+            if (n_deleted == 0 && n_added == 0) {
+                ++*empty_counter;
+                // Empty mergeinfo being added or dropped is noise, but a
+                // "modification" that changes nothing is not understood.
+                if (from && to)
+                    unparsed = true;
+                continue;
+            }
+            if (!to || n_deleted + n_added > 1) {
+                unparsed = true;
+                continue;
+            }
+            if (n_deleted == 1) {
+                qDebug() << "=== Ignoring SVN rollbacks via mergeinfo";
+                continue;  // parsed ok, but no action to take.
+            }
+
+            apr_hash_index_t *i = apr_hash_first(mipool, added);
+            const void *source;
+            void *value;
+            apr_hash_this(i, &source, NULL, &value);
+            svn_rangelist_t *ranges = reinterpret_cast<svn_rangelist_t *>(value);
+            // Non-inheritable ranges only cover part of the tree.
+            bool inheritable = true;
+            for (int r = 0; r < ranges->nelts; ++r)
+                inheritable = inheritable && APR_ARRAY_IDX(ranges, r, svn_merge_range_t *)->inheritable;
+            if (!inheritable || ranges->nelts == 0) {
+                unparsed = true;
+                continue;
+            }
+            mergeinfo mi;
+            mi.rev = APR_ARRAY_IDX(ranges, ranges->nelts - 1, svn_merge_range_t *)->end;
+            const QString p = QString::fromUtf8(reinterpret_cast<const char *>(source)) + "/";  // Our rules expect a trailing '/'
+            const QString f = QString::fromUtf8(path) + "/";
+            merged.append(qMakePair(mi, qMakePair(p, f)));
+        }
+    }
 
     if ((del_mi+add_mi+diff_mi) == 0) {
-#if 0
-        printf(" ===Skipping non-existant mergeinfo (why are we even here?) on %d=== ", revnum);
-        return true;
-#endif
         qFatal("Something went wrong parsing the mergeinfo!");
     }
 
@@ -653,113 +1270,14 @@ SvnRevision::maybeParseSimpleMergeinfo(const int revnum, QList<mergeinfo>* mi_li
     }
 
     qDebug() << "=START=";
-    qDebug() << qPrintable(result);
+    qDebug() << qPrintable(report);
     qDebug() << "=END=";
     qDebug() << "mergeinfo parsing: del/add/mod=" << del_mi << del_mi_empty << add_mi << add_mi_empty << diff_mi << diff_mi_empty;
-    QString tmp = result;
-
-    // Remove property changes on files/paths that don't have any mergeinfo
-    // changes in them.
-    static QRegularExpression ignore = QRegularExpression(
-           R"(Index: ([\S]+)
-=============*
-... ([\S]+).\([^)]+\)
-... ([\S]+).\([^)]+\)
-
-Property changes on: (?<path>[\S]+)
-_____________*
-((Added|Deleted|Modified): (fbsd|svn):(executable|n?o?keywords|notbinary|eol-style|mime-type)
-## -[\d,]+ \+[\d,]+ ##
-([-+].*){1,2}
-*)+
-(?=Index|$))");
-    if (!ignore.isValid()) {
-        qWarning() << "Error in regular expression" << ignore.errorString();
-        exit(1);
-    }
-    QRegularExpressionMatchIterator i = ignore.globalMatch(result);
-    while (i.hasNext()) {
-        QRegularExpressionMatch match = i.next();
-        qDebug() << "--- matched properties to ignore" << match.captured(0);
-        tmp.remove(match.captured(0)); // eat the input
-    }
-
-    // Remove property changes on files/paths that deleted empty mergeinfo.
-    // This happens about 300 times. (In fact, sometimes empty mergeinfo is
-    // being added.)
-    static QRegularExpression deletere = QRegularExpression(
-           R"(Index: ([\S]+)
-=============*
-... ([\S]+).\([^)]+\)
-... ([\S]+).\([^)]+\)
-
-Property changes on: (?<path>[\S]+)
-_____________*
-(Added|Deleted): svn:mergeinfo
-## -0,0 \+0,0 ##
-*
-(?=Index|$))");
-    if (!deletere.isValid()) {
-        qWarning() << "Error in regular expression" << deletere.errorString();
-        exit(1);
-    }
-    i = deletere.globalMatch(tmp);
-    while (i.hasNext()) {
-        QRegularExpressionMatch match = i.next();
-        qDebug() << "--- matched properties to ignore" << match.captured(0);
-        tmp.remove(match.captured(0)); // eat the input
-    }
-
-    // NOTE: need to use a fully anchored match, otherwise e.g. r238926 gets
-    // handled wrong, as it uses the first mergeinfo to deduce the merge-from,
-    // which is incorrect and off-by-one! r240415 also merges up to 240357 but
-    // ends up with 240326 instead. This reduces the "handled" mergeinfo from
-    // 2000 out of 3000 down to 1125. The rest should be hard-coded.
-    static QRegularExpression mire = QRegularExpression(
-           R"((Index: ([\S]+)
-=============*
-... ([\S]+).\([^)]+\)
-... ([\S]+).\([^)]+\)
-
-Property changes on: (?<path>[\S]+)
-_____________*
-(?<garbage>(Added|Deleted|Modified): (fbsd|svn):(executable|n?o?keywords|eol-style|mime-type)
-## -[\d,]+ \+[\d,]+ ##
-([-+].*
-){1,2})*)*(Modified|Added): svn:mergeinfo
-## \-0,[01] \+0,[01] ##
-   (?<dir>Merged|Reverse-merged) (?<from>[^:]+):r([0-9]*[-,])*(?<rev>[0-9]*)
-*)");
-    if (!mire.isValid()) {
-        qWarning() << "Error in regular expression" << mire.errorString();
-        exit(1);
-    }
-    i = mire.globalMatch(tmp);
-    while (i.hasNext()) {
-        mergeinfo mi;
-        QRegularExpressionMatch match = i.next();
-        if (match.captured(0).isEmpty() || match.captured(0) == "\n") {
-            continue;
-        }
-        qDebug() << "Matched" <<  match.captured(0);
-        if (match.captured("dir") == "Reverse-merged") {
-            qDebug() << "=== Ignoring SVN rollbacks via mergeinfo";
-            tmp.remove(match.captured(0)); // eat the input
-            continue;  // parsed ok, but no action to take.
-        }
-        if (match.captured("dir") == "" && match.captured("garbage") != "") {
-            qDebug() << "=== Ignoring garbage match";
-            tmp.remove(match.captured(0)); // eat the input
-            continue;
-        }
-        qDebug() << "=== Matched properties" <<  match.captured("garbage");
-        qDebug() << "=== Matched path" <<  match.captured("path");
-        qDebug() << "=== Matched dir" <<  match.captured("dir");
-        qDebug() << "=== Matched from" <<  match.captured("from");
-        qDebug() << "=== Matched rev" <<  match.captured("rev");
-        QString f = "/" + match.captured("path") + "/";
-        QString p = match.captured("from") + "/";  // Our rules expect a trailing '/'
-        mi.rev = match.captured("rev").toInt(nullptr, 10);
+
+    for (auto const& entry : merged) {
+        mergeinfo mi = entry.first;
+        const QString& p = entry.second.first;
+        const QString& f = entry.second.second;
         mi.from = match_path_to_branch(p);
         mi.to = match_path_to_branch(f);
         if (!mi.to.isEmpty() && !mi.from.isEmpty()) {
@@ -780,15 +1298,15 @@ _____________*
             if (!mi.to.isEmpty() && !mi.from.isEmpty()) {
                 mi_list->push_back(mi);
             }
-            tmp.remove(match.captured(0)); // eat the input
         } else {
             qDebug("Couldn't parse mergeinfo via rules file for %s or %s", qPrintable(p), qPrintable(f));
+            unparsed = true;
         }
     }
     std::sort(mi_list->begin(), mi_list->end());
-    if (mi_list->size() == 1 && tmp == "") {
+    if (mi_list->size() == 1 && !unparsed) {
         return true;
-    } else if (mi_list->size() > 1 && tmp == "") {
+    } else if (mi_list->size() > 1 && !unparsed) {
         // Special case the 66 cases where vendor/clang + vendor/llvm + lld,
         // openmp, etc. are merged in 1 rev. We want to properly record this,
         // but can't just do it for everything, as there are merges from head
@@ -810,35 +1328,33 @@ _____________*
     if (mi_list->size() > 1) {
         qDebug() << "Got" << mi_list->size() << "different matches:" << *mi_list;
     }
-    if (!tmp.isEmpty()) {
-        qDebug() << "Remaining unparsed MI is" << qPrintable(tmp);
+    if (unparsed) {
+        qDebug() << "Mergeinfo was not fully understood";
     }
     // We parsed everything, but it was probably an SVN rollback.
-    if (tmp.isEmpty() && mi_list->isEmpty()) {
+    if (!unparsed && mi_list->isEmpty()) {
         return true;
     }
 
     QDir dir;
     if (dir.mkpath("mi")) {
-        QProcess svn2;
-        svn2.start("svn",
-                QStringList() << "log"
-                << "-vc" << QString::number(revnum)
-                << svn_repo_path);
-
-        if (!svn2.waitForFinished(-1)) {
-            fprintf(stderr, "svn fork terminated abnormally for rev %d\n", revnum);
-            exit(1);
-        }
-        const QString svn_log = QString(svn2.readAll());
+        fetchRevProps();
 
         // This should create only about 3k files or so.
         QFile file(QString("mi/r%1.txt").arg(revnum));
         if (file.open(QIODevice::WriteOnly | QIODevice::Text)) {
             QTextStream out(&file);
-            out << qPrintable(result);
+            out << qPrintable(report);
             out << "\n";
-            out << qPrintable(svn_log);
+            out << "r" << revnum << "\n";
+            QMapIterator<QByteArray, svn_fs_path_change2_t*> paths(changes);
+            while (paths.hasNext()) {
+                paths.next();
+                static const char actions[] = "MADR";
+                const int kind = paths.value()->change_kind;
+                out << "   " << (kind < 4 ? actions[kind] : '?') << " " << paths.key() << "\n";
+            }
+            out << "\n" << QString::fromUtf8(log) << "\n";
             foreach (mergeinfo mi, *mi_list) {
                 out << "\n { " + QString::number(revnum) + ", { " << mi << " } },";
             }
@@ -1374,7 +1890,7 @@ int SvnRevision::prepareTransactions()
         // There are quite a number of revisions touching many branches and having a
         // "change" in svn:mergeinfo, except it's all empty, e.g. r182326. Try to
         // parse this and silently skip it if the mergeinfo is empty.
-        parse_ok = maybeParseSimpleMergeinfo(revnum, &mi);
+        parse_ok = maybeParseSimpleMergeinfo(revnum, map, &mi);
     }
     if (parse_ok && mi.isEmpty()) {
         // all empty, ignore, this happens when we have -0,0 +0,0 changes
@@ -1617,7 +2133,7 @@ int SvnRevision::exportEntry(const char *key, const svn_fs_path_change2_t *chang
             return EXIT_FAILURE;
         }
     } else if (change->change_kind == svn_fs_path_change_delete) {
-        is_dir = wasDir(fs, revnum - 1, key, revpool);
+        is_dir = wasDir(roots, revnum - 1, key);
     }
 
     if (is_dir)
@@ -1628,10 +2144,9 @@ int SvnRevision::exportEntry(const char *key, const svn_fs_path_change2_t *chang
     bool isHandled = false;
     foreach ( const MatchRuleList matchRules, allMatchRules ) {
         // find the first rule that matches this pathname
-        MatchRuleList::ConstIterator match = findMatchRule(matchRules, revnum, current);
-        if (match != matchRules.constEnd()) {
-            const Rules::Match &rule = *match;
-            if ( exportDispatch(key, change, path_from, rev_from, changes, current, rule, matchRules, revpool) == EXIT_FAILURE )
+        const RuleMatch match = ruleCache.find(matchRules, revnum, current);
+        if (match.isValid()) {
+            if ( exportDispatch(key, change, path_from, rev_from, changes, current, match, matchRules, revpool) == EXIT_FAILURE )
                 return EXIT_FAILURE;
             isHandled = true;
         } else if (is_dir && path_from != NULL) {
@@ -1649,7 +2164,7 @@ int SvnRevision::exportEntry(const char *key, const svn_fs_path_change2_t *chang
     if ( isHandled ) {
         return EXIT_SUCCESS;
     }
-    if (wasDir(fs, revnum - 1, key, revpool)) {
+    if (wasDir(roots, revnum - 1, key)) {
         qDebug() << current << "was a directory; ignoring";
     } else if (change->change_kind == svn_fs_path_change_delete) {
         qDebug() << current << "is being deleted but I don't know anything about it; ignoring";
@@ -1663,8 +2178,9 @@ int SvnRevision::exportEntry(const char *key, const svn_fs_path_change2_t *chang
 int SvnRevision::exportDispatch(const char *key, const svn_fs_path_change2_t *change,
                                 const char *path_from, svn_revnum_t rev_from,
                                 apr_hash_t *changes, const QString &current,
-                                const Rules::Match &rule, const MatchRuleList &matchRules, apr_pool_t *pool)
+                                const RuleMatch &match, const MatchRuleList &matchRules, apr_pool_t *pool)
 {
+    const Rules::Match &rule = match.rule();
     switch (rule.action) {
     case Rules::Match::Ignore:
         if(ruledebug)
@@ -1679,7 +2195,7 @@ int SvnRevision::exportDispatch(const char *key, const svn_fs_path_change2_t *ch
     case Rules::Match::Export:
         if(ruledebug)
             qDebug() << "rev" << revnum << qPrintable(current) << "matched rule:" << rule.info() << "  " << "exporting.";
-        if (exportInternal(key, change, path_from, rev_from, current, rule, matchRules) == EXIT_SUCCESS)
+        if (exportInternal(key, change, path_from, rev_from, current, match, matchRules) == EXIT_SUCCESS)
             return EXIT_SUCCESS;
         if (change->change_kind != svn_fs_path_change_delete) {
             if(ruledebug)
@@ -1696,13 +2212,47 @@ int SvnRevision::exportDispatch(const char *key, const svn_fs_path_change2_t *ch
     return EXIT_FAILURE;
 }
 
+/*
+ * Whether the commit prevbranch has as of rev_from holds exactly what
+ * path_from had then, so that its copy to current can be sent as a diff.
+ * The rules must take the whole of both trees into rule's repository, so
+ * nothing in them was left out or went elsewhere, and no change below
+ * path_from may be newer than that commit.  Opens the source's root in
+ * *from_root.
+ */
+bool SvnRevision::parentTreeMatches(Repository *repo, const QString &prevbranch, const char *path_from,
+                                    svn_revnum_t rev_from, const QString &previous, const QString &current,
+                                    const Rules::Match &rule, const MatchRuleList &matchRules,
+                                    svn_fs_root_t **from_root)
+{
+    RuleMatch match, fromMatch;
+    if (!ruleCache.decides(matchRules, revnum, current, &match) || !exportsToRepository(match, rule)
+        || !ruleCache.decides(matchRules, rev_from, previous, &fromMatch) || !exportsToRepository(fromMatch, rule))
+        return false;
+
+    int commitRevnum = repo->branchCommitRevnum(prevbranch, rev_from);
+    if (commitRevnum == -1)
+        return false;
+
+    svn_revnum_t changed;
+    svn_error_t *err = roots->root(from_root, rev_from);
+    if (!err)
+        err = svn_fs_node_created_rev(&changed, *from_root, path_from, pool);
+    if (err) {
+        svn_error_clear(err);
+        return false;
+    }
+    return changed <= commitRevnum;
+}
+
 int SvnRevision::exportInternal(const char *key, const svn_fs_path_change2_t *change,
                                 const char *path_from, svn_revnum_t rev_from,
-                                const QString &current, const Rules::Match &rule, const MatchRuleList &matchRules)
+                                const QString &current, const RuleMatch &match, const MatchRuleList &matchRules)
 {
+    const Rules::Match &rule = match.rule();
     needCommit = true;
     QString svnprefix, repository, effectiveRepository, branch, path;
-    splitPathName(rule, current, &svnprefix, &repository, &effectiveRepository, &branch, &path);
+    splitPathName(match, current, &svnprefix, &repository, &effectiveRepository, &branch, &path);
 
     to_branches_.insert(branch);
 
@@ -1730,16 +2280,16 @@ int SvnRevision::exportInternal(const char *key, const svn_fs_path_change2_t *ch
 
     if (path_from != NULL) {
         previous = QString::fromUtf8(path_from);
-        if (wasDir(fs, rev_from, path_from, pool.data())) {
+        if (wasDir(roots, rev_from, path_from)) {
             previous += '/';
         }
-        MatchRuleList::ConstIterator prevmatch =
-            findMatchRule(matchRules, rev_from, previous, NoIgnoreRule);
-        if (prevmatch != matchRules.constEnd()) {
-            splitPathName(*prevmatch, previous, &prevsvnprefix, &prevrepository,
+        const RuleMatch prevmatch =
+            ruleCache.find(matchRules, rev_from, previous, NoIgnoreRule);
+        if (prevmatch.isValid()) {
+            splitPathName(prevmatch, previous, &prevsvnprefix, &prevrepository,
                           &preveffectiverepository, &prevbranch, &prevpath);
             if (ruledebug) {
-                //qDebug() << "found prevmatch:" << *prevmatch;
+                //qDebug() << "found prevmatch:" << prevmatch.rule();
             }
             if (preveffectiverepository.isEmpty() || prevrepository.isEmpty()) {
                 qWarning() << "Matching the from of a SVN copy yielded no resulting repository! recurse rule?";
@@ -1852,8 +2402,22 @@ int SvnRevision::exportInternal(const char *key, const svn_fs_path_change2_t *ch
                 }
                 if(ruledebug)
                     qDebug() << "Create a true SVN copy of branch (" << key << "->" << branch << path << ")";
-                txn->deleteFile(path);
-                recursiveDumpDir(txn, fs, fs_root, key, path, pool, revnum, rule, matchRules, ruledebug);
+                // The new branch starts out as the source's commit.  When
+                // that commit is known to hold path_from as of rev_from,
+                // only the differences to it need sending.
+                svn_fs_root_t *from_root;
+                if (rule.branchpoint.isEmpty() && previous == prevsvnprefix && prevpath == path
+                    && preveffectiverepository == effectiveRepository
+                    && parentTreeMatches(repo, prevbranch, path_from, rev_from, previous, current,
+                                         rule, matchRules, &from_root)) {
+                    if (recursiveDumpDirDiff(txn, roots, fs_root, key, path, from_root, path_from,
+                                             pool, revnum, rule, matchRules, ruleCache, ruledebug) == EXIT_FAILURE)
+                        return EXIT_FAILURE;
+                } else {
+                    txn->deleteFile(path);
+                    if (recursiveDumpDir(txn, roots, fs_root, key, path, pool, revnum, rule, matchRules, ruleCache, ruledebug) == EXIT_FAILURE)
+                        return EXIT_FAILURE;
+                }
             }
             if (rule.annotate) {
                 // create an annotated tag
@@ -1979,7 +2543,7 @@ int SvnRevision::exportInternal(const char *key, const svn_fs_path_change2_t *ch
             }
         }
 
-        recursiveDumpDir(txn, fs, fs_root, key, path, pool, revnum, rule, matchRules, ruledebug);
+        recursiveDumpDir(txn, roots, fs_root, key, path, pool, revnum, rule, matchRules, ruleCache, ruledebug);
     }
 
     if (rule.annotate) {
@@ -2034,12 +2598,15 @@ int SvnRevision::recurse(const char *path, const svn_fs_path_change2_t *change,
                          apr_hash_t *changes, apr_pool_t *pool)
 {
     svn_fs_root_t *fs_root = this->fs_root;
-    if (change->change_kind == svn_fs_path_change_delete)
-        SVN_ERR(svn_fs_revision_root(&fs_root, fs, revnum - 1, pool));
+    svn_revnum_t root_revnum = revnum;
+    if (change->change_kind == svn_fs_path_change_delete) {
+        root_revnum = revnum - 1;
+        SVN_ERR(roots->root(&fs_root, root_revnum));
+    }
 
     // get the dir listing
     svn_node_kind_t kind;
-    SVN_ERR(svn_fs_check_path(&kind, fs_root, path, pool));
+    SVN_ERR(roots->checkPath(&kind, root_revnum, path));
     if(kind == svn_node_none) {
         qWarning() << "WARN: Trying to recurse using a nonexistant path" << path << ", ignoring";
         return EXIT_SUCCESS;
@@ -2087,10 +2654,10 @@ int SvnRevision::recurse(const char *path, const svn_fs_path_change2_t *change,
             current += '/';
 
         // find the first rule that matches this pathname
-        MatchRuleList::ConstIterator match = findMatchRule(matchRules, revnum, current);
-        if (match != matchRules.constEnd()) {
+        const RuleMatch match = ruleCache.find(matchRules, revnum, current);
+        if (match.isValid()) {
             if (exportDispatch(entry, change, entryFrom.isNull() ? 0 : entryFrom.constData(),
-                               rev_from, changes, current, *match, matchRules, dirpool) == EXIT_FAILURE)
+                               rev_from, changes, current, match, matchRules, dirpool) == EXIT_FAILURE)
                 return EXIT_FAILURE;
         } else {
             if (i.value() == svn_node_dir) {
@@ -71,6 +71,8 @@ class Svn
 {
 public:
     static void initialize();
+    // times SvnRevision::splitPathName() for --benchmark
+    static void benchmarkSplitPathName(const QList<MatchRuleList> &allMatchRules, const MatchPathList &paths);
 
     Svn(const QString &pathToRepository);
     ~Svn();
@@ -81,6 +83,8 @@ public:
     void setIdentityDomain(const QString &identityDomain);
 
     int youngestRevision();
+    // prefetches no further than lastRevision
+    void startPrefetch(int depth, int lastRevision);
     bool exportRevision(int revnum);
 
 private: